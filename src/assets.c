@@ -0,0 +1,492 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ \********************************************************************/
+
+/** @internal
+  @file assets.c
+  @brief In-memory cache of the files under webroot
+
+  The splash page and the images and pages it uses are read once, at
+  startup and again whenever they change, into ready made microhttpd
+  responses with an ETag and a Cache-Control header.  A file with a
+  gzipped copy next to it, as foo.css.gz, is also sent gzipped to
+  browsers that accept it.  Files too big to keep in memory are only
+  stat'ed, and sent from disk with sendfile.
+
+  The responses own their buffers, so a reload can drop them while
+  connections are still sending them.  Requests only read the table,
+  under a shared lock, so the threads of the server queue them in
+  parallel; a reload takes the lock alone just to swap tables.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <microhttpd.h>
+
+#include "safe.h"
+#include "conf.h"
+#include "debug.h"
+#include "assets.h"
+
+typedef struct {
+	char *url;			/* as requested, e.g. /images/logo.png */
+	char *path;			/* on disk */
+	int public;			/* under imagesdir or pagesdir, served at its url */
+	off_t size;
+	const char *type;
+	const char *cache_control;
+	char etag[40];
+	char *data;			/* owned by plain, NULL when sent from disk */
+	struct MHD_Response *plain;
+	struct MHD_Response *gzip;
+	struct MHD_Response *not_modified;
+} t_asset;
+
+static t_asset *assets = NULL;
+static int assets_count = 0;
+static size_t assets_bytes = 0;
+static unsigned long assets_served = 0, assets_gzipped = 0, assets_not_modified = 0, assets_from_disk = 0;
+
+static volatile sig_atomic_t assets_stale = 0;
+
+static pthread_rwlock_t assets_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static const struct {
+	const char *ext;
+	const char *type;
+} assets_types[] = {
+	{ "html", "text/html; charset=utf-8" },
+	{ "htm", "text/html; charset=utf-8" },
+	{ "css", "text/css" },
+	{ "js", "application/javascript" },
+	{ "json", "application/json" },
+	{ "txt", "text/plain" },
+	{ "png", "image/png" },
+	{ "jpg", "image/jpeg" },
+	{ "jpeg", "image/jpeg" },
+	{ "gif", "image/gif" },
+	{ "svg", "image/svg+xml" },
+	{ "ico", "image/x-icon" },
+	{ "woff", "font/woff" },
+	{ "woff2", "font/woff2" },
+	{ NULL, "application/octet-stream" }
+};
+
+
+/** @internal
+ * The Content-Type of a file, from its extension.
+ */
+static const char *
+_assets_type(const char *name)
+{
+	const char *ext = strrchr(name, '.');
+	int i;
+
+	for (i = 0; assets_types[i].ext; i++) {
+		if (ext && !strcasecmp(ext + 1, assets_types[i].ext))
+			break;
+	}
+	return assets_types[i].type;
+}
+
+/** @internal
+ * Read the whole of path, of size bytes, into a new buffer; NULL if it cannot.
+ */
+static char *
+_assets_read(const char *path, off_t size)
+{
+	char *data;
+	ssize_t got;
+	off_t len = 0;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return NULL;
+	data = safe_malloc(size + 1);
+	while (len < size && (got = read(fd, data + len, size - len)) > 0)
+		len += got;
+	close(fd);
+	if (len != size) {
+		free(data);
+		return NULL;
+	}
+	data[size] = '\0';
+	return data;
+}
+
+/** @internal
+ * A response sending size bytes of data, which it then owns, with the
+ * headers of asset.
+ */
+static struct MHD_Response *
+_assets_response(t_asset *asset, char *data, size_t size, int gzip)
+{
+	struct MHD_Response *response;
+
+	response = MHD_create_response_from_buffer(size, data, MHD_RESPMEM_MUST_FREE);
+	if (!response) {
+		free(data);
+		return NULL;
+	}
+	MHD_add_response_header(response, "Content-Type", asset->type);
+	MHD_add_response_header(response, "ETag", asset->etag);
+	MHD_add_response_header(response, "Cache-Control", asset->cache_control);
+	MHD_add_response_header(response, "Vary", "Accept-Encoding");
+	if (gzip)
+		MHD_add_response_header(response, "Content-Encoding", "gzip");
+	return response;
+}
+
+/** @internal
+ * Add the file name of dir to the assets being built, at url prefix/name.
+ */
+static void
+_assets_add(t_asset **table, int *count, int *allocated, size_t *bytes,
+			const char *dir, const char *prefix, const char *name, int public)
+{
+	t_asset *asset;
+	struct stat st, gz;
+	char *path, *gzpath, *data;
+	size_t len = strlen(name);
+
+	safe_asprintf(&path, "%s/%s", dir, name);
+	if (stat(path, &st) < 0 || !S_ISREG(st.st_mode)) {
+		free(path);
+		return;
+	}
+	/* a gzipped copy goes with its original, if there is one */
+	if (len > 3 && !strcmp(name + len - 3, ".gz")) {
+		path[strlen(path) - 3] = '\0';
+		if (stat(path, &gz) == 0) {
+			free(path);
+			return;
+		}
+		path[strlen(path)] = '.';
+	}
+
+	if (*count == *allocated) {
+		*allocated = *allocated ? 2 * *allocated : 32;
+		*table = safe_realloc(*table, *allocated * sizeof(t_asset));
+	}
+	asset = &(*table)[(*count)++];
+	memset(asset, 0, sizeof(t_asset));
+	safe_asprintf(&asset->url, "%s/%s", prefix, name);
+	asset->path = path;
+	asset->public = public;
+	asset->size = st.st_size;
+	asset->type = _assets_type(name);
+	asset->cache_control = strncmp(asset->type, "text/html", 9) ? ASSETS_CACHE_CONTROL : "no-cache";
+	snprintf(asset->etag, sizeof(asset->etag), "\"%lx-%lx\"", (unsigned long) st.st_mtime, (unsigned long) st.st_size);
+
+	asset->not_modified = MHD_create_response_from_buffer(0, (void *) "", MHD_RESPMEM_PERSISTENT);
+	if (asset->not_modified) {
+		MHD_add_response_header(asset->not_modified, "ETag", asset->etag);
+		MHD_add_response_header(asset->not_modified, "Cache-Control", asset->cache_control);
+	}
+
+	if (st.st_size > ASSETS_MEMORY_MAX || !(data = _assets_read(path, st.st_size))) {
+		return;
+	}
+	if (!(asset->plain = _assets_response(asset, data, st.st_size, 0))) {
+		/* data went with the failed response; the file is sent from disk */
+		return;
+	}
+	asset->data = data;
+	*bytes += st.st_size;
+
+	safe_asprintf(&gzpath, "%s.gz", path);
+	if (stat(gzpath, &gz) == 0 && gz.st_size < st.st_size && (data = _assets_read(gzpath, gz.st_size))) {
+		asset->gzip = _assets_response(asset, data, gz.st_size, 1);
+		*bytes += gz.st_size;
+	}
+	free(gzpath);
+}
+
+/** @internal
+ * Add each file of dir to the assets being built.
+ */
+static void
+_assets_scan(t_asset **table, int *count, int *allocated, size_t *bytes,
+			 const char *dir, const char *prefix, int public)
+{
+	DIR *d;
+	struct dirent *entry;
+
+	if (!(d = opendir(dir))) {
+		debug(LOG_DEBUG, "Could not read assets directory %s: %s", dir, strerror(errno));
+		return;
+	}
+	while ((entry = readdir(d)) != NULL) {
+		if (entry->d_name[0] != '.')
+			_assets_add(table, count, allocated, bytes, dir, prefix, entry->d_name, public);
+	}
+	closedir(d);
+}
+
+/** @internal
+ * Sort order of the assets, by url.
+ */
+static int
+_assets_compare(const void *a, const void *b)
+{
+	return strcmp(((const t_asset *) a)->url, ((const t_asset *) b)->url);
+}
+
+/** @internal
+ * Drop a table of assets; connections still sending one of its
+ * responses keep it until they are done.
+ */
+static void
+_assets_free(t_asset *table, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (table[i].plain)
+			MHD_destroy_response(table[i].plain);
+		if (table[i].gzip)
+			MHD_destroy_response(table[i].gzip);
+		if (table[i].not_modified)
+			MHD_destroy_response(table[i].not_modified);
+		free(table[i].url);
+		free(table[i].path);
+	}
+	free(table);
+}
+
+void
+assets_load(void)
+{
+	s_config *config = config_get_config();
+	t_asset *table = NULL, *old;
+	int count = 0, allocated = 0, old_count;
+	size_t bytes = 0;
+	char *dir, *prefix;
+
+	_assets_scan(&table, &count, &allocated, &bytes, config->webroot, "", 0);
+	safe_asprintf(&dir, "%s/%s", config->webroot, config->imagesdir);
+	safe_asprintf(&prefix, "/%s", config->imagesdir);
+	_assets_scan(&table, &count, &allocated, &bytes, dir, prefix, 1);
+	free(dir);
+	free(prefix);
+	safe_asprintf(&dir, "%s/%s", config->webroot, config->pagesdir);
+	safe_asprintf(&prefix, "/%s", config->pagesdir);
+	_assets_scan(&table, &count, &allocated, &bytes, dir, prefix, 1);
+	free(dir);
+	free(prefix);
+	qsort(table, count, sizeof(t_asset), _assets_compare);
+
+	pthread_rwlock_wrlock(&assets_lock);
+	old = assets;
+	old_count = assets_count;
+	assets = table;
+	assets_count = count;
+	assets_bytes = bytes;
+	pthread_rwlock_unlock(&assets_lock);
+
+	_assets_free(old, old_count);
+	debug(LOG_INFO, "Cached %d assets of %s, %lu bytes in memory", count, config->webroot, (unsigned long) bytes);
+}
+
+void
+assets_refresh(void)
+{
+	assets_stale = 1;
+}
+
+/** @internal
+ * Find the asset at url. Must be called with assets_lock held.
+ */
+static t_asset *
+_assets_find(const char *url)
+{
+	t_asset key;
+
+	if (!assets_count)
+		return NULL;
+	key.url = (char *) url;
+	return bsearch(&key, assets, assets_count, sizeof(t_asset), _assets_compare);
+}
+
+/** @internal
+ * Queue the asset at url: not modified if the browser has it, gzipped
+ * if it takes that, and from disk if it is not in memory.
+ */
+static int
+_assets_queue(struct MHD_Connection *connection, const char *url, int public_only)
+{
+	struct MHD_Response *response;
+	const char *match, *encoding;
+	t_asset *asset;
+	char *path = NULL, etag[40];
+	off_t size = 0;
+	int ret, fd;
+
+	match = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "If-None-Match");
+	encoding = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "Accept-Encoding");
+
+	/* Shared: queueing takes a reference, so the table only has to
+	 * outlive the call, and the counters are bumped atomically */
+	pthread_rwlock_rdlock(&assets_lock);
+	if (!(asset = _assets_find(url)) || (public_only && !asset->public)) {
+		pthread_rwlock_unlock(&assets_lock);
+		return -1;
+	}
+	__sync_add_and_fetch(&assets_served, 1);
+	if (match && asset->not_modified && !strcmp(match, asset->etag)) {
+		__sync_add_and_fetch(&assets_not_modified, 1);
+		ret = MHD_queue_response(connection, MHD_HTTP_NOT_MODIFIED, asset->not_modified);
+	} else if (asset->gzip && encoding && strstr(encoding, "gzip")) {
+		__sync_add_and_fetch(&assets_gzipped, 1);
+		ret = MHD_queue_response(connection, MHD_HTTP_OK, asset->gzip);
+	} else if (asset->plain) {
+		ret = MHD_queue_response(connection, MHD_HTTP_OK, asset->plain);
+	} else {
+		__sync_add_and_fetch(&assets_from_disk, 1);
+		path = safe_strdup(asset->path);
+		size = asset->size;
+		strcpy(etag, asset->etag);
+		ret = MHD_NO;
+	}
+	pthread_rwlock_unlock(&assets_lock);
+
+	if (!path)
+		return ret;
+
+	/* too big for memory, the response sends it with sendfile */
+	fd = open(path, O_RDONLY);
+	free(path);
+	if (fd < 0)
+		return -1;
+	if (!(response = MHD_create_response_from_fd(size, fd))) {
+		close(fd);
+		return MHD_NO;
+	}
+	MHD_add_response_header(response, "Content-Type", _assets_type(url));
+	MHD_add_response_header(response, "ETag", etag);
+	MHD_add_response_header(response, "Cache-Control", ASSETS_CACHE_CONTROL);
+	ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+	MHD_destroy_response(response);
+
+	return ret;
+}
+
+int
+assets_serve(struct MHD_Connection *connection, const char *url)
+{
+	return _assets_queue(connection, url, 1);
+}
+
+int
+assets_serve_page(struct MHD_Connection *connection, const char *name)
+{
+	char url[256];
+
+	snprintf(url, sizeof(url), "/%s", name);
+	return _assets_queue(connection, url, 0);
+}
+
+int
+assets_copy(const char *name, char **data)
+{
+	t_asset *asset;
+	char url[256];
+	int rc = -1;
+
+	snprintf(url, sizeof(url), "/%s", name);
+	pthread_rwlock_rdlock(&assets_lock);
+	if ((asset = _assets_find(url)) && asset->data) {
+		*data = safe_strdup(asset->data);
+		rc = 0;
+	}
+	pthread_rwlock_unlock(&assets_lock);
+
+	return rc;
+}
+
+char *
+assets_text(void)
+{
+	char *text;
+
+	pthread_rwlock_rdlock(&assets_lock);
+	safe_asprintf(&text, "Assets: %d cached, %lu bytes in memory; %lu served, %lu gzipped, %lu not modified, %lu from disk\n",
+				  assets_count, (unsigned long) assets_bytes,
+				  assets_served, assets_gzipped, assets_not_modified, assets_from_disk);
+	pthread_rwlock_unlock(&assets_lock);
+
+	return text;
+}
+
+void
+thread_assets(const void *arg)
+{
+	s_config *config = config_get_config();
+	char buf[4096], *dir;
+	struct pollfd pfd;
+	int changed;
+
+	pfd.events = POLLIN;
+	if ((pfd.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+		debug(LOG_WARNING, "inotify_init1(): %s, assets are only reloaded on SIGHUP", strerror(errno));
+	} else {
+#define ASSETS_EVENTS (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+		inotify_add_watch(pfd.fd, config->webroot, ASSETS_EVENTS);
+		safe_asprintf(&dir, "%s/%s", config->webroot, config->imagesdir);
+		inotify_add_watch(pfd.fd, dir, ASSETS_EVENTS);
+		free(dir);
+		safe_asprintf(&dir, "%s/%s", config->webroot, config->pagesdir);
+		inotify_add_watch(pfd.fd, dir, ASSETS_EVENTS);
+		free(dir);
+	}
+
+	while (1) {
+		changed = 0;
+		if (pfd.fd >= 0 && poll(&pfd, 1, 1000) > 0) {
+			while (read(pfd.fd, buf, sizeof(buf)) > 0)
+				changed = 1;
+		} else if (pfd.fd < 0) {
+			sleep(1);
+		}
+		if (changed) {
+			/* let a copy of several files finish first */
+			usleep(200000);
+			while (pfd.fd >= 0 && read(pfd.fd, buf, sizeof(buf)) > 0)
+				;
+		}
+		if (changed || assets_stale) {
+			assets_stale = 0;
+			assets_load();
+		}
+	}
+}
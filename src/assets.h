@@ -0,0 +1,59 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file assets.h
+    @brief In-memory cache of the files under webroot
+*/
+
+#ifndef _ASSETS_H_
+#define _ASSETS_H_
+
+#include <stddef.h>
+
+struct MHD_Connection;
+
+/** Largest file kept in memory; bigger ones are sent from disk with sendfile */
+#define ASSETS_MEMORY_MAX (256 * 1024)
+
+/** Cache-Control of assets but pages, which are always revalidated */
+#define ASSETS_CACHE_CONTROL "max-age=86400"
+
+/** @brief Read webroot, imagesdir and pagesdir into the cache, replacing what it held */
+void assets_load(void);
+
+/** @brief Have the cache reloaded soon; safe to call from a signal handler */
+void assets_refresh(void);
+
+/** @brief Queue the cached asset at url, if it is under imagesdir or pagesdir; -1 if it is not */
+int assets_serve(struct MHD_Connection *connection, const char *url);
+
+/** @brief Queue the cached page name of webroot; -1 if there is none */
+int assets_serve_page(struct MHD_Connection *connection, const char *name);
+
+/** @brief Copy the cached page name of webroot, NUL terminated, into *data; caller must free. 0 if cached, -1 if not */
+int assets_copy(const char *name, char **data);
+
+/** @brief Counters of the cache as a status line, caller must free */
+char *assets_text(void);
+
+/** @brief Reload the cache when the files change, or on assets_refresh() */
+void thread_assets(const void *arg);
+
+#endif /* _ASSETS_H_ */
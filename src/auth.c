@@ -35,6 +35,7 @@
 #include <sys/socket.h>
 #include <unistd.h>
 #include <syslog.h>
+#include <time.h>
 
 #include "httpd.h"
 #include "http.h"
@@ -46,6 +47,7 @@
 #include "firewall.h"
 #include "client_list.h"
 #include "util.h"
+#include "tc.h"
 
 /* Defined in clientlist.c */
 extern	pthread_mutex_t	client_list_mutex;
@@ -85,6 +87,57 @@ thread_client_timeout_check(const void *arg)
 	}
 }
 
+/** Remove the rules of parked clients whose grace period is over.
+ * Client list must be locked.
+ */
+void
+auth_expire_parked(void)
+{
+	t_client *client, *next;
+	time_t now = time(NULL);
+	int deauth_grace = config_get_config()->deauth_grace;
+
+	for (client = client_get_first_client(); client != NULL; client = next) {
+		next = client->next;
+		if (client->parked && client->parked + deauth_grace <= now) {
+			debug(LOG_NOTICE, "%s %s grace period over, removing parked rules", client->ip, client->mac);
+			iptables_fw_access(AUTH_MAKE_DEAUTHENTICATED, client);
+			client_list_delete(client);
+		}
+	}
+}
+
+/** Launched in its own thread, which always runs, unlike
+ *  thread_client_timeout_check().
+ *  Every AUTH_HOUSEKEEPING_INTERVAL seconds it expires parked clients
+ *  and samples the tc class statistics.
+ *  Every checkinterval seconds it also reconciles the tc classes.
+ */
+void
+thread_fw_housekeeping(const void *arg)
+{
+	s_config *config = config_get_config();
+	time_t reconciled = time(NULL);
+
+	while (1) {
+		LOCK_CLIENT_LIST();
+		auth_expire_parked();
+		UNLOCK_CLIENT_LIST();
+
+		if (config->traffic_control) {
+			tc_stats_update();
+		}
+
+		/* Catch classes left behind or lost by failed tc changes */
+		if (config->traffic_control && time(NULL) - reconciled >= config->checkinterval) {
+			tc_reconcile();
+			reconciled = time(NULL);
+		}
+
+		safe_sleep(AUTH_HOUSEKEEPING_INTERVAL);
+	}
+}
+
 /** Take action on a client.
  * Alter the firewall rules and client list accordingly.
 */
@@ -95,6 +148,8 @@ auth_client_action(char *ip, char *mac, t_authaction action)
 
 	LOCK_CLIENT_LIST();
 
+	auth_expire_parked();
+
 	client = client_list_find(ip,mac);
 
 	/* Client should already have hit the server and be on the client list */
@@ -108,7 +163,13 @@ auth_client_action(char *ip, char *mac, t_authaction action)
 	switch(action) {
 
 	case AUTH_MAKE_AUTHENTICATED:
-		if(client->fw_connection_state != FW_MARK_AUTHENTICATED) {
+		if(client->parked) {
+			/* Rules and tc classes are still in place */
+			client->fw_connection_state = FW_MARK_AUTHENTICATED;
+			iptables_fw_unpark(client);
+			client->parked = 0;
+			authenticated_since_start++;
+		} else if(client->fw_connection_state != FW_MARK_AUTHENTICATED) {
 			client->fw_connection_state = FW_MARK_AUTHENTICATED;
 			iptables_fw_access(AUTH_MAKE_AUTHENTICATED, client);
 			authenticated_since_start++;
@@ -118,7 +179,14 @@ auth_client_action(char *ip, char *mac, t_authaction action)
 		break;
 
 	case AUTH_MAKE_DEAUTHENTICATED:
-		if(client->fw_connection_state == FW_MARK_AUTHENTICATED) {
+		if(client->fw_connection_state == FW_MARK_AUTHENTICATED && config_get_config()->deauth_grace > 0) {
+			/* Keep the rules around in case the client comes straight back */
+			client->fw_connection_state = FW_MARK_PREAUTHENTICATED;
+			iptables_fw_park(client);
+			client->parked = time(NULL);
+			break;
+		}
+		if(client->fw_connection_state == FW_MARK_AUTHENTICATED || client->parked) {
 			iptables_fw_access(AUTH_MAKE_DEAUTHENTICATED, client);
 		}
 		client_list_delete(client);
@@ -130,3 +198,76 @@ auth_client_action(char *ip, char *mac, t_authaction action)
 	UNLOCK_CLIENT_LIST();
 	return;
 }
+
+/** Set the limits in kbit/s of a client, and if it is authenticated
+ * change the rates it is shaped at right away.
+ * Limits of 0 go back to the configured DownloadLimit and UploadLimit.
+ * Returns 0, or -1 if the client is not on the client list or
+ * its tc classes could not be changed.
+ */
+int
+auth_client_rate(char *ip, char *mac, int download_limit, int upload_limit)
+{
+	t_client *client;
+	int rc = 0;
+
+	LOCK_CLIENT_LIST();
+
+	client = client_list_find(ip,mac);
+
+	if (client == NULL) {
+		debug(LOG_ERR, "Client %s %s to rate is not on client list", ip, mac);
+		UNLOCK_CLIENT_LIST();
+		return -1;
+	}
+
+	client->download_limit = download_limit;
+	client->upload_limit = upload_limit;
+
+	/* Classes of parked clients are still in place too */
+	if(client->fw_connection_state == FW_MARK_AUTHENTICATED || client->parked) {
+		rc = iptables_fw_rate(client, client->plan) == 0 ? 0 : -1;
+	}
+
+	UNLOCK_CLIENT_LIST();
+	return rc;
+}
+
+/** Put a client on another traffic control plan. If it is authenticated
+ * or parked, its tc classes move under the class of the new plan.
+ * Returns 0, or -1 if the client is not on the client list or
+ * its tc classes could not be moved.
+ */
+int
+auth_client_plan(char *ip, char *mac, const char *plan)
+{
+	t_client *client;
+	char *old_plan;
+	int rc = 0;
+
+	LOCK_CLIENT_LIST();
+
+	client = client_list_find(ip,mac);
+
+	if (client == NULL) {
+		debug(LOG_ERR, "Client %s %s to put on plan %s is not on client list", ip, mac, plan);
+		UNLOCK_CLIENT_LIST();
+		return -1;
+	}
+
+	if (client->plan && !strcmp(client->plan, plan)) {
+		UNLOCK_CLIENT_LIST();
+		return 0;
+	}
+
+	old_plan = client->plan;
+	client->plan = safe_strdup(plan);
+
+	if(client->fw_connection_state == FW_MARK_AUTHENTICATED || client->parked) {
+		rc = iptables_fw_rate(client, old_plan) == 0 ? 0 : -1;
+	}
+	free(old_plan);
+
+	UNLOCK_CLIENT_LIST();
+	return rc;
+}
@@ -38,7 +38,22 @@ typedef enum {
 /** @brief Take action on a single client */
 void auth_client_action(char *ip, char *mac, t_authaction action);
 
+/** @brief Remove the rules of parked clients whose grace period is over */
+void auth_expire_parked(void);
+
+/** @brief Change the limits of a single client */
+int auth_client_rate(char *ip, char *mac, int download_limit, int upload_limit);
+
+/** @brief Put a single client on another traffic control plan */
+int auth_client_plan(char *ip, char *mac, const char *plan);
+
+/** Seconds between two runs of thread_fw_housekeeping() */
+#define AUTH_HOUSEKEEPING_INTERVAL 10
+
 /** @brief Periodically check if connections expired */
 void thread_client_timeout_check(const void *arg);
 
+/** @brief Periodically expire parked clients, sample and reconcile tc classes */
+void thread_fw_housekeeping(const void *arg);
+
 #endif
@@ -320,6 +320,9 @@ _client_list_free_node(t_client * client)
 	if (client->token != NULL)
 		free(client->token);
 
+	if (client->plan != NULL)
+		free(client->plan);
+
 	if (client_arr[client->idx] == client)
 		client_arr[client->idx] = NULL;
 
@@ -38,6 +38,22 @@ typedef struct _t_counters {
 	time_t	last_updated;	/**< @brief Last update of the counters */
 } t_counters;
 
+/** Statistics of a client's htb class on one shaping device.
+ * Counts are since the client was first seen shaped, the class of a
+ * pool slot may have shaped other clients before.
+ */
+typedef struct _t_tc_stats {
+	unsigned long long	bytes;	/**< @brief Bytes sent by the class */
+	unsigned long	packets;	/**< @brief Packets sent by the class */
+	unsigned long	drops;		/**< @brief Packets dropped by the class */
+	unsigned long	overlimits;	/**< @brief Times the class was held back by its rate */
+	unsigned int	backlog;	/**< @brief Bytes queued at the last update */
+	double	rate;			/**< @brief Moving average of the rate, bytes/s */
+	unsigned long long	class_bytes;	/**< @brief Class counters at the last update */
+	unsigned int	class_packets, class_drops, class_overlimits;
+	time_t	last_updated;	/**< @brief Last update of the statistics, or 0 */
+} t_tc_stats;
+
 /** Client node for the connected client linked list.
  */
 typedef struct	_t_client {
@@ -53,6 +69,11 @@ typedef struct	_t_client {
 	int download_limit;           /**< @brief Download limit, kb/s */
 	int upload_limit;             /**< @brief Upload limit, kb/s */
 	int idx;
+	char *plan;                   /**< @brief Name of the TrafficControlPlan the client is shaped in, or NULL */
+	int offloaded;                /**< @brief Whether the client is in the nft flowtable fast path */
+	time_t parked;                /**< @brief When the client was deauthenticated with its rules kept, or 0 */
+	t_tc_stats tc_download;       /**< @brief Statistics of the client's download class */
+	t_tc_stats tc_upload;         /**< @brief Statistics of the client's upload class */
 } t_client;
 
 /** @brief Get the first element of the list of connected clients
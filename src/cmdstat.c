@@ -0,0 +1,163 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ \********************************************************************/
+
+
+/** @internal
+  @file cmdstat.c
+  @brief Control plane command accounting and dry run
+
+  Counts the processes spawned and the netlink messages sent by each
+  high level firewall operation, and how long it took, so the cost of
+  the control plane can be compared between releases.
+  In dry run mode the commands are only logged, not run.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "safe.h"
+#include "debug.h"
+#include "conf.h"
+#include "cmdstat.h"
+
+/** Totals of one operation */
+typedef struct {
+	unsigned long runs;
+	unsigned long spawns;
+	unsigned long netlink;
+	double msecs;
+	double max_msecs;
+} t_cmdstat;
+
+static const char *cmdstat_names[CMDSTAT_OPS] = {
+	"init", "auth", "deauth", "counters", "destroy"
+};
+
+static t_cmdstat cmdstat_totals[CMDSTAT_OPS];
+
+static pthread_mutex_t cmdstat_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* The operation running on this thread; inner operations count towards it */
+static __thread int cmdstat_depth = 0;
+static __thread t_cmdstat_op cmdstat_op;
+static __thread struct timespec cmdstat_start;
+static __thread unsigned long cmdstat_spawns, cmdstat_netlinks;
+
+
+/** Whether commands are only to be logged, not run */
+int
+cmdstat_dry_run(void)
+{
+	return config_get_config()->dry_run;
+}
+
+/** Start accounting operation op on this thread */
+void
+cmdstat_begin(t_cmdstat_op op)
+{
+	if (cmdstat_depth++ > 0) {
+		return;
+	}
+
+	cmdstat_op = op;
+	cmdstat_spawns = cmdstat_netlinks = 0;
+	clock_gettime(CLOCK_MONOTONIC, &cmdstat_start);
+}
+
+/** Finish the operation started by the matching cmdstat_begin() */
+void
+cmdstat_end(void)
+{
+	struct timespec now;
+	t_cmdstat *t;
+	double msecs;
+
+	if (cmdstat_depth == 0 || --cmdstat_depth > 0) {
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	msecs = (now.tv_sec - cmdstat_start.tv_sec) * 1e3 + (now.tv_nsec - cmdstat_start.tv_nsec) / 1e6;
+
+	pthread_mutex_lock(&cmdstat_mutex);
+	t = &cmdstat_totals[cmdstat_op];
+	t->runs++;
+	t->spawns += cmdstat_spawns;
+	t->netlink += cmdstat_netlinks;
+	t->msecs += msecs;
+	if (msecs > t->max_msecs) {
+		t->max_msecs = msecs;
+	}
+	pthread_mutex_unlock(&cmdstat_mutex);
+
+	debug(LOG_DEBUG, "%s took %.1f ms, %lu processes, %lu netlink messages",
+		  cmdstat_names[cmdstat_op], msecs, cmdstat_spawns, cmdstat_netlinks);
+}
+
+/** Count a process about to be spawned to run cmd */
+void
+cmdstat_spawn(const char *cmd)
+{
+	cmdstat_spawns++;
+
+	if (cmdstat_dry_run()) {
+		debug(LOG_INFO, "Dry run: %s", cmd);
+	}
+}
+
+/** Count a netlink message about to be sent */
+void
+cmdstat_netlink(void)
+{
+	cmdstat_netlinks++;
+}
+
+/** Return the totals of all operations as text, one line each.
+ *  Caller must free.
+ */
+char *
+cmdstat_text(void)
+{
+	char buffer[1024];
+	size_t len = 0;
+	t_cmdstat *t;
+	int op;
+
+	buffer[0] = '\0';
+
+	pthread_mutex_lock(&cmdstat_mutex);
+	for (op = 0; op < CMDSTAT_OPS; op++) {
+		t = &cmdstat_totals[op];
+		snprintf((buffer + len), (sizeof(buffer) - len),
+				 "  %-9s %lu runs; processes: %lu; netlink: %lu; avg: %.1f ms; max: %.1f ms\n",
+				 cmdstat_names[op], t->runs, t->spawns, t->netlink,
+				 t->runs ? t->msecs / t->runs : 0.0, t->max_msecs);
+		len = strlen(buffer);
+	}
+	pthread_mutex_unlock(&cmdstat_mutex);
+
+	return safe_strdup(buffer);
+}
@@ -0,0 +1,56 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file cmdstat.h
+    @brief Control plane command accounting and dry run
+*/
+
+#ifndef _CMDSTAT_H_
+#define _CMDSTAT_H_
+
+/** High level operations whose cost is accounted */
+typedef enum {
+	CMDSTAT_INIT,		/**< @brief fw_init() */
+	CMDSTAT_AUTH,		/**< @brief Authenticating or unparking a client */
+	CMDSTAT_DEAUTH,		/**< @brief Deauthenticating or parking a client */
+	CMDSTAT_COUNTERS,	/**< @brief iptables_fw_counters_update() */
+	CMDSTAT_DESTROY,	/**< @brief fw_destroy() */
+	CMDSTAT_OPS
+} t_cmdstat_op;
+
+/** @brief Whether commands are only logged, not run */
+int cmdstat_dry_run(void);
+
+/** @brief Start accounting an operation on this thread */
+void cmdstat_begin(t_cmdstat_op op);
+
+/** @brief Finish accounting the operation of this thread */
+void cmdstat_end(void);
+
+/** @brief Count a process spawned to run a command */
+void cmdstat_spawn(const char *cmd);
+
+/** @brief Count a netlink message sent */
+void cmdstat_netlink(void);
+
+/** @brief Totals of all operations as text, caller must free */
+char *cmdstat_text(void);
+
+#endif /* _CMDSTAT_H_ */
@@ -51,6 +51,7 @@ usage(void)
 	printf("  -f            Run in foreground\n");
 	printf("  -d <level>    Debug level\n");
 	printf("  -s            Log to syslog\n");
+	printf("  -n            Dry run, log firewall and tc commands instead of running them\n");
 	printf("  -w <path>     Ndsctl socket path\n");
 	printf("  -h            Print usage\n");
 	printf("  -v            Print version information\n");
@@ -66,7 +67,7 @@ void parse_commandline(int argc, char **argv)
 
 	s_config *config = config_get_config();
 
-	while (-1 != (c = getopt(argc, argv, "c:hfd:sw:vi:"))) {
+	while (-1 != (c = getopt(argc, argv, "c:hfd:snw:vi:"))) {
 
 		switch(c) {
 
@@ -102,6 +103,10 @@ void parse_commandline(int argc, char **argv)
 			config->log_syslog = 1;
 			break;
 
+		case 'n':
+			config->dry_run = 1;
+			break;
+
 		case 'v':
 			printf("This is nodogsplash version " VERSION "\n");
 			exit(1);
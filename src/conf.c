@@ -76,6 +76,20 @@ typedef enum {
 	oGatewayAddress,
 	oGatewayPort,
 	oRemoteAuthenticatorAction,
+	oHttpThreads,
+	oHttpListenMode,
+	oHttpMaxConnections,
+	oHttpMaxConnectionsPerIP,
+	oHttpConnectionMemory,
+	oHttpTimeout,
+	oHttpTransparent,
+	oHttpsPreauth,
+	oAdmissionCacheTime,
+	oAdmissionNegativeCacheTime,
+	oCloudFallback,
+	oCloudFallbackTime,
+	oCloudBreakerCooldown,
+	oCloudSlowRequest,
 	oEnablePreAuth,
 	oBinVoucher,
 	oForceVoucher,
@@ -97,8 +111,18 @@ typedef enum {
 	oSetMSS,
 	oMSSValue,
 	oTrafficControl,
+	oTrafficControlMode,
+	oTrafficControlQdisc,
+	oTrafficControlPool,
+	oFlowOffload,
+	oWalledGarden,
+	oWalledGardenSnoop,
+	oDeauthGracePeriod,
 	oDownloadLimit,
 	oUploadLimit,
+	oUplinkDownloadRate,
+	oUplinkUploadRate,
+	oTrafficControlPlan,
 	oDownloadIMQ,
 	oUploadIMQ,
 	oNdsctlSocket,
@@ -133,6 +157,20 @@ static const struct {
 	{ "gatewayaddress", oGatewayAddress },
 	{ "gatewayport", oGatewayPort },
 	{ "remoteauthenticatoraction", oRemoteAuthenticatorAction },
+	{ "httpthreads", oHttpThreads },
+	{ "httplistenmode", oHttpListenMode },
+	{ "httpmaxconnections", oHttpMaxConnections },
+	{ "httpmaxconnectionsperip", oHttpMaxConnectionsPerIP },
+	{ "httpconnectionmemory", oHttpConnectionMemory },
+	{ "httptimeout", oHttpTimeout },
+	{ "httptransparent", oHttpTransparent },
+	{ "httpspreauth", oHttpsPreauth },
+	{ "admissioncachetime", oAdmissionCacheTime },
+	{ "admissionnegativecachetime", oAdmissionNegativeCacheTime },
+	{ "cloudfallback", oCloudFallback },
+	{ "cloudfallbacktime", oCloudFallbackTime },
+	{ "cloudbreakercooldown", oCloudBreakerCooldown },
+	{ "cloudslowrequest", oCloudSlowRequest },
 	{ "enablepreauth", oEnablePreAuth },
 	{ "binvoucher", oBinVoucher },
 	{ "forcevoucher", oForceVoucher },
@@ -153,8 +191,18 @@ static const struct {
 	{ "setmss", oSetMSS },
 	{ "mssvalue", oMSSValue },
 	{ "trafficcontrol",	oTrafficControl },
+	{ "trafficcontrolmode",	oTrafficControlMode },
+	{ "trafficcontrolqdisc",	oTrafficControlQdisc },
+	{ "trafficcontrolpool",	oTrafficControlPool },
+	{ "flowoffload",	oFlowOffload },
+	{ "walledgarden",	oWalledGarden },
+	{ "walledgardensnoop",	oWalledGardenSnoop },
+	{ "deauthgraceperiod",	oDeauthGracePeriod },
 	{ "downloadlimit", oDownloadLimit },
 	{ "uploadlimit", oUploadLimit },
+	{ "uplinkdownloadrate", oUplinkDownloadRate },
+	{ "uplinkuploadrate", oUplinkUploadRate },
+	{ "trafficcontrolplan", oTrafficControlPlan },
 	{ "downloadimq", oDownloadIMQ },
 	{ "uploadimq", oUploadIMQ },
 	{ "syslogfacility", oSyslogFacility },
@@ -179,6 +227,7 @@ static void config_notnull(const void *parm, const char *parmname);
 static int parse_boolean_value(char *);
 static int _parse_firewall_rule(t_firewall_ruleset *ruleset, char *leftover);
 static void parse_firewall_ruleset(const char *, FILE *, const char *, int *);
+static int parse_tc_plan(char *);
 
 static OpCodes config_parse_opcode(const char *cp, const char *filename, int linenum);
 
@@ -216,6 +265,20 @@ config_init(void)
 	config.gw_address = NULL;
 	config.gw_port = DEFAULT_GATEWAYPORT;
 	config.remote_auth_action = NULL;
+	config.http_threads = DEFAULT_HTTP_THREADS;
+	config.http_listen_mode = DEFAULT_HTTP_LISTEN_MODE;
+	config.http_max_connections = DEFAULT_HTTP_MAX_CONNECTIONS;
+	config.http_max_connections_per_ip = DEFAULT_HTTP_MAX_CONNECTIONS_PER_IP;
+	config.http_connection_memory = DEFAULT_HTTP_CONNECTION_MEMORY;
+	config.http_timeout = DEFAULT_HTTP_TIMEOUT;
+	config.http_transparent = DEFAULT_HTTP_TRANSPARENT;
+	config.https_preauth = DEFAULT_HTTPS_PREAUTH;
+	config.admission_cache_time = DEFAULT_ADMISSION_CACHE_TIME;
+	config.admission_negative_cache_time = DEFAULT_ADMISSION_NEGATIVE_CACHE_TIME;
+	config.cloud_fallback = DEFAULT_CLOUD_FALLBACK;
+	config.cloud_fallback_time = DEFAULT_CLOUD_FALLBACK_TIME;
+	config.cloud_breaker_cooldown = DEFAULT_CLOUD_BREAKER_COOLDOWN;
+	config.cloud_slow_request = DEFAULT_CLOUD_SLOW_REQUEST;
 	config.webroot = DEFAULT_WEBROOT;
 	config.splashpage = DEFAULT_SPLASHPAGE;
 	config.infoskelpage = DEFAULT_INFOSKELPAGE;
@@ -237,12 +300,23 @@ config_init(void)
 	config.set_mss = DEFAULT_SET_MSS;
 	config.mss_value = DEFAULT_MSS_VALUE;
 	config.traffic_control = DEFAULT_TRAFFIC_CONTROL;
+	config.tc_mode = DEFAULT_TC_MODE;
+	config.tc_qdisc = DEFAULT_TC_QDISC;
+	config.tc_pool = DEFAULT_TC_POOL;
+	config.flow_offload = DEFAULT_FLOW_OFFLOAD;
+	config.walled_garden = DEFAULT_WALLED_GARDEN;
+	config.walled_garden_snoop = DEFAULT_WALLED_GARDEN_SNOOP;
+	config.deauth_grace = DEFAULT_DEAUTH_GRACE;
 	config.upload_limit =  DEFAULT_UPLOAD_LIMIT;
 	config.download_limit = DEFAULT_DOWNLOAD_LIMIT;
+	config.uplink_download_rate = DEFAULT_UPLINK_DOWNLOAD_RATE;
+	config.uplink_upload_rate = DEFAULT_UPLINK_UPLOAD_RATE;
+	config.tc_plans = NULL;
 	config.upload_imq =  DEFAULT_UPLOAD_IMQ;
 	config.download_imq = DEFAULT_DOWNLOAD_IMQ;
 	config.syslog_facility = DEFAULT_SYSLOG_FACILITY;
 	config.log_syslog = DEFAULT_LOG_SYSLOG;
+	config.dry_run = DEFAULT_DRY_RUN;
 	config.ndsctl_sock = safe_strdup(DEFAULT_NDSCTL_SOCK);
 	config.internal_sock = safe_strdup(DEFAULT_INTERNAL_SOCK);
 	config.rulesets = NULL;
@@ -757,6 +831,109 @@ config_read(const char *filename)
 		case oRemoteAuthenticatorAction:
 			config.remote_auth_action = safe_strdup(p1);
 			break;
+		case oAdmissionCacheTime:
+			if(sscanf(p1, "%d", &config.admission_cache_time) < 1 || config.admission_cache_time < 0) {
+				debug(LOG_ERR, "Bad arg %s to option %s on line %d in %s", p1, s, linenum, filename);
+				debug(LOG_ERR, "Exiting...");
+				exit(-1);
+			}
+			break;
+		case oAdmissionNegativeCacheTime:
+			if(sscanf(p1, "%d", &config.admission_negative_cache_time) < 1 || config.admission_negative_cache_time < 0) {
+				debug(LOG_ERR, "Bad arg %s to option %s on line %d in %s", p1, s, linenum, filename);
+				debug(LOG_ERR, "Exiting...");
+				exit(-1);
+			}
+			break;
+		case oHttpThreads:
+			if(sscanf(p1, "%d", &config.http_threads) < 1 || config.http_threads < 0) {
+				debug(LOG_ERR, "Bad arg %s to option %s on line %d in %s", p1, s, linenum, filename);
+				debug(LOG_ERR, "Exiting...");
+				exit(-1);
+			}
+			break;
+		case oHttpListenMode:
+			if(!strcasecmp("pool",p1)) config.http_listen_mode = HTTP_LISTEN_POOL;
+			else if(!strcasecmp("reuseport",p1)) config.http_listen_mode = HTTP_LISTEN_REUSEPORT;
+			else {
+				debug(LOG_ERR, "Bad arg %s to option %s on line %d in %s", p1, s, linenum, filename);
+				debug(LOG_ERR, "Exiting...");
+				exit(-1);
+			}
+			break;
+		case oHttpMaxConnections:
+			if(sscanf(p1, "%d", &config.http_max_connections) < 1 || config.http_max_connections < 0) {
+				debug(LOG_ERR, "Bad arg %s to option %s on line %d in %s", p1, s, linenum, filename);
+				debug(LOG_ERR, "Exiting...");
+				exit(-1);
+			}
+			break;
+		case oHttpMaxConnectionsPerIP:
+			if(sscanf(p1, "%d", &config.http_max_connections_per_ip) < 1 || config.http_max_connections_per_ip < 0) {
+				debug(LOG_ERR, "Bad arg %s to option %s on line %d in %s", p1, s, linenum, filename);
+				debug(LOG_ERR, "Exiting...");
+				exit(-1);
+			}
+			break;
+		case oHttpConnectionMemory:
+			if(sscanf(p1, "%d", &config.http_connection_memory) < 1 || config.http_connection_memory < 0) {
+				debug(LOG_ERR, "Bad arg %s to option %s on line %d in %s", p1, s, linenum, filename);
+				debug(LOG_ERR, "Exiting...");
+				exit(-1);
+			}
+			break;
+		case oHttpTimeout:
+			if(sscanf(p1, "%d", &config.http_timeout) < 1 || config.http_timeout < 1) {
+				debug(LOG_ERR, "Bad arg %s to option %s on line %d in %s", p1, s, linenum, filename);
+				debug(LOG_ERR, "Exiting...");
+				exit(-1);
+			}
+			break;
+		case oHttpTransparent:
+			value = parse_boolean_value(p1);
+			if (value != - 1)
+				config.http_transparent = value;
+			break;
+		case oHttpsPreauth:
+			if(!strcasecmp("proxy",p1)) config.https_preauth = HTTPS_PREAUTH_PROXY;
+			else if(!strcasecmp("peek",p1)) config.https_preauth = HTTPS_PREAUTH_PEEK;
+			else if(!strcasecmp("reject",p1)) config.https_preauth = HTTPS_PREAUTH_REJECT;
+			else {
+				debug(LOG_ERR, "Bad arg %s to option %s on line %d in %s", p1, s, linenum, filename);
+				debug(LOG_ERR, "Exiting...");
+				exit(-1);
+			}
+			break;
+		case oCloudFallback:
+			if(!strcasecmp("splash",p1)) config.cloud_fallback = CLOUD_FALLBACK_SPLASH;
+			else if(!strcasecmp("grant",p1)) config.cloud_fallback = CLOUD_FALLBACK_GRANT;
+			else {
+				debug(LOG_ERR, "Bad arg %s to option %s on line %d in %s", p1, s, linenum, filename);
+				debug(LOG_ERR, "Exiting...");
+				exit(-1);
+			}
+			break;
+		case oCloudFallbackTime:
+			if(sscanf(p1, "%d", &config.cloud_fallback_time) < 1 || config.cloud_fallback_time < 1) {
+				debug(LOG_ERR, "Bad arg %s to option %s on line %d in %s", p1, s, linenum, filename);
+				debug(LOG_ERR, "Exiting...");
+				exit(-1);
+			}
+			break;
+		case oCloudBreakerCooldown:
+			if(sscanf(p1, "%d", &config.cloud_breaker_cooldown) < 1 || config.cloud_breaker_cooldown < 1) {
+				debug(LOG_ERR, "Bad arg %s to option %s on line %d in %s", p1, s, linenum, filename);
+				debug(LOG_ERR, "Exiting...");
+				exit(-1);
+			}
+			break;
+		case oCloudSlowRequest:
+			if(sscanf(p1, "%d", &config.cloud_slow_request) < 1 || config.cloud_slow_request < 1) {
+				debug(LOG_ERR, "Bad arg %s to option %s on line %d in %s", p1, s, linenum, filename);
+				debug(LOG_ERR, "Exiting...");
+				exit(-1);
+			}
+			break;
 		case oEnablePreAuth:
 			value = parse_boolean_value(p1);
 			if (value != - 1)
@@ -894,6 +1071,67 @@ config_read(const char *filename)
 				exit(-1);
 			}
 			break;
+		case oTrafficControlMode:
+			if(!strcasecmp("imq",p1)) config.tc_mode = TC_MODE_IMQ;
+			else if(!strcasecmp("ifb",p1)) config.tc_mode = TC_MODE_IFB;
+			else {
+				debug(LOG_ERR, "Bad arg %s to option %s on line %d in %s", p1, s, linenum, filename);
+				debug(LOG_ERR, "Exiting...");
+				exit(-1);
+			}
+			break;
+		case oTrafficControlQdisc:
+			if(!strcasecmp("htb",p1)) config.tc_qdisc = TC_QDISC_HTB;
+			else if(!strcasecmp("cake",p1)) config.tc_qdisc = TC_QDISC_CAKE;
+			else {
+				debug(LOG_ERR, "Bad arg %s to option %s on line %d in %s", p1, s, linenum, filename);
+				debug(LOG_ERR, "Exiting...");
+				exit(-1);
+			}
+			break;
+		case oTrafficControlPool:
+			if ((value = parse_boolean_value(p1)) != -1) {
+				config.tc_pool = value;
+			} else {
+				debug(LOG_ERR, "Bad arg %s to option %s on line %d in %s", p1, s, linenum, filename);
+				debug(LOG_ERR, "Exiting...");
+				exit(-1);
+			}
+			break;
+		case oFlowOffload:
+			if ((value = parse_boolean_value(p1)) != -1) {
+				config.flow_offload = value;
+			} else {
+				debug(LOG_ERR, "Bad arg %s to option %s on line %d in %s", p1, s, linenum, filename);
+				debug(LOG_ERR, "Exiting...");
+				exit(-1);
+			}
+			break;
+		case oWalledGarden:
+			if ((value = parse_boolean_value(p1)) != -1) {
+				config.walled_garden = value;
+			} else {
+				debug(LOG_ERR, "Bad arg %s to option %s on line %d in %s", p1, s, linenum, filename);
+				debug(LOG_ERR, "Exiting...");
+				exit(-1);
+			}
+			break;
+		case oWalledGardenSnoop:
+			if ((value = parse_boolean_value(p1)) != -1) {
+				config.walled_garden_snoop = value;
+			} else {
+				debug(LOG_ERR, "Bad arg %s to option %s on line %d in %s", p1, s, linenum, filename);
+				debug(LOG_ERR, "Exiting...");
+				exit(-1);
+			}
+			break;
+		case oDeauthGracePeriod:
+			if(sscanf(p1, "%d", &config.deauth_grace) < 1 || config.deauth_grace < 0) {
+				debug(LOG_ERR, "Bad arg %s to option %s on line %d in %s", p1, s, linenum, filename);
+				debug(LOG_ERR, "Exiting...");
+				exit(-1);
+			}
+			break;
 		case oDownloadLimit:
 			if(sscanf(p1, "%d", &config.download_limit) < 1) {
 				debug(LOG_ERR, "Bad arg %s to option %s on line %d in %s", p1, s, linenum, filename);
@@ -908,6 +1146,27 @@ config_read(const char *filename)
 				exit(-1);
 			}
 			break;
+		case oUplinkDownloadRate:
+			if(sscanf(p1, "%d", &config.uplink_download_rate) < 1) {
+				debug(LOG_ERR, "Bad arg %s to option %s on line %d in %s", p1, s, linenum, filename);
+				debug(LOG_ERR, "Exiting...");
+				exit(-1);
+			}
+			break;
+		case oUplinkUploadRate:
+			if(sscanf(p1, "%d", &config.uplink_upload_rate) < 1) {
+				debug(LOG_ERR, "Bad arg %s to option %s on line %d in %s", p1, s, linenum, filename);
+				debug(LOG_ERR, "Exiting...");
+				exit(-1);
+			}
+			break;
+		case oTrafficControlPlan:
+			if(parse_tc_plan(p1) != 0) {
+				debug(LOG_ERR, "Bad arg %s to option %s on line %d in %s", p1, s, linenum, filename);
+				debug(LOG_ERR, "Exiting...");
+				exit(-1);
+			}
+			break;
 		case oDownloadIMQ:
 			if(sscanf(p1, "%d", &config.download_imq) < 1) {
 				debug(LOG_ERR, "Bad arg %s to option %s on line %d in %s", p1, s, linenum, filename);
@@ -1044,6 +1303,53 @@ int add_to_trusted_mac_list(char *possiblemac)
 }
 
 
+/** @internal
+ * Parse "name downloadrate uploadrate [downloadceil uploadceil]" and
+ * append the plan to the config's list, keeping the config file order.
+ * Return 0 on success, -1 on a bad or duplicate plan.
+ */
+static int
+parse_tc_plan(char *line)
+{
+	t_tc_plan *plan, **p;
+	char name[32];
+	int n, count = 0;
+
+	plan = safe_malloc(sizeof(t_tc_plan));
+	memset(plan, 0, sizeof(t_tc_plan));
+
+	n = sscanf(line, "%31s %d %d %d %d", name, &plan->download_rate, &plan->upload_rate,
+			   &plan->download_ceil, &plan->upload_ceil);
+	if (n == 3) {
+		plan->download_ceil = plan->download_rate;
+		plan->upload_ceil = plan->upload_rate;
+	}
+	if ((n != 3 && n != 5) || plan->download_rate <= 0 || plan->upload_rate <= 0
+			|| plan->download_ceil < plan->download_rate || plan->upload_ceil < plan->upload_rate) {
+		free(plan);
+		return -1;
+	}
+
+	for (p = &config.tc_plans; *p != NULL; p = &(*p)->next) {
+		if (!strcmp((*p)->name, name)) {
+			debug(LOG_ERR, "Traffic control plan %s defined twice", name);
+			free(plan);
+			return -1;
+		}
+		count++;
+	}
+	if (count >= TC_MAX_PLANS) {
+		debug(LOG_ERR, "Too many traffic control plans, at most %d", TC_MAX_PLANS);
+		free(plan);
+		return -1;
+	}
+
+	plan->name = safe_strdup(name);
+	*p = plan;
+	debug(LOG_INFO, "Added traffic control plan %s", name);
+	return 0;
+}
+
 /* Remove given MAC address from the config's trusted mac list.
  * Return 0 on success, nonzero on failure
  */
@@ -40,6 +40,18 @@
 #define EXT_INTERFACE_DETECT_RETRY_INTERVAL 1
 #define MAC_ALLOW 0 /** macmechanism to block MAC's unless allowed */
 #define MAC_BLOCK 1 /** macmechanism to allow MAC's unless blocked */
+#define TC_MODE_IMQ 0 /** tc_mode shaping on IMQ devices */
+#define TC_MODE_IFB 1 /** tc_mode shaping on the gateway interface and an ifb */
+#define TC_QDISC_HTB 0 /** tc_qdisc with an htb class per client */
+#define TC_QDISC_CAKE 1 /** tc_qdisc with one cake qdisc isolating hosts */
+#define TC_MAX_PLANS 9 /** htb plan classes fit between the default class and the client classes */
+#define CLOUD_FALLBACK_SPLASH 0 /** cloud_fallback serving the local splash page */
+#define CLOUD_FALLBACK_GRANT 1 /** cloud_fallback authenticating the client for cloud_fallback_time */
+#define HTTP_LISTEN_POOL 0 /** http_listen_mode with one listening socket shared by a pool of threads */
+#define HTTP_LISTEN_REUSEPORT 1 /** http_listen_mode with a SO_REUSEPORT listening socket per thread */
+#define HTTPS_PREAUTH_PROXY 0 /** https_preauth redirecting to whatever listens on SSL_PORT */
+#define HTTPS_PREAUTH_PEEK 1 /** https_preauth redirecting to thread_sni, which reads the server name and resets */
+#define HTTPS_PREAUTH_REJECT 2 /** https_preauth rejecting with a tcp reset in the firewall */
 
 /** Defaults configuration values */
 #ifndef SYSCONFDIR
@@ -55,6 +67,20 @@
 #define DEFAULT_GATEWAYNAME "NoDogSplash"
 #define DEFAULT_GATEWAYPORT 2050
 #define DEFAULT_REMOTE_AUTH_PORT 80
+#define DEFAULT_HTTP_THREADS 1
+#define DEFAULT_HTTP_LISTEN_MODE HTTP_LISTEN_POOL
+#define DEFAULT_HTTP_MAX_CONNECTIONS 0
+#define DEFAULT_HTTP_MAX_CONNECTIONS_PER_IP 0
+#define DEFAULT_HTTP_CONNECTION_MEMORY 0
+#define DEFAULT_HTTP_TIMEOUT 10
+#define DEFAULT_HTTP_TRANSPARENT 0
+#define DEFAULT_HTTPS_PREAUTH HTTPS_PREAUTH_PROXY
+#define DEFAULT_ADMISSION_CACHE_TIME 60
+#define DEFAULT_ADMISSION_NEGATIVE_CACHE_TIME 10
+#define DEFAULT_CLOUD_FALLBACK CLOUD_FALLBACK_SPLASH
+#define DEFAULT_CLOUD_FALLBACK_TIME 600
+#define DEFAULT_CLOUD_BREAKER_COOLDOWN 30
+#define DEFAULT_CLOUD_SLOW_REQUEST 2000
 #define DEFAULT_CHECKINTERVAL 60
 #define DEFAULT_CLIENTTIMEOUT 10
 #define DEFAULT_CLIENTFORCEOUT 360
@@ -73,11 +99,21 @@
 #define DEFAULT_SET_MSS 1
 #define DEFAULT_MSS_VALUE 0
 #define DEFAULT_TRAFFIC_CONTROL 0
+#define DEFAULT_TC_MODE TC_MODE_IMQ
+#define DEFAULT_TC_QDISC TC_QDISC_HTB
+#define DEFAULT_TC_POOL 0
+#define DEFAULT_FLOW_OFFLOAD 0
+#define DEFAULT_WALLED_GARDEN 0
+#define DEFAULT_WALLED_GARDEN_SNOOP 0
+#define DEFAULT_DEAUTH_GRACE 0
 #define DEFAULT_UPLOAD_LIMIT 0
 #define DEFAULT_DOWNLOAD_LIMIT 0
+#define DEFAULT_UPLINK_DOWNLOAD_RATE 0
+#define DEFAULT_UPLINK_UPLOAD_RATE 0
 #define DEFAULT_DOWNLOAD_IMQ 0
 #define DEFAULT_UPLOAD_IMQ 1
 #define DEFAULT_LOG_SYSLOG 0
+#define DEFAULT_DRY_RUN 0
 #define DEFAULT_SYSLOG_FACILITY LOG_DAEMON
 #define DEFAULT_NDSCTL_SOCK "/tmp/ndsctl.sock"
 #define DEFAULT_INTERNAL_SOCK "/tmp/ndsctl.sock"
@@ -126,6 +162,18 @@ typedef struct _firewall_ruleset_t {
 	struct _firewall_ruleset_t *next;
 } t_firewall_ruleset;
 
+/**
+ * Traffic control plans, htb classes capping the clients on them together
+ */
+typedef struct _tc_plan_t {
+	char *name;
+	int download_rate;		/**< @brief kbit/s guaranteed to the plan's clients together */
+	int upload_rate;
+	int download_ceil;		/**< @brief kbit/s they may borrow up to */
+	int upload_ceil;
+	struct _tc_plan_t *next;
+} t_tc_plan;
+
 /**
  * MAC Addresses
  */
@@ -154,6 +202,20 @@ typedef struct {
 	char *gw_address;		/**< @brief Internal IP address for our web server */
 	unsigned int gw_port;		/**< @brief Port the webserver will run on */
 	char *remote_auth_action;	/**< @brief Path for remote auth */
+	int http_threads;		/**< @brief threads serving http, 0 for one per CPU core */
+	int http_listen_mode;		/**< @brief HTTP_LISTEN_POOL or HTTP_LISTEN_REUSEPORT */
+	int http_max_connections;	/**< @brief concurrent http connections, 0 for the microhttpd default */
+	int http_max_connections_per_ip;	/**< @brief concurrent http connections from one IP, 0 for no limit */
+	int http_connection_memory;	/**< @brief bytes of memory per http connection, 0 for the microhttpd default */
+	int http_timeout;		/**< @brief seconds an idle http connection is kept */
+	int http_transparent;		/**< @brief port 80 is redirected to gw_port itself, rather than to a reverse proxy */
+	int https_preauth;		/**< @brief HTTPS from preauthenticated clients, HTTPS_PREAUTH_PROXY, _PEEK or _REJECT */
+	int admission_cache_time;	/**< @brief seconds a cannavigate answer letting a client navigate is cached */
+	int admission_negative_cache_time;	/**< @brief seconds any other cannavigate answer is cached */
+	int cloud_fallback;		/**< @brief answer to new clients while wifiLazooo is unreachable, CLOUD_FALLBACK_SPLASH or CLOUD_FALLBACK_GRANT */
+	int cloud_fallback_time;	/**< @brief seconds a client is authenticated for by CLOUD_FALLBACK_GRANT */
+	int cloud_breaker_cooldown;	/**< @brief seconds requests to wifiLazooo are refused for, once too many failed */
+	int cloud_slow_request;	/**< @brief milliseconds after which a request to wifiLazooo counts as failed */
 	char enable_preauth;    /**< @brief enable pre-authentication support */
 	char *bin_voucher;    /**< @brief enable voucher support */
 	char force_voucher;    /**< @brief force voucher */
@@ -180,11 +242,22 @@ typedef struct {
 	int set_mss;			/**< @brief boolean, whether to set mss */
 	int mss_value;		/**< @brief int, mss value; <= 0 clamp to pmtu */
 	int traffic_control;		/**< @brief boolean, whether to do tc */
+	int tc_mode;			/**< @brief devices traffic is shaped on, TC_MODE_IMQ or TC_MODE_IFB */
+	int tc_qdisc;			/**< @brief how traffic is shaped, TC_QDISC_HTB or TC_QDISC_CAKE */
+	int tc_pool;			/**< @brief boolean, whether to create the htb classes of all MaxClients slots up front */
+	int flow_offload;		/**< @brief boolean, whether to offload authenticated flows to an nft flowtable */
+	int walled_garden;		/**< @brief boolean, whether preauthenticated users may reach the hosts in HOSTS_FILE_PATH */
+	int walled_garden_snoop;	/**< @brief boolean, whether to add walled garden addresses from DNS replies to clients */
+	int deauth_grace;		/**< @brief seconds a deauthenticated client's rules are kept for a quick reauthentication */
 	int download_limit;		/**< @brief Download limit, kb/s */
 	int upload_limit;		/**< @brief Upload limit, kb/s */
+	int uplink_download_rate;	/**< @brief Download rate of the uplink, kb/s; 0 for no limit on the htb root */
+	int uplink_upload_rate;	/**< @brief Upload rate of the uplink, kb/s; 0 for no limit on the htb root */
+	t_tc_plan *tc_plans;		/**< @brief traffic control plans, in config file order */
 	int download_imq;		/**< @brief Number of IMQ handling download */
 	int upload_imq;		/**< @brief Number of IMQ handling upload */
 	int log_syslog;		/**< @brief boolean, whether to log to syslog */
+	int dry_run;			/**< @brief boolean, whether firewall and tc commands are only logged, not run */
 	int syslog_facility;		/**< @brief facility to use when using syslog for logging */
 	int macmechanism; 		/**< @brief mechanism wrt MAC addrs */
 	t_firewall_ruleset *rulesets;	/**< @brief firewall rules */
@@ -72,6 +72,8 @@
 #include "firewall.h"
 #include "fw_iptables.h"
 #include "auth.h"
+#include "cmdstat.h"
+#include "neigh.h"
 
 
 extern pthread_mutex_t client_list_mutex;
@@ -84,38 +86,60 @@ unsigned int FW_MARK_TRUSTED;          /**< @brief The client is trusted */
 unsigned int FW_MARK_MASK;             /**< @brief Iptables mask: bitwise or of the others */
 
 /**
- * Get an IP's MAC address from the ARP cache.
- * Go through all the entries in /proc/net/arp until we find the requested
- * IP address and return the MAC address bound to it.
- * @todo Make this function portable (using shell scripts?)
+ * Get an IP's MAC address from the ARP cache into mac, which has room
+ * for 18 bytes.  Returns 0, or -1 if it is not known.
+ * The neighbour cache is asked, and resolves addresses the kernel does
+ * not know yet.  Until it is loaded, go through all the entries in
+ * /proc/net/arp until we find the requested IP address.
  */
-char *
-arp_get(const char *req_ip)
+int
+arp_lookup(const char *req_ip, char *mac)
 {
 	FILE *proc;
 	char ip[16];
-	char mac[18];
-	char *reply = NULL;
+	int rc = -1;
+
+	switch (neigh_resolve(req_ip, mac)) {
+	case 0:
+		return 0;
+	case -1:
+		return -1;
+	}
 
 	if (!(proc = fopen("/proc/net/arp", "r"))) {
-		return NULL;
+		return -1;
 	}
 
 	/* Skip first line */
 	while (!feof(proc) && fgetc(proc) != '\n');
 
-	/* Find ip, copy mac in reply */
-	reply = NULL;
+	/* Find ip, copy mac */
 	while (!feof(proc) && (fscanf(proc, " %15[0-9.] %*s %*s %17[A-Fa-f0-9:] %*s %*s", ip, mac) == 2)) {
 		if (strcmp(ip, req_ip) == 0) {
-			reply = safe_strdup(mac);
+			rc = 0;
 			break;
 		}
 	}
 
 	fclose(proc);
 
-	return reply;
+	return rc;
+}
+
+/**
+ * Get an IP's MAC address from the ARP cache, as arp_lookup().
+ * Returns a copy the caller must free, or NULL.
+ */
+char *
+arp_get(const char *req_ip)
+{
+	char mac[18];
+
+	if (arp_lookup(req_ip, mac) != 0) {
+		return NULL;
+	}
+
+	return safe_strdup(mac);
 }
 
 /** Initialize the firewall rules
@@ -128,7 +152,9 @@ fw_init(void)
 	t_client * client = NULL;
 
 	debug(LOG_INFO, "Initializing Firewall");
+	cmdstat_begin(CMDSTAT_INIT);
 	result = iptables_fw_init();
+	cmdstat_end();
 
 	return result;
 }
@@ -141,8 +167,19 @@ fw_init(void)
 int
 fw_destroy(void)
 {
+	char *text;
+	int result;
+
 	debug(LOG_INFO, "Removing Firewall rules");
-	return iptables_fw_destroy();
+	cmdstat_begin(CMDSTAT_DESTROY);
+	result = iptables_fw_destroy();
+	cmdstat_end();
+
+	text = cmdstat_text();
+	debug(LOG_NOTICE, "Control plane totals:\n%s", text);
+	free(text);
+
+	return result;
 }
 
 /** Ping clients to see if they are still active,
@@ -166,6 +203,9 @@ fw_refresh_client_list(void)
 
 	LOCK_CLIENT_LIST();
 
+	/* Parked clients are only removed once their grace period is over */
+	auth_expire_parked();
+
 	for (cp1 = cp2 = client_get_first_client(); NULL != cp1; cp1 = cp2) {
 		cp2 = cp1->next;
 
@@ -180,7 +220,9 @@ fw_refresh_client_list(void)
 			now = time(NULL);
 			last_updated = cp1->counters.last_updated;
 			added_time = cp1->added_time;
-			if (last_updated +  (config->checkinterval * config->clienttimeout) <= now) {
+			if (cp1->parked) {
+				/* Still within its grace period, see auth_expire_parked() */
+			} else if (last_updated +  (config->checkinterval * config->clienttimeout) <= now) {
 				/* Timing out inactive user */
 				debug(LOG_NOTICE, "%s %s inactive %d secs. kB in: %llu  kB out: %llu",
 					  cp1->ip, cp1->mac, config->checkinterval * config->clienttimeout,
@@ -48,6 +48,9 @@ void fw_refresh_client_list(void);
 /** @brief Get an IP's MAC address from the ARP cache.*/
 char *arp_get(const char *req_ip);
 
+/** @brief Get an IP's MAC address from the ARP cache into an 18 byte buffer */
+int arp_lookup(const char *req_ip, char *mac);
+
 /** @brief Return a string representing a connection state */
 char *fw_connection_state_as_string(int mark);
 
@@ -50,6 +50,10 @@
 #include "debug.h"
 #include "util.h"
 #include "tc.h"
+#include "fw_nft.h"
+#include "walled_garden.h"
+#include "probe.h"
+#include "cmdstat.h"
 
 static char * _iptables_compile(const char *, char *, t_firewall_rule *);
 static int _iptables_append_ruleset(char *, char *, char *);
@@ -114,10 +118,31 @@ _iptables_init_marks()
 	return 0;
 }
 
-/** @internal */
+/** @internal
+ * Choose the mark op and mark mask from the probed kernel features.
+ * Only if those are unknown, test them with rules in the live chains.
+ */
 int
 _iptables_check_mark_masking()
 {
+	int features;
+
+	if ((features = probe_features(0)) >= 0) {
+		if (features & FEATURE_OR_MARK) {
+			markop = "--or-mark";
+		} else {
+			debug(LOG_INFO,"Kernel does not support iptables --or-mark.  Using --set-mark instead.");
+			markop = "--set-mark";
+		}
+		if (features & FEATURE_MARK_MASK) {
+			safe_asprintf(&markmask,"/0x%x",FW_MARK_MASK);
+		} else {
+			debug(LOG_INFO,"Kernel does not support iptables mark masking.  Using empty mask.");
+			markmask = "";
+		}
+		debug(LOG_INFO,"Iptables mark op \"%s\" and mark mask \"%s\".", markop, markmask);
+		return 0;
+	}
 
 	/* See if kernel supports mark or-ing */
 	fw_quiet = 1; /* do it quietly */
@@ -318,8 +343,8 @@ iptables_fw_init(void)
 	char * gw_interface = NULL;
 	char * gw_address = NULL;
 	char * gw_iprange = NULL;
-	int gw_port = 0;
-	int traffic_control;
+	int gw_port = 0, http_port, https_preauth;
+	int traffic_control, flow_offload, walled_garden, walled_garden_snoop;
 	int set_mss, mss_value;
 	t_MAC *pt;
 	t_MAC *pb;
@@ -332,6 +357,9 @@ iptables_fw_init(void)
 	gw_address = safe_strdup(config->gw_address);    /* must free */
 	gw_iprange = safe_strdup(config->gw_iprange);    /* must free */
 	gw_port = config->gw_port;
+	/* with HttpTransparent we are the proxy */
+	http_port = config->http_transparent ? gw_port : 8888;
+	https_preauth = config->https_preauth;
 	pt = config->trustedmaclist;
 	pb = config->blockedmaclist;
 	pa = config->allowedmaclist;
@@ -339,6 +367,9 @@ iptables_fw_init(void)
 	set_mss = config->set_mss;
 	mss_value = config->mss_value;
 	traffic_control = config->traffic_control;
+	flow_offload = config->flow_offload;
+	walled_garden = config->walled_garden;
+	walled_garden_snoop = config->walled_garden_snoop;
 	FW_MARK_BLOCKED = config->FW_MARK_BLOCKED;
 	FW_MARK_TRUSTED = config->FW_MARK_TRUSTED;
 	FW_MARK_AUTHENTICATED = config->FW_MARK_AUTHENTICATED;
@@ -368,6 +399,15 @@ iptables_fw_init(void)
 	rc |= iptables_do_command("-t mangle -I PREROUTING 3 -i %s -s %s -j " CHAIN_TRUSTED, gw_interface, gw_iprange);
 	rc |= iptables_do_command("-t mangle -I POSTROUTING 1 -o %s -d %s -j " CHAIN_INCOMING, gw_interface, gw_iprange);
 
+	/* Queue DNS replies to clients for the walled garden snooper.
+	 * Appended after CHAIN_INCOMING, which accepts authenticated clients' packets,
+	 * so only replies to the other clients are queued. */
+	if(walled_garden && walled_garden_snoop) {
+		rc |= iptables_do_command("-t mangle -N " CHAIN_DNS_SNOOP);
+		rc |= iptables_do_command("-t mangle -A POSTROUTING -o %s -d %s -p udp --sport 53 -j " CHAIN_DNS_SNOOP, gw_interface, gw_iprange);
+		rc |= iptables_do_command("-t mangle -A " CHAIN_DNS_SNOOP " -j NFQUEUE --queue-num %d --queue-bypass", WG_SNOOP_QUEUE);
+	}
+
 	/* Rules to mark as trusted MAC address packets in mangle PREROUTING */
 	for (; pt != NULL; pt = pt->next) {
 		rc |= iptables_trust_mac(pt->mac);
@@ -402,6 +442,11 @@ iptables_fw_init(void)
 		rc |= tc_init_tc();
 	}
 
+	/* Set up the flowtable fast path */
+	if(flow_offload) {
+		rc |= nft_fw_init_offload();
+	}
+
 	/*
 	 * End of mangle table chains and rules
 	 **************************************
@@ -414,6 +459,11 @@ iptables_fw_init(void)
 	 *
 	 */
 
+	/* The walled garden set must exist before rules can refer to it */
+	if(walled_garden) {
+		rc |= wg_fw_init();
+	}
+
 	/* Create new chains in nat table */
 	rc |= iptables_do_command("-t nat -N " CHAIN_OUTGOING);
 
@@ -427,12 +477,18 @@ iptables_fw_init(void)
 	rc |= iptables_do_command("-t nat -A " CHAIN_OUTGOING " -m mark --mark 0x%x%s -j ACCEPT", FW_MARK_TRUSTED, markmask);
 	/* CHAIN_OUTGOING, packets marked AUTHENTICATED  ACCEPT */
 	rc |= iptables_do_command("-t nat -A " CHAIN_OUTGOING " -m mark --mark 0x%x%s -j ACCEPT",FW_MARK_AUTHENTICATED, markmask);
+	/* CHAIN_OUTGOING, packets to the walled garden  ACCEPT */
+	if(walled_garden) {
+		rc |= iptables_do_command("-t nat -A " CHAIN_OUTGOING " -m set --match-set " WG_IPSET " dst -j ACCEPT");
+	}
 	/* CHAIN_OUTGOING, append the "preauthenticated-users" ruleset */
 	rc |= _iptables_append_ruleset("nat", "preauthenticated-users", CHAIN_OUTGOING);
 
 	/* CHAIN_OUTGOING, packets for tcp port 80, redirect to gw_port on primary address for the iface */
-	rc |= iptables_do_command("-t nat -A " CHAIN_OUTGOING " -p tcp --dport 80 -j DNAT --to-destination %s:%d", gw_address, 8888);
-	rc |= iptables_do_command("-t nat -A " CHAIN_OUTGOING " -p tcp --dport 443 -j DNAT --to-destination %s:%d", gw_address, 8443);
+	rc |= iptables_do_command("-t nat -A " CHAIN_OUTGOING " -p tcp --dport 80 -j DNAT --to-destination %s:%d", gw_address, http_port);
+	if (https_preauth != HTTPS_PREAUTH_REJECT) {
+		rc |= iptables_do_command("-t nat -A " CHAIN_OUTGOING " -p tcp --dport 443 -j DNAT --to-destination %s:%d", gw_address, 8443);
+	}
 	/* CHAIN_OUTGOING, other packets  ACCEPT */
 	rc |= iptables_do_command("-t nat -A " CHAIN_OUTGOING " -j ACCEPT");
 
@@ -573,17 +629,31 @@ iptables_fw_init(void)
 		rc |= iptables_do_command("-t filter -A " CHAIN_AUTHENTICATED " -j REJECT --reject-with icmp-port-unreachable");
 	}
 
+	/* CHAIN_TO_INTERNET, packets to the walled garden  ACCEPT */
+	if(walled_garden) {
+		rc |= iptables_do_command("-t filter -A " CHAIN_TO_INTERNET " -m set --match-set " WG_IPSET " dst -j ACCEPT");
+	}
+
 	/* CHAIN_TO_INTERNET, other packets: */
 
 	/* if preauthenticated-users ruleset is empty:
 	 *    use empty ruleset policy
 	 * else:
 	 *    load and use authenticated-users ruleset
+	 * With HttpsPreauth reject, https not let through by the ruleset
+	 * is REJECTed with a reset, before the empty ruleset policy or the
+	 * final REJECT.
 	 */
 	if(is_empty_ruleset("preauthenticated-users")) {
+		if (https_preauth == HTTPS_PREAUTH_REJECT) {
+			rc |= iptables_do_command("-t filter -A " CHAIN_TO_INTERNET " -p tcp --dport 443 -j REJECT --reject-with tcp-reset");
+		}
 		rc |= iptables_do_command("-t filter -A " CHAIN_TO_INTERNET " -j %s ",  get_empty_ruleset_policy("preauthenticated-users"));
 	} else {
 		rc |= _iptables_append_ruleset("filter", "preauthenticated-users", CHAIN_TO_INTERNET);
+		if (https_preauth == HTTPS_PREAUTH_REJECT) {
+			rc |= iptables_do_command("-t filter -A " CHAIN_TO_INTERNET " -p tcp --dport 443 -j REJECT --reject-with tcp-reset");
+		}
 	}
 	/* CHAIN_TO_INTERNET, all other packets REJECT */
 	rc |= iptables_do_command("-t filter -A " CHAIN_TO_INTERNET " -j REJECT --reject-with icmp-port-unreachable");
@@ -609,11 +679,13 @@ iptables_fw_destroy(void)
 {
 	fw_quiet = 1;
 	s_config *config;
-	int traffic_control;
+	int traffic_control, flow_offload, walled_garden;
 
 	LOCK_CONFIG();
 	config = config_get_config();
 	traffic_control = config->traffic_control;
+	flow_offload = config->flow_offload;
+	walled_garden = config->walled_garden;
 	UNLOCK_CONFIG();
 
 	if(traffic_control) {
@@ -621,6 +693,11 @@ iptables_fw_destroy(void)
 		tc_destroy_tc();
 	}
 
+	if(flow_offload) {
+		debug(LOG_DEBUG, "Destroying our flowtable");
+		nft_fw_destroy_offload();
+	}
+
 	debug(LOG_DEBUG, "Destroying our iptables entries");
 
 	/*
@@ -634,16 +711,19 @@ iptables_fw_destroy(void)
 	iptables_fw_destroy_mention("mangle", "PREROUTING", CHAIN_ALLOWED);
 	iptables_fw_destroy_mention("mangle", "PREROUTING", CHAIN_OUTGOING);
 	iptables_fw_destroy_mention("mangle", "POSTROUTING", CHAIN_INCOMING);
+	iptables_fw_destroy_mention("mangle", "POSTROUTING", CHAIN_DNS_SNOOP);
 	iptables_do_command("-t mangle -F " CHAIN_TRUSTED);
 	iptables_do_command("-t mangle -F " CHAIN_BLOCKED);
 	iptables_do_command("-t mangle -F " CHAIN_ALLOWED);
 	iptables_do_command("-t mangle -F " CHAIN_OUTGOING);
 	iptables_do_command("-t mangle -F " CHAIN_INCOMING);
+	iptables_do_command("-t mangle -F " CHAIN_DNS_SNOOP);
 	iptables_do_command("-t mangle -X " CHAIN_TRUSTED);
 	iptables_do_command("-t mangle -X " CHAIN_BLOCKED);
 	iptables_do_command("-t mangle -X " CHAIN_ALLOWED);
 	iptables_do_command("-t mangle -X " CHAIN_OUTGOING);
 	iptables_do_command("-t mangle -X " CHAIN_INCOMING);
+	iptables_do_command("-t mangle -X " CHAIN_DNS_SNOOP);
 
 	/*
 	 *
@@ -676,6 +756,10 @@ iptables_fw_destroy(void)
 	iptables_do_command("-t filter -X " CHAIN_TRUSTED);
 	iptables_do_command("-t filter -X " CHAIN_TRUSTED_TO_ROUTER);
 
+	if(walled_garden) {
+		wg_fw_destroy();
+	}
+
 	return 0;
 }
 
@@ -703,7 +787,7 @@ iptables_fw_destroy_mention(
 
 	safe_asprintf(&command, "iptables -t %s -L %s -n --line-numbers -v", table, chain);
 
-	if ((p = popen(command, "r"))) {
+	if ((p = execute_popen(command, "r"))) {
 		/* Skip first 2 lines */
 		while (!feof(p) && fgetc(p) != '\n');
 		while (!feof(p) && fgetc(p) != '\n');
@@ -737,23 +821,48 @@ iptables_fw_destroy_mention(
 	return (retval);
 }
 
+/** @internal
+ * Whether an authenticated client takes the flowtable fast path.
+ * Offloaded packets skip the imq hooks, so only unshaped clients do.
+ */
+static int
+_iptables_fw_offloadable(t_client *client)
+{
+	int download_limit, upload_limit, traffic_control, flow_offload;
+	s_config *config;
+
+	LOCK_CONFIG();
+	config = config_get_config();
+	traffic_control = config->traffic_control;
+	flow_offload = config->flow_offload;
+	download_limit = config->download_limit;
+	upload_limit = config->upload_limit;
+	UNLOCK_CONFIG();
+
+	if ((client->download_limit > 0) && (client->upload_limit > 0)) {
+		download_limit = client->download_limit;
+		upload_limit = client->upload_limit;
+	}
+
+	return flow_offload && !(traffic_control && (download_limit > 0 || upload_limit > 0));
+}
+
 /** Insert or delete firewall mangle rules marking a client's packets.
  */
 int
 iptables_fw_access(t_authaction action, t_client *client)
 {
-	int rc = 0, download_limit, upload_limit, traffic_control;
+	int rc = 0, download_limit, upload_limit, traffic_control, flow_offload;
 	s_config *config;
 	char *download_imqname, *upload_imqname;
 
 	fw_quiet = 0;
 
-	config = config_get_config();
-	safe_asprintf(&download_imqname,"imq%d",config->download_imq); /* must free */
-	safe_asprintf(&upload_imqname,"imq%d",config->upload_imq);  /* must free */
-
 	LOCK_CONFIG();
+	config = config_get_config();
+	tc_get_devices(&download_imqname, &upload_imqname); /* must free */
 	traffic_control = config->traffic_control;
+	flow_offload = config->flow_offload;
 	download_limit = config->download_limit;
 	upload_limit = config->upload_limit;
 	UNLOCK_CONFIG();
@@ -763,6 +872,8 @@ iptables_fw_access(t_authaction action, t_client *client)
 		upload_limit = client->upload_limit;
 	}
 
+	cmdstat_begin(action == AUTH_MAKE_AUTHENTICATED ? CMDSTAT_AUTH : CMDSTAT_DEAUTH);
+
 	switch(action) {
 	case AUTH_MAKE_AUTHENTICATED:
 		debug(LOG_NOTICE, "Authenticating %s %s", client->ip, client->mac);
@@ -772,28 +883,118 @@ iptables_fw_access(t_authaction action, t_client *client)
 		/* This rule is just for download (incoming) byte counting, see iptables_fw_counters_update() */
 		rc |= iptables_do_command("-t mangle -A " CHAIN_INCOMING " -d %s -j ACCEPT", client->ip);
 		if(traffic_control) {
-			rc |= tc_attach_client(download_imqname, download_limit, upload_imqname, upload_limit, client->idx, FW_MARK_AUTHENTICATED);
+			rc |= tc_attach_client(download_imqname, download_limit, upload_imqname, upload_limit, client->idx, FW_MARK_AUTHENTICATED, client->plan);
+		}
+		if(_iptables_fw_offloadable(client)) {
+			nft_fw_offload_access(action, client);
 		}
 		break;
 	case AUTH_MAKE_DEAUTHENTICATED:
 		/* Remove the authentication rules. */
 		debug(LOG_NOTICE, "Deauthenticating %s %s", client->ip, client->mac);
+		if(client->parked) {
+			rc |= iptables_do_command("-t mangle -D " CHAIN_OUTGOING " -s %s -m mac --mac-source %s -j RETURN", client->ip, client->mac);
+		}
 		rc |= iptables_do_command("-t mangle -D " CHAIN_OUTGOING " -s %s -m mac --mac-source %s -j MARK %s 0x%x%x", client->ip, client->mac, markop, client->idx + 10, FW_MARK_AUTHENTICATED);
 		rc |= iptables_do_command("-t mangle -D " CHAIN_INCOMING " -d %s -j ACCEPT", client->ip);
 		if(traffic_control) {
 			rc |= tc_detach_client(download_imqname, upload_imqname, client->idx);
 		}
+		if(flow_offload) {
+			nft_fw_offload_access(action, client);
+		}
 		break;
 	default:
 		rc = -1;
 		break;
 	}
 
+	cmdstat_end();
+
+	free(upload_imqname);
+	free(download_imqname);
+	return rc;
+}
+
+/** Change the rates of an authenticated or parked client's tc classes in
+ * place, after its download_limit and upload_limit have been changed.
+ * Its packets stay queued, and its rules are left alone.
+ * If its plan was changed from old_plan, its classes move to the new one.
+ */
+int
+iptables_fw_rate(t_client *client, const char *old_plan)
+{
+	int rc = 0, download_limit, upload_limit, traffic_control;
+	s_config *config;
+	char *download_imqname, *upload_imqname;
+
+	fw_quiet = 0;
+
+	LOCK_CONFIG();
+	config = config_get_config();
+	tc_get_devices(&download_imqname, &upload_imqname); /* must free */
+	traffic_control = config->traffic_control;
+	download_limit = config->download_limit;
+	upload_limit = config->upload_limit;
+	UNLOCK_CONFIG();
+
+	if ((client->download_limit > 0) && (client->upload_limit > 0)) {
+		download_limit = client->download_limit;
+		upload_limit = client->upload_limit;
+	}
+
+	if(traffic_control) {
+		debug(LOG_NOTICE, "Rating %s %s at %d/%d kbit/s", client->ip, client->mac, download_limit, upload_limit);
+		rc = tc_change_client(download_imqname, download_limit, upload_imqname, upload_limit, client->idx, old_plan, client->plan);
+	}
+
 	free(upload_imqname);
 	free(download_imqname);
 	return rc;
 }
 
+/** Park the rules of a deauthenticated client.
+ * A RETURN rule ahead of its MARK rule stops its packets being marked
+ * authenticated, while its other rules and tc classes stay in place.
+ */
+int
+iptables_fw_park(t_client *client)
+{
+	int rc;
+
+	fw_quiet = 0;
+
+	debug(LOG_NOTICE, "Parking %s %s", client->ip, client->mac);
+	cmdstat_begin(CMDSTAT_DEAUTH);
+	rc = iptables_do_command("-t mangle -I " CHAIN_OUTGOING " -s %s -m mac --mac-source %s -j RETURN", client->ip, client->mac);
+	if(client->offloaded) {
+		nft_fw_offload_access(AUTH_MAKE_DEAUTHENTICATED, client);
+	}
+	cmdstat_end();
+
+	return rc;
+}
+
+/** Give a parked client its access back.
+ */
+int
+iptables_fw_unpark(t_client *client)
+{
+	int rc;
+
+	fw_quiet = 0;
+
+	debug(LOG_NOTICE, "Unparking %s %s", client->ip, client->mac);
+	cmdstat_begin(CMDSTAT_AUTH);
+	rc = iptables_do_command("-t mangle -D " CHAIN_OUTGOING " -s %s -m mac --mac-source %s -j RETURN", client->ip, client->mac);
+	if(_iptables_fw_offloadable(client)) {
+		nft_fw_offload_access(AUTH_MAKE_AUTHENTICATED, client);
+	}
+	cmdstat_end();
+
+	return rc;
+}
+
 /** Return the total upload usage in bytes */
 unsigned long long int
 iptables_fw_total_upload()
@@ -806,7 +1007,7 @@ iptables_fw_total_upload()
 
 	/* Look for outgoing traffic */
 	script =  "iptables -v -n -x -t mangle -L PREROUTING";
-	output = popen(script, "r");
+	output = execute_popen(script, "r");
 	if (!output) {
 		debug(LOG_ERR, "popen(): %s", strerror(errno));
 		return 0;
@@ -844,7 +1045,7 @@ iptables_fw_total_download()
 
 	/* Look for incoming traffic */
 	script =  "iptables -v -n -x -t mangle -L POSTROUTING";
-	output = popen(script, "r");
+	output = execute_popen(script, "r");
 	if (!output) {
 		debug(LOG_ERR, "popen(): %s", strerror(errno));
 		return 0;
@@ -870,22 +1071,24 @@ iptables_fw_total_download()
 	return 0;
 }
 
-/** Update the counters of all the clients in the client list */
-int
-iptables_fw_counters_update(void)
+/** @internal
+ * Read the counters of all the clients from the mangle chains.
+ */
+static int
+_iptables_fw_counters_update(void)
 {
 	FILE *output;
 	char *script,
 		 ip[16],
 		 target[MAX_BUF];
-	int rc;
+	int rc, flow_offload;
 	unsigned long long int counter;
 	t_client *p1;
 	struct in_addr tempaddr;
 
 	/* Look for outgoing traffic */
 	safe_asprintf(&script, "%s %s", "iptables", "-v -n -x -t mangle -L " CHAIN_OUTGOING);
-	output = popen(script, "r");
+	output = execute_popen(script, "r");
 	free(script);
 	if (!output) {
 		debug(LOG_ERR, "popen(): %s", strerror(errno));
@@ -924,7 +1127,7 @@ iptables_fw_counters_update(void)
 
 	/* Look for incoming traffic */
 	safe_asprintf(&script, "%s %s", "iptables", "-v -n -x -t mangle -L " CHAIN_INCOMING);
-	output = popen(script, "r");
+	output = execute_popen(script, "r");
 	free(script);
 	if (!output) {
 		debug(LOG_ERR, "popen(): %s", strerror(errno));
@@ -960,5 +1163,27 @@ iptables_fw_counters_update(void)
 	}
 	pclose(output);
 
+	/* Offloaded flows bypass the mangle chains, their bytes are counted by nft */
+	LOCK_CONFIG();
+	flow_offload = config_get_config()->flow_offload;
+	UNLOCK_CONFIG();
+
+	if(flow_offload) {
+		nft_fw_counters_update();
+	}
+
 	return 0;
 }
+
+/** Update the counters of all the clients in the client list */
+int
+iptables_fw_counters_update(void)
+{
+	int rc;
+
+	cmdstat_begin(CMDSTAT_COUNTERS);
+	rc = _iptables_fw_counters_update();
+	cmdstat_end();
+
+	return rc;
+}
@@ -43,6 +43,7 @@
 #define CHAIN_BLOCKED    "ndsBLK"
 #define CHAIN_ALLOWED    "ndsALW"
 #define CHAIN_TRUSTED    "ndsTRU"
+#define CHAIN_DNS_SNOOP  "ndsDNS"
 /*@}*/
 
 /** @brief Initialize the firewall */
@@ -57,6 +58,15 @@ int iptables_fw_destroy_mention( const char * table, const char * chain, const c
 /** @brief Define the access of a specific client */
 int iptables_fw_access(t_authaction action, t_client *client);
 
+/** @brief Change the rates of a client's tc classes, and their plan if it left old_plan */
+int iptables_fw_rate(t_client *client, const char *old_plan);
+
+/** @brief Park the rules of a deauthenticated client */
+int iptables_fw_park(t_client *client);
+
+/** @brief Give a parked client its access back */
+int iptables_fw_unpark(t_client *client);
+
 /** @brief Return the total download usage in bytes */
 unsigned long long int iptables_fw_total_download();
 
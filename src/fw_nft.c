@@ -0,0 +1,285 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ \********************************************************************/
+
+/** @internal
+  @file fw_nft.c
+  @brief Firewall nftables functions
+
+  Authenticated clients that are not shaped can have their established
+  flows offloaded to an nftables flowtable spanning the GatewayInterface
+  and the ExternalInterface.  Offloaded packets no longer traverse the
+  iptables mangle and filter chains, so their bytes are counted instead
+  in a netdev table hooked on the GatewayInterface, which sees every
+  packet whether it was offloaded or not.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <syslog.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "common.h"
+
+#include "safe.h"
+#include "conf.h"
+#include "auth.h"
+#include "client_list.h"
+#include "firewall.h"
+#include "debug.h"
+#include "util.h"
+
+#include "fw_nft.h"
+
+extern pthread_mutex_t	client_list_mutex;
+extern pthread_mutex_t	config_mutex;
+
+/**
+ * Make nonzero to supress the error output of nft during destruction.
+ */
+static int nft_quiet = 0;
+
+
+/** @internal */
+int
+nft_do_command(const char *format, ...)
+{
+	va_list vlist;
+	char *fmt_cmd, *cmd;
+	int rc;
+
+	va_start(vlist, format);
+	safe_vasprintf(&fmt_cmd, format, vlist);
+	va_end(vlist);
+
+	/* Several nft commands may be joined by ';', so keep them away from the shell */
+	safe_asprintf(&cmd, "nft '%s'", fmt_cmd);
+
+	free(fmt_cmd);
+
+	debug(LOG_DEBUG, "Executing command: %s", cmd);
+
+	rc = execute(cmd, nft_quiet);
+
+	if(!nft_quiet && rc != 0) {
+		debug(LOG_ERR, "Nonzero exit status %d from command: %s", rc, cmd);
+	}
+
+	free(cmd);
+
+	return rc;
+}
+
+/** Create the flowtable and the accounting table.
+ *  Everything is submitted in a single nft transaction.
+ */
+int
+nft_fw_init_offload(void)
+{
+	s_config *config;
+	char *gw_interface, *ext_interface;
+	int rc;
+
+	LOCK_CONFIG();
+	config = config_get_config();
+	gw_interface = safe_strdup(config->gw_interface);
+	ext_interface = config->ext_interface ? safe_strdup(config->ext_interface) : NULL;
+	UNLOCK_CONFIG();
+
+	if (!ext_interface) {
+		ext_interface = get_ext_iface();
+	}
+
+	debug(LOG_NOTICE, "Setting up flowtable fast path on %s and %s", gw_interface, ext_interface);
+
+	nft_quiet = 0;
+
+	rc = nft_do_command(
+			 "add table inet " NFT_TABLE_OFFLOAD "; "
+			 "add flowtable inet " NFT_TABLE_OFFLOAD " " NFT_FLOWTABLE " { hook ingress priority 0; devices = { %s, %s }; }; "
+			 "add set inet " NFT_TABLE_OFFLOAD " " NFT_SET_OFFLOAD " { type ipv4_addr; }; "
+			 "add chain inet " NFT_TABLE_OFFLOAD " " NFT_CHAIN_FORWARD " { type filter hook forward priority 10; policy accept; }; "
+			 "add rule inet " NFT_TABLE_OFFLOAD " " NFT_CHAIN_FORWARD " meta l4proto { tcp, udp } ct state established ip saddr @" NFT_SET_OFFLOAD " flow add @" NFT_FLOWTABLE "; "
+			 "add rule inet " NFT_TABLE_OFFLOAD " " NFT_CHAIN_FORWARD " meta l4proto { tcp, udp } ct state established ip daddr @" NFT_SET_OFFLOAD " flow add @" NFT_FLOWTABLE "; "
+			 "add table netdev " NFT_TABLE_ACCT "; "
+			 "add map netdev " NFT_TABLE_ACCT " " NFT_SET_UPLOAD " { type ipv4_addr : counter; }; "
+			 "add map netdev " NFT_TABLE_ACCT " " NFT_SET_DOWNLOAD " { type ipv4_addr : counter; }; "
+			 "add chain netdev " NFT_TABLE_ACCT " " NFT_CHAIN_UPLOAD " { type filter hook ingress device %s priority -300; policy accept; }; "
+			 "add chain netdev " NFT_TABLE_ACCT " " NFT_CHAIN_DOWNLOAD " { type filter hook egress device %s priority -300; policy accept; }; "
+			 "add rule netdev " NFT_TABLE_ACCT " " NFT_CHAIN_UPLOAD " counter name ip saddr map @" NFT_SET_UPLOAD "; "
+			 "add rule netdev " NFT_TABLE_ACCT " " NFT_CHAIN_DOWNLOAD " counter name ip daddr map @" NFT_SET_DOWNLOAD,
+			 gw_interface, ext_interface, gw_interface, gw_interface);
+
+	if (rc != 0) {
+		debug(LOG_ERR, "Could not set up flowtable fast path. Flow offload will not work");
+	}
+
+	free(gw_interface);
+	free(ext_interface);
+
+	return rc;
+}
+
+/** Remove the flowtable and the accounting table.
+ */
+int
+nft_fw_destroy_offload(void)
+{
+	int old_nft_quiet;
+
+	old_nft_quiet = nft_quiet;
+	nft_quiet = 1;
+
+	debug(LOG_DEBUG, "Destroying our nft tables");
+	nft_do_command("delete table inet " NFT_TABLE_OFFLOAD);
+	nft_do_command("delete table netdev " NFT_TABLE_ACCT);
+
+	nft_quiet = old_nft_quiet;
+
+	return 0;
+}
+
+/** Add or remove a client from the flowtable fast path.
+ *  The per client counters are named after client->idx, like the tc classes.
+ */
+int
+nft_fw_offload_access(t_authaction action, t_client *client)
+{
+	int rc = 0;
+	char *cmd;
+
+	switch(action) {
+	case AUTH_MAKE_AUTHENTICATED:
+		debug(LOG_INFO, "Offloading flows of %s %s", client->ip, client->mac);
+		rc = nft_do_command(
+				 "add counter netdev " NFT_TABLE_ACCT " ndsup%d; "
+				 "add counter netdev " NFT_TABLE_ACCT " ndsdown%d; "
+				 "add element netdev " NFT_TABLE_ACCT " " NFT_SET_UPLOAD " { %s : ndsup%d }; "
+				 "add element netdev " NFT_TABLE_ACCT " " NFT_SET_DOWNLOAD " { %s : ndsdown%d }; "
+				 "add element inet " NFT_TABLE_OFFLOAD " " NFT_SET_OFFLOAD " { %s }",
+				 client->idx, client->idx,
+				 client->ip, client->idx,
+				 client->ip, client->idx,
+				 client->ip);
+		client->offloaded = (rc == 0);
+		break;
+	case AUTH_MAKE_DEAUTHENTICATED:
+		if (!client->offloaded) {
+			break;
+		}
+		debug(LOG_INFO, "Removing offloaded flows of %s %s", client->ip, client->mac);
+		rc = nft_do_command(
+				 "delete element inet " NFT_TABLE_OFFLOAD " " NFT_SET_OFFLOAD " { %s }; "
+				 "delete element netdev " NFT_TABLE_ACCT " " NFT_SET_UPLOAD " { %s }; "
+				 "delete element netdev " NFT_TABLE_ACCT " " NFT_SET_DOWNLOAD " { %s }; "
+				 "delete counter netdev " NFT_TABLE_ACCT " ndsup%d; "
+				 "delete counter netdev " NFT_TABLE_ACCT " ndsdown%d",
+				 client->ip, client->ip, client->ip,
+				 client->idx, client->idx);
+		/* Flows already in the flowtable would outlive the set element */
+		safe_asprintf(&cmd, "conntrack -D -s %s; conntrack -D -d %s", client->ip, client->ip);
+		execute(cmd, 1);
+		free(cmd);
+		client->offloaded = 0;
+		break;
+	default:
+		rc = -1;
+		break;
+	}
+
+	return rc;
+}
+
+/** @internal
+ * Find an offloaded client by the index its counters are named after.
+ * Client list must be locked.
+ */
+static t_client *
+_nft_find_offloaded_client(int idx)
+{
+	t_client *client;
+
+	for (client = client_get_first_client(); client != NULL; client = client->next) {
+		if (client->idx == idx && client->offloaded) {
+			return client;
+		}
+	}
+
+	return NULL;
+}
+
+/** Update the counters of offloaded clients from the nft named counters.
+ *  These see every packet of the client, so they are never lower than
+ *  what iptables_fw_counters_update() read from the mangle chains.
+ */
+int
+nft_fw_counters_update(void)
+{
+	FILE *output;
+	char line[MAX_BUF], direction[8];
+	int idx = -1;
+	unsigned long long int packets, counter;
+	t_client *p1;
+
+	output = execute_popen("nft list counters table netdev " NFT_TABLE_ACCT, "r");
+	if (!output) {
+		debug(LOG_ERR, "popen(): %s", strerror(errno));
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), output)) {
+		/* counter ndsup12 {
+		 *         packets 3 bytes 180
+		 * }
+		 */
+		if (sscanf(line, " counter nds%7[a-z]%d {", direction, &idx) == 2) {
+			continue;
+		}
+		if (idx < 0 || sscanf(line, " packets %llu bytes %llu", &packets, &counter) != 2) {
+			continue;
+		}
+
+		LOCK_CLIENT_LIST();
+		if ((p1 = _nft_find_offloaded_client(idx))) {
+			if (!strcmp(direction, "up")) {
+				if ((p1->counters.outgoing - p1->counters.outgoing_history) < counter) {
+					p1->counters.outgoing = p1->counters.outgoing_history + counter;
+					p1->counters.last_updated = time(NULL);
+					debug(LOG_DEBUG, "%s - Updated counter.outgoing to %llu bytes from nft", p1->ip, counter);
+				}
+			} else if (!strcmp(direction, "down")) {
+				if ((p1->counters.incoming - p1->counters.incoming_history) < counter) {
+					p1->counters.incoming = p1->counters.incoming_history + counter;
+					debug(LOG_DEBUG, "%s - Updated counter.incoming to %llu bytes from nft", p1->ip, counter);
+				}
+			}
+		}
+		UNLOCK_CLIENT_LIST();
+		idx = -1;
+	}
+	pclose(output);
+
+	return 0;
+}
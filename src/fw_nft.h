@@ -0,0 +1,59 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file fw_nft.h
+    @brief Firewall nftables functions
+*/
+
+#ifndef _FW_NFT_H_
+#define _FW_NFT_H_
+
+#include "auth.h"
+#include "client_list.h"
+
+/*@{*/
+/** nftables object names used by nodogsplash */
+#define NFT_TABLE_OFFLOAD	"nds"		/**< inet table holding the flowtable */
+#define NFT_TABLE_ACCT	"nds_acct"	/**< netdev table counting client bytes */
+#define NFT_FLOWTABLE	"ndsft"
+#define NFT_CHAIN_FORWARD	"ndsFWD"
+#define NFT_CHAIN_UPLOAD	"ndsUP"
+#define NFT_CHAIN_DOWNLOAD	"ndsDOWN"
+#define NFT_SET_OFFLOAD	"nds_offload"	/**< client IPs whose flows are offloaded */
+#define NFT_SET_UPLOAD	"nds_up"	/**< map of client IPs to upload counters */
+#define NFT_SET_DOWNLOAD	"nds_down"	/**< map of client IPs to download counters */
+/*@}*/
+
+/** @brief Set up the flowtable fast path */
+int nft_fw_init_offload(void);
+
+/** @brief Remove the flowtable fast path */
+int nft_fw_destroy_offload(void);
+
+/** @brief Add or remove a client from the flowtable fast path */
+int nft_fw_offload_access(t_authaction action, t_client *client);
+
+/** @brief Update client counters from the nft accounting counters */
+int nft_fw_counters_update(void);
+
+/** @brief Fork an nft command */
+int nft_do_command(const char *format, ...);
+
+#endif /* _FW_NFT_H_ */
@@ -48,6 +48,7 @@
 /* for unix socket communication*/
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <netinet/in.h>
 
 #include <sys/types.h>
 #include <sys/select.h>
@@ -69,6 +70,11 @@
 #include "httpd_handler.h"
 #include "util.h"
 #include "wl_service.h"
+#include "walled_garden.h"
+#include "probe.h"
+#include "neigh.h"
+#include "sni.h"
+#include "assets.h"
 
 
 
@@ -84,54 +90,6 @@ httpd * webserver = NULL;
 /* Time when nodogsplash started  */
 time_t started_time = 0;
 
-static long
-get_file_size (const char *filename) {
-	FILE *fp;
-
-	fp = fopen (filename, "rb");
-	if (fp) {
-	  long size;
-
-	  if ((0 != fseek (fp, 0, SEEK_END)) || (-1 == (size = ftell (fp))))
-	    size = 0;
-
-	  fclose (fp);
-
-	  return size;
-	}
-	else
-	return 0;
-}
-
-static char *
-load_file (const char *filename) {
-	FILE *fp;
-	char *buffer;
-	long size;
-
-	size = get_file_size (filename);
-	if (size == 0)
-	return NULL;
-
-	fp = fopen (filename, "rb");
-	if (!fp)
-	return NULL;
-
-	buffer = malloc (size);
-	if (!buffer) {
-	  fclose (fp);
-	  return NULL;
-	}
-
-	if (size != fread (buffer, 1, size, fp)) {
-	  free (buffer);
-	  buffer = NULL;
-	}
-
-	fclose (fp);
-	return buffer;
-}
-
 /**@internal
  * @brief Handles SIGCHLD signals to avoid zombie processes
  *
@@ -207,6 +165,15 @@ termination_handler(int s)
 	exit(s == 0 ? 1 : 0);
 }
 
+/** @internal
+ * Reloads the splash page and its assets; the thread_assets thread does
+ * the work, a signal handler must not.
+ */
+static void
+sighup_handler(int s)
+{
+	assets_refresh();
+}
 
 /** @internal
  * Registers all the signal handlers
@@ -260,6 +227,14 @@ init_signals(void)
 		debug(LOG_ERR, "sigaction(): %s", strerror(errno));
 		exit(1);
 	}
+
+	/* Trap SIGHUP, to reload the splash page and its assets */
+	debug(LOG_DEBUG, "Setting SIGHUP handler to sighup_handler()");
+	sa.sa_handler = sighup_handler;
+	if (sigaction(SIGHUP, &sa, NULL) == -1) {
+		debug(LOG_ERR, "sigaction(): %s", strerror(errno));
+		exit(1);
+	}
 }
 
 void
@@ -269,17 +244,89 @@ init_wl_service(void){
 	wl_init();
 }
 
-void
-allow_ips_loop(void){
-
-	while(1==1){
+/**@internal
+ * Open a SO_REUSEPORT listening socket on port, one of several the
+ * kernel spreads new connections over.
+ */
+static int
+http_listen_socket(unsigned int port)
+{
+	struct sockaddr_in addr;
+	int fd, on = 1;
 
-		allow_white_ips();
-		//30 secs
-		safe_sleep(30);
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		debug(LOG_ERR, "socket(): %s", strerror(errno));
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+			setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0 ||
+			bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+			listen(fd, SOMAXCONN) < 0) {
+		debug(LOG_ERR, "Could not listen on port %u: %s", port, strerror(errno));
+		close(fd);
+		return -1;
 	}
+	return fd;
 }
 
+/**@internal
+ * Start a microhttpd daemon with the Http* options, its connections
+ * divided over threads threads. With listen_fd >= 0 it accepts on that
+ * socket, which it then owns, instead of opening its own.
+ */
+static struct MHD_Daemon *
+http_start_daemon(int listen_fd, unsigned int threads, unsigned int share)
+{
+	s_config *config = config_get_config();
+	struct MHD_OptionItem options[8];
+	int n = 0;
+
+	options[n].option = MHD_OPTION_CONNECTION_TIMEOUT;
+	options[n].value = config->http_timeout;
+	options[n++].ptr_value = NULL;
+	if (threads > 1) {
+		options[n].option = MHD_OPTION_THREAD_POOL_SIZE;
+		options[n].value = threads;
+		options[n++].ptr_value = NULL;
+	}
+	if (config->http_max_connections > 0) {
+		/* each listener takes its share of the total */
+		options[n].option = MHD_OPTION_CONNECTION_LIMIT;
+		options[n].value = (config->http_max_connections + share - 1) / share;
+		options[n++].ptr_value = NULL;
+	}
+	if (config->http_max_connections_per_ip > 0) {
+		options[n].option = MHD_OPTION_PER_IP_CONNECTION_LIMIT;
+		options[n].value = config->http_max_connections_per_ip;
+		options[n++].ptr_value = NULL;
+	}
+	if (config->http_connection_memory > 0) {
+		options[n].option = MHD_OPTION_CONNECTION_MEMORY_LIMIT;
+		options[n].value = config->http_connection_memory;
+		options[n++].ptr_value = NULL;
+	}
+	if (listen_fd >= 0) {
+		options[n].option = MHD_OPTION_LISTEN_SOCKET;
+		options[n].value = listen_fd;
+		options[n++].ptr_value = NULL;
+	}
+	options[n].option = MHD_OPTION_END;
+	options[n].value = 0;
+	options[n].ptr_value = NULL;
+
+	return MHD_start_daemon(
+						MHD_USE_EPOLL_INTERNALLY_LINUX_ONLY | MHD_USE_SUSPEND_RESUME,
+						 config->gw_port,
+						 NULL, NULL,
+						 &answer_to_connection, NULL,
+						 MHD_OPTION_NOTIFY_COMPLETED, &request_completed, NULL,
+						 MHD_OPTION_ARRAY, options,
+						 MHD_OPTION_END);
+}
 
 /**@internal
  * Main execution loop
@@ -288,7 +335,7 @@ static void
 main_loop(void)
 {
 	int result;
-	pthread_t	tid, wl_service, allow_ips;
+	pthread_t	tid, wl_service, wl_admission, walled_garden, wg_snoop, neigh, sni, assets_tid, housekeeping;
 	s_config *config = config_get_config();
 	struct timespec wait_time;
 	int msec;
@@ -297,6 +344,7 @@ main_loop(void)
 	int* thread_serial_num_p;
 	struct MHD_Daemon *daemon;
 	struct MHD_Daemon *ssl_daemon;
+	int threads, i, listen_fd;
   	char *key_pem;
   	char *cert_pem;
 
@@ -319,6 +367,9 @@ main_loop(void)
 		debug(LOG_NOTICE, "Detected gateway %s at %s", config->gw_interface, config->gw_address);
 	}
 
+	/* Fall back from backends this kernel cannot do */
+	probe_select_backends();
+
 	/* Reset the firewall (cleans it, in case we are restarting after nodogsplash crash) */
 
 	fw_destroy();
@@ -331,13 +382,59 @@ main_loop(void)
 		exit(1);
 	}
 
-	/* Start thread that loops for white IPS */
-	//result = pthread_create(&allow_ips, NULL, (void *)allow_ips_loop, NULL);
-	//if (result != 0) {
-	//	debug(LOG_ERR, "FATAL: Failed to create thread for allow white ips - exiting");
-	//	termination_handler(0);
-	//}
-	//pthread_detach(allow_ips);
+	/* Start thread that keeps the neighbour cache */
+	result = pthread_create(&neigh, NULL, (void *)thread_neigh, NULL);
+	if (result != 0) {
+		debug(LOG_ERR, "FATAL: Failed to create thread_neigh - exiting");
+		termination_handler(0);
+	}
+	pthread_detach(neigh);
+
+	/* Cache the splash page and its assets, and keep them fresh */
+	assets_load();
+	result = pthread_create(&assets_tid, NULL, (void *)thread_assets, NULL);
+	if (result != 0) {
+		debug(LOG_ERR, "FATAL: Failed to create thread_assets - exiting");
+		termination_handler(0);
+	}
+	pthread_detach(assets_tid);
+
+	/* Start thread that resets preauthenticated HTTPS */
+	if (config->https_preauth == HTTPS_PREAUTH_PEEK) {
+		result = pthread_create(&sni, NULL, (void *)thread_sni, NULL);
+		if (result != 0) {
+			debug(LOG_ERR, "FATAL: Failed to create thread_sni - exiting");
+			termination_handler(0);
+		}
+		pthread_detach(sni);
+	}
+
+	/* Start thread that keeps the walled garden resolved */
+	if (config->walled_garden) {
+		result = pthread_create(&walled_garden, NULL, (void *)thread_walled_garden, NULL);
+		if (result != 0) {
+			debug(LOG_ERR, "FATAL: Failed to create thread_walled_garden - exiting");
+			termination_handler(0);
+		}
+		pthread_detach(walled_garden);
+
+		if (config->walled_garden_snoop) {
+			result = pthread_create(&wg_snoop, NULL, (void *)thread_wg_snoop, NULL);
+			if (result != 0) {
+				debug(LOG_ERR, "FATAL: Failed to create thread_wg_snoop - exiting");
+				termination_handler(0);
+			}
+			pthread_detach(wg_snoop);
+		}
+	}
+
+	/* Start thread expiring parked clients */
+	result = pthread_create(&housekeeping, NULL, (void *)thread_fw_housekeeping, NULL);
+	if (result != 0) {
+		debug(LOG_ERR, "FATAL: Failed to create thread_fw_housekeeping - exiting");
+		termination_handler(0);
+	}
+	pthread_detach(housekeeping);
 
 	/* Start client statistics and timeout clean-up thread */
 	//result = pthread_create(&tid_client_check, NULL, (void *)thread_client_timeout_check, NULL);
@@ -355,6 +452,17 @@ main_loop(void)
 	//}
 	//pthread_detach(tid);
 
+	/* Before any thread uses libcurl */
+	curl_global_init(CURL_GLOBAL_DEFAULT);
+
+	/* Start thread that asks wifiLazooo about new clients */
+	result = pthread_create(&wl_admission, NULL, (void *)thread_wl_admission, NULL);
+	if (result != 0) {
+		debug(LOG_ERR, "FATAL: Failed to create thread for wl_admission - exiting");
+		termination_handler(0);
+	}
+	pthread_detach(wl_admission);
+
 	/* Start thread that waits for wifiLazooo events */
 	result = pthread_create(&wl_service, NULL, (void *)init_wl_service, NULL);
 	if (result != 0) {
@@ -363,23 +471,31 @@ main_loop(void)
 	}
 	pthread_detach(wl_service);
 
-	//daemon = MHD_start_daemon (MHD_USE_THREAD_PER_CONNECTION, config->gw_port, &on_client_connect,
-	//                  NULL, &answer_to_connection, NULL, MHD_OPTION_END);
-	daemon = MHD_start_daemon(
-						MHD_USE_EPOLL_INTERNALLY_LINUX_ONLY,
-						 //MHD_USE_THREAD_PER_CONNECTION,
-						 config->gw_port,
-						 NULL, NULL,
-						 &answer_to_connection, NULL,
-						 MHD_OPTION_CONNECTION_TIMEOUT, (unsigned int) 10,
-						 //MHD_OPTION_LISTENING_ADDRESS_REUSE, 1,
-						 MHD_OPTION_END);
-	if (NULL == daemon ) {
-	  debug(LOG_ERR, "FATAL: Failed to create the server daemon");
-		
-	  termination_handler(0);
+	http_probe_init();
+
+	threads = config->http_threads;
+	if (threads == 0 && (threads = sysconf(_SC_NPROCESSORS_ONLN)) < 1) {
+		threads = 1;
+	}
+	if (config->http_listen_mode == HTTP_LISTEN_REUSEPORT) {
+		/* a daemon with its own socket and thread per core, no shared accept queue */
+		for (i = 0; i < threads; i++) {
+			if ((listen_fd = http_listen_socket(config->gw_port)) < 0 ||
+					NULL == (daemon = http_start_daemon(listen_fd, 1, threads))) {
+				debug(LOG_ERR, "FATAL: Failed to create the server daemon %d", i);
+				termination_handler(0);
+			}
+		}
+	} else {
+		daemon = http_start_daemon(-1, threads, 1);
+		if (NULL == daemon ) {
+		  debug(LOG_ERR, "FATAL: Failed to create the server daemon");
+
+		  termination_handler(0);
+		}
 	}
-	debug(LOG_NOTICE, "Microhttpd started, pausing main thread");
+	debug(LOG_NOTICE, "Microhttpd started with %d threads, %s, pausing main thread",
+		  threads, config->http_listen_mode == HTTP_LISTEN_REUSEPORT ? "a listener each" : "one listener");
 	pause();
 }
 
@@ -39,6 +39,7 @@
 #include <sys/socket.h>
 #include <microhttpd.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
 
 #include "httpd.h"
 
@@ -52,6 +53,8 @@
 #include "client_list.h"
 #include "common.h"
 #include "wl_service.h"
+#include "sni.h"
+#include "assets.h"
 
 #include "util.h"
 
@@ -60,6 +63,47 @@ char* UUID;
 
 extern pthread_mutex_t client_list_mutex;
 
+#ifndef SO_ORIGINAL_DST
+/* from linux/netfilter_ipv4.h, which clashes with netinet/in.h on older libcs */
+#define SO_ORIGINAL_DST 80
+#endif
+
+/** A connectivity check some OS makes to find out whether it is behind a
+ * captive portal, and the answer it expects when it is online.
+ */
+typedef struct {
+	const char *host;		/**< @brief Host probed, or NULL for any */
+	const char *path;		/**< @brief Path probed */
+	unsigned int status;		/**< @brief Status when online */
+	const char *type;		/**< @brief Content-Type when online, or NULL */
+	const char *body;		/**< @brief Body when online */
+	struct MHD_Response *online;	/**< @brief Prebuilt online response */
+} t_probe;
+
+static t_probe probes[] = {
+	{ NULL, "/generate_204", MHD_HTTP_NO_CONTENT, NULL, "", NULL },
+	{ NULL, "/gen_204", MHD_HTTP_NO_CONTENT, NULL, "", NULL },
+	{ "captive.apple.com", "/hotspot-detect.html", MHD_HTTP_OK, "text/html",
+	  "<HTML><HEAD><TITLE>Success</TITLE></HEAD><BODY>Success</BODY></HTML>", NULL },
+	{ "www.apple.com", "/library/test/success.html", MHD_HTTP_OK, "text/html",
+	  "<HTML><HEAD><TITLE>Success</TITLE></HEAD><BODY>Success</BODY></HTML>", NULL },
+	{ "www.msftconnecttest.com", "/connecttest.txt", MHD_HTTP_OK, "text/plain", "Microsoft Connect Test", NULL },
+	{ "www.msftncsi.com", "/ncsi.txt", MHD_HTTP_OK, "text/plain", "Microsoft NCSI", NULL },
+	{ "detectportal.firefox.com", "/success.txt", MHD_HTTP_OK, "text/plain", "success\n", NULL },
+	{ "nmcheck.gnome.org", "/check_network_status.txt", MHD_HTTP_OK, "text/plain", "NetworkManager is online\n", NULL },
+	{ NULL, NULL, 0, NULL, NULL, NULL }
+};
+
+/** Prebuilt redirect for probes from clients not yet authenticated;
+ * the request it leads to goes the whole captive way.
+ */
+static struct MHD_Response *probe_redirect;
+
+static pthread_mutex_t probe_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long probes_online = 0;
+static unsigned long probes_redirected = 0;
+static unsigned long browser_requests = 0;
+
 typedef struct {
    short sin_family;
    unsigned short sin_port;
@@ -73,9 +117,11 @@ static int data_extract_bw(const char *buff, t_client *client)
 	int seconds = 0;
 	int upload = 0;
 	int download = 0;
+	char plan[32];
 
 	/* We require at least one value */
-	if (sscanf(buff, "%d %d %d", &seconds, &upload, &download) < 1)
+	plan[0] = '\0';
+	if (sscanf(buff, "%d %d %d %31s", &seconds, &upload, &download, plan) < 1)
 		goto err;
 
 	if (seconds < 1 || upload < 0 || download < 0)
@@ -83,6 +129,8 @@ static int data_extract_bw(const char *buff, t_client *client)
 
 	client->download_limit = download;
 	client->upload_limit = upload;
+	free(client->plan);
+	client->plan = plan[0] ? safe_strdup(plan) : NULL;
 	return seconds;
 
 err:
@@ -174,56 +222,332 @@ http_nodogsplash_callback_index(httpd *webserver, request *r)
 	http_nodogsplash_first_contact(r);
 }
 
-static int return_ok_page_js (struct MHD_Connection *connection, char *url) {
-	int ret;
+/* Captive pages, the target URL goes between each two fragments */
+static const char *const page_ok_js[] = {
+	"<html><head><title>Success</title><script type='text/javascript'>window.location.href='",
+	"'</script></head><body>Success</body></html>",
+	NULL
+};
+static const char *const page_js[] = {
+	"<html><head><script type='text/javascript'>window.location.href='",
+	"'</script></head><body><a href='",
+	"'>connect @wifiLazooo now</a></body></html>",
+	NULL
+};
+
+/** @internal
+ * Append url to the page in buf, of size bytes, holding len; characters
+ * that could end the quoted string it goes in are percent-encoded.
+ */
+static size_t
+_http_splice_url(char *buf, size_t size, size_t len, const char *url)
+{
+	static const char hex[] = "0123456789ABCDEF";
+
+	for (; *url && len + 4 < size; url++) {
+		if (strchr("'\"<>\\", *url)) {
+			buf[len++] = '%';
+			buf[len++] = hex[(unsigned char) *url >> 4];
+			buf[len++] = hex[*url & 0xf];
+		} else {
+			buf[len++] = *url;
+		}
+	}
+	return len;
+}
+
+/** @internal
+ * Queue the page made of fragments and url as the response to connection.
+ * The page is put together on the stack, and MHD keeps its own copy
+ * until the response is sent, so nothing is left to free.
+ */
+static int
+_http_queue_page(struct MHD_Connection *connection, unsigned int status,
+				 const char *const *fragments, const char *url, const char *location)
+{
+	char page[HTTP_PAGE_MAX];
+	size_t len = 0, flen;
 	struct MHD_Response *response;
-	const char *page;
-	debug(LOG_DEBUG, "Redirecting with success JS to %s", url);
-	safe_asprintf(&page,  "<html><head><title>Success</title><script type='text/javascript'>window.location.href='%s'</script></head><body>Success</body></html>", url, url);
-	response = MHD_create_response_from_buffer (strlen (page), (void *) page, MHD_RESPMEM_PERSISTENT);
+	int ret;
+
+	for (; *fragments; fragments++) {
+		flen = strlen(*fragments);
+		if (len + flen >= sizeof(page)) {
+			break;
+		}
+		memcpy(page + len, *fragments, flen);
+		len += flen;
+		if (fragments[1]) {
+			len = _http_splice_url(page, sizeof(page), len, url);
+		}
+	}
+
+	response = MHD_create_response_from_buffer (len, page, MHD_RESPMEM_MUST_COPY);
 	if (!response)
 		return MHD_NO;
 
-	ret = MHD_queue_response (connection, MHD_HTTP_OK, response);
+	if (location) {
+		MHD_add_response_header (response, "Content-Type", "text/html; charset=utf-8");
+		MHD_add_response_header (response, "Location", location);
+	}
+	ret = MHD_queue_response (connection, status, response);
 	MHD_destroy_response (response);
 
 	return ret;
 }
 
-static int return_page_js (struct MHD_Connection *connection, char *url) {
-	int ret;
-	struct MHD_Response *response;
-	const char *page;
+static int return_ok_page_js (struct MHD_Connection *connection, const char *url) {
+	debug(LOG_DEBUG, "Redirecting with success JS to %s", url);
+	return _http_queue_page(connection, MHD_HTTP_OK, page_ok_js, url, NULL);
+}
+
+static int return_page_js (struct MHD_Connection *connection, const char *url) {
 	debug(LOG_DEBUG, "Redirecting with JS to %s", url);
-	safe_asprintf(&page,  "<html><head><script type='text/javascript'>window.location.href='%s'</script></head><body><a href='%s'>connect @wifiLazooo now</a></body></html>", url, url);
-	response = MHD_create_response_from_buffer (strlen (page), (void *) page, MHD_RESPMEM_PERSISTENT);
-	if (!response)
-		return MHD_NO;
+	return _http_queue_page(connection, MHD_HTTP_OK, page_js, url, NULL);
+}
 
-	ret = MHD_queue_response (connection, MHD_HTTP_OK, response);
-	MHD_destroy_response (response);
+static int return_page (struct MHD_Connection *connection, const char *url) {
+	debug(LOG_DEBUG, "Redirecting with 307 to %s", url);
+	return _http_queue_page(connection, 307, page_js, url, url);
+}
 
-	return ret;
+/** State of a connection suspended while wifiLazooo is asked whether
+ *  its new client can navigate.
+ */
+typedef struct {
+	struct MHD_Connection *connection;
+	int allowed;
+	char ip[16];
+	char mac[18];
+	char to[HTTP_URL_MAX];
+	char url_connect[HTTP_URL_MAX];
+} t_admission;
+
+/** @internal
+ * Called from the admission thread with wifiLazooo's answer.
+ */
+static void
+admission_answered(int allowed, void *arg)
+{
+	t_admission *admission = arg;
+
+	admission->allowed = allowed;
+	MHD_resume_connection(admission->connection);
+}
+
+void request_completed (void *cls, struct MHD_Connection *connection,
+                        void **con_cls, enum MHD_RequestTerminationCode toe) {
+	t_admission *admission = *con_cls;
+
+	if (admission) {
+		free(admission);
+		*con_cls = NULL;
+	}
 }
 
-static int return_page (struct MHD_Connection *connection, char *url) {
+/** @internal
+ * Serve the local splash page, while wifiLazooo cannot be reached.
+ */
+static int return_splash (struct MHD_Connection *connection, const char *url) {
 	int ret;
-	struct MHD_Response *response;
-	const char *page;
-	debug(LOG_DEBUG, "Redirecting with 307 to %s", url);
-	safe_asprintf(&page,  "<html><head><script type='text/javascript'>window.location.href='%s'</script></head><body><a href='%s'>connect @wifiLazooo now</a></body></html>", url, url);
-	response = MHD_create_response_from_buffer (strlen (page), (void *) page, MHD_RESPMEM_PERSISTENT);
-	if (!response)
-		return MHD_NO;
+	s_config *config = config_get_config();
 
-	MHD_add_response_header (response, "Content-Type", "text/html; charset=utf-8");
-	MHD_add_response_header (response, "Location", url);
-	ret = MHD_queue_response (connection, 307, response);
-	MHD_destroy_response (response);
+	if ((ret = assets_serve_page(connection, config->splashpage)) < 0) {
+		debug(LOG_ERR, "Could not find splash page '%s/%s'", config->webroot, config->splashpage);
+		return return_page(connection, url);
+	}
+	debug(LOG_DEBUG, "Serving splash page %s", config->splashpage);
 
 	return ret;
 }
 
+/** @internal
+ * Answer a captive request while wifiLazooo cannot be reached, as CloudFallback says.
+ */
+static int return_fallback (struct MHD_Connection *connection, char *ip, char *mac,
+							const char *to, const char *url_connect) {
+	s_config *config = config_get_config();
+	t_client *client;
+
+	if (config->cloud_fallback != CLOUD_FALLBACK_GRANT) {
+		return return_splash(connection, url_connect);
+	}
+
+	debug(LOG_NOTICE, "WifiLazooo unreachable, granting %s %s %d seconds",
+		  ip, mac, config->cloud_fallback_time);
+	auth_client_action(ip, mac, AUTH_MAKE_AUTHENTICATED);
+	LOCK_CLIENT_LIST();
+	if ((client = client_list_find(ip, mac))) {
+		client->added_time = time(NULL) - (config->checkinterval * config->clientforceout) + config->cloud_fallback_time;
+	}
+	UNLOCK_CLIENT_LIST();
+
+	return return_ok_page_js(connection, to);
+}
+
+/** Build the responses to captive portal probes, once, before the
+ * server starts; MHD only ever queues them, so they are never freed.
+ */
+void
+http_probe_init(void)
+{
+	static const char redirect[] = "<html><body><a href='/'>Sign in</a></body></html>";
+	t_probe *probe;
+
+	for (probe = probes; probe->path; probe++) {
+		probe->online = MHD_create_response_from_buffer(strlen(probe->body),
+						(void *) probe->body, MHD_RESPMEM_PERSISTENT);
+		if (probe->online && probe->type) {
+			MHD_add_response_header(probe->online, "Content-Type", probe->type);
+		}
+		if (probe->online) {
+			MHD_add_response_header(probe->online, "Cache-Control", "no-cache, no-store");
+		}
+	}
+
+	probe_redirect = MHD_create_response_from_buffer(strlen(redirect),
+					 (void *) redirect, MHD_RESPMEM_PERSISTENT);
+	if (probe_redirect) {
+		MHD_add_response_header(probe_redirect, "Content-Type", "text/html");
+		MHD_add_response_header(probe_redirect, "Cache-Control", "no-cache, no-store");
+		MHD_add_response_header(probe_redirect, "Location", "/");
+	}
+}
+
+/** @internal
+ * Find the probe host and url make, if they are one.
+ */
+static t_probe *
+http_probe_find(const char *host, const char *url)
+{
+	t_probe *probe;
+	size_t len;
+
+	for (probe = probes; probe->path; probe++) {
+		if (strcmp(url, probe->path) != 0) {
+			continue;
+		}
+		if (!probe->host) {
+			return probe;
+		}
+		if (!host) {
+			continue;
+		}
+		/* the Host header may carry a port */
+		len = strlen(probe->host);
+		if (strncasecmp(host, probe->host, len) == 0 && (host[len] == '\0' || host[len] == ':')) {
+			return probe;
+		}
+	}
+	return NULL;
+}
+
+/** @internal
+ * Answer a probe from ip: online if the client is authenticated,
+ * else a redirect into the portal.
+ */
+static int
+http_probe_answer(struct MHD_Connection *connection, t_probe *probe, const char *ip)
+{
+	t_client *client;
+	int authenticated;
+
+	LOCK_CLIENT_LIST();
+	client = client_list_find_by_ip(ip);
+	authenticated = client && client->fw_connection_state == FW_MARK_AUTHENTICATED;
+	UNLOCK_CLIENT_LIST();
+
+	pthread_mutex_lock(&probe_mutex);
+	if (authenticated)
+		probes_online++;
+	else
+		probes_redirected++;
+	pthread_mutex_unlock(&probe_mutex);
+
+	if (authenticated && probe->online) {
+		debug(LOG_DEBUG, "Answering probe %s from %s: online", probe->path, ip);
+		return MHD_queue_response(connection, probe->status, probe->online);
+	}
+	if (!probe_redirect) {
+		return MHD_NO;
+	}
+	debug(LOG_DEBUG, "Answering probe %s from %s: redirect", probe->path, ip);
+	return MHD_queue_response(connection, MHD_HTTP_FOUND, probe_redirect);
+}
+
+/** Get the captive portal probe counters, as a line for the status
+ * output; the caller must free it.
+ */
+char *
+http_probe_text(void)
+{
+	char *text;
+
+	pthread_mutex_lock(&probe_mutex);
+	safe_asprintf(&text, "Captive probes: %lu answered online, %lu redirected; %lu browser requests\n",
+				  probes_online, probes_redirected, browser_requests);
+	pthread_mutex_unlock(&probe_mutex);
+
+	return text;
+}
+
+/** @internal
+ * Find out which client asks, into ip, and for what, into to. As the
+ * transparent proxy DNAT sends port 80 to, the client is the peer and
+ * the URL comes from the Host header, or else from where the client was
+ * going before the redirect. Behind the reverse proxy both come from
+ * the headers it adds. Returns -1 when the client is not known.
+ */
+static int
+http_request_origin(struct MHD_Connection *connection, const char *url,
+					char *ip, const char **host, char *to)
+{
+	s_config *config = config_get_config();
+	const union MHD_ConnectionInfo *info;
+	const char *proto, *forwarded;
+	struct sockaddr_in dst;
+	socklen_t len = sizeof(dst);
+	char dst_ip[INET_ADDRSTRLEN];
+
+	to[0] = '\0';
+	if (!config->http_transparent) {
+		proto = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "X-Forwarded-Proto");
+		*host = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "X-Host");
+		if (*host != NULL && proto != NULL) {
+			snprintf(to, HTTP_URL_MAX, "%s://%s%s", proto, *host, url);
+		}
+		forwarded = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "X-Forwarded-For");
+		if (forwarded == NULL || strlen(forwarded) >= INET_ADDRSTRLEN) {
+			return -1;
+		}
+		strcpy(ip, forwarded);
+		return 0;
+	}
+
+	info = MHD_get_connection_info(connection, MHD_CONNECTION_INFO_CLIENT_ADDRESS);
+	if (!info || !info->client_addr || info->client_addr->sa_family != AF_INET) {
+		return -1;
+	}
+	inet_ntop(AF_INET, &((struct sockaddr_in *) info->client_addr)->sin_addr, ip, INET_ADDRSTRLEN);
+
+	*host = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_HOST);
+	if (*host != NULL) {
+		snprintf(to, HTTP_URL_MAX, "http://%s%s", *host, url);
+		return 0;
+	}
+	/* no Host header, HTTP/1.0 */
+	info = MHD_get_connection_info(connection, MHD_CONNECTION_INFO_CONNECTION_FD);
+	if (info && getsockopt(info->connect_fd, SOL_IP, SO_ORIGINAL_DST, &dst, &len) == 0) {
+		inet_ntop(AF_INET, &dst.sin_addr, dst_ip, sizeof(dst_ip));
+		if (ntohs(dst.sin_port) == 80) {
+			snprintf(to, HTTP_URL_MAX, "http://%s%s", dst_ip, url);
+		} else {
+			snprintf(to, HTTP_URL_MAX, "http://%s:%u%s", dst_ip, ntohs(dst.sin_port), url);
+		}
+	}
+	return 0;
+}
+
 int on_client_connect (void *cls, const struct sockaddr *addr, socklen_t addrlen) {
 
 	return MHD_YES;	
@@ -239,58 +563,100 @@ int answer_to_connection (void *cls, struct MHD_Connection *connection,
                       const char *url, const char *method,
                       const char *version, const char *upload_data,
                       size_t *upload_data_size, void **con_cls) {
-  
-	char *mac, *url_connect, *to = "";
+
+	const char *host;
+	char ip[INET_ADDRSTRLEN], mac[18], hint[64], to[HTTP_URL_MAX], url_connect[HTTP_URL_MAX];
 	t_client *client;
-	t_auth_target *authtarget;
+	t_probe *probe;
 	s_config *config = config_get_config();
-	char *redir, cmd_buff[255];
-	int already_in = TRUE;
-	
-	debug(LOG_DEBUG, "Try to answer to a connection in answer_to_connection");
-	if(MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "X-Host") != NULL && MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "X-Forwarded-Proto") != NULL ){
-
-		safe_asprintf(&to, "%s://%s%s",MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "X-Forwarded-Proto"), MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "X-Host"), url);
+	int already_in = TRUE, ret;
+	t_admission *admission = *con_cls;
+
+	if (admission) {
+		/* Resumed with wifiLazooo's answer for a new client */
+		if (admission->allowed == TRUE) {
+			return return_ok_page_js(connection, admission->to);
+		} else if (admission->allowed == WL_UNAVAILABLE) {
+			return return_fallback(connection, admission->ip, admission->mac, admission->to, admission->url_connect);
+		}
+		return return_page(connection, admission->url_connect);
 	}
 
-	char *ip = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "X-Forwarded-For");
-	if(ip == NULL){
+	debug(LOG_DEBUG, "Try to answer to a connection in answer_to_connection");
+	/* images and pages of the splash page, from memory */
+	if ((ret = assets_serve(connection, url)) >= 0) {
+		return ret;
+	}
+	if (http_request_origin(connection, url, ip, &host, to) != 0) {
 
-		debug(LOG_DEBUG, "Could not find x-forwarded ip address for");
+		debug(LOG_DEBUG, "Could not find the client ip address for %s", url);
 		return MHD_NO;
 	}
-	else if (!(mac = arp_get(ip))) {
+	if (to[0] == '\0' && sni_hint(ip, hint, sizeof(hint)) == 0) {
+		/* where it last tried to go over HTTPS */
+		snprintf(to, sizeof(to), "https://%s/", hint);
+	}
+
+	/* OS connectivity checks need no ARP, no new client and no cloud call */
+	if (host == NULL) {
+		host = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_HOST);
+	}
+	if ((probe = http_probe_find(host, url)) != NULL) {
+		return http_probe_answer(connection, probe, ip);
+	}
+	pthread_mutex_lock(&probe_mutex);
+	browser_requests++;
+	pthread_mutex_unlock(&probe_mutex);
+
+	if (arp_lookup(ip, mac) != 0) {
 		/* We could not get their MAC address */
 		debug(LOG_NOTICE, "Could not arp MAC address for %s", ip);
 		return MHD_NO;
 	}
+	MHD_get_connection_values (connection, MHD_HEADER_KIND, &print_out_key, NULL);
+
+	LOCK_CLIENT_LIST();
 	if(!(client = client_list_find_by_mac(mac))){
 		already_in = FALSE;
-	}
-	MHD_get_connection_values (connection, MHD_HEADER_KIND, &print_out_key, NULL);
-	if(already_in == FALSE){
-		
-		LOCK_CLIENT_LIST();
 		client = client_list_add_client(ip);
-		UNLOCK_CLIENT_LIST();
 	}
-	safe_asprintf(&url_connect, "%s/cortona/connect?userToken=%s&userMAC=%s&UUID=%s&destination=%s", config->remote_auth_action, client->token, client->mac, UUID, to);
-	safe_asprintf(&redir,  "%s/navigate?to=%s", config->remote_auth_action, to);
-	authtarget = http_nodogsplash_make_authtarget(client->token, redir);
+	if (client) {
+		snprintf(url_connect, sizeof(url_connect), "%s/cortona/connect?userToken=%s&userMAC=%s&UUID=%s&destination=%s",
+				 config->remote_auth_action, client->token, mac, UUID, to);
+	}
+	UNLOCK_CLIENT_LIST();
+
+	if (!client) {
+		return MHD_NO;
+	}
 	debug(LOG_DEBUG, "Captured request for %s", to);
-	char *session_cookies = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "Cookie");
 
 	if (already_in == FALSE) {
-		if(can_mac_connects(client->mac) == TRUE){
-			return return_ok_page_js(connection, to);
+		/* Don't hold the server up while wifiLazooo answers */
+		admission = safe_malloc(sizeof(t_admission));
+		admission->connection = connection;
+		admission->allowed = FALSE;
+		strncpy(admission->ip, ip, sizeof(admission->ip) - 1);
+		admission->ip[sizeof(admission->ip) - 1] = '\0';
+		memcpy(admission->mac, mac, sizeof(mac));
+		memcpy(admission->to, to, sizeof(to));
+		memcpy(admission->url_connect, url_connect, sizeof(url_connect));
+		*con_cls = admission;
+		MHD_suspend_connection(connection);
+		if (can_mac_connects_async(mac, admission_answered, admission) != 0) {
+			MHD_resume_connection(connection);
 		}
+		return MHD_YES;
+	}
+	if (wl_breaker_open()) {
+		/* The connect URL is on wifiLazooo too */
+		return return_fallback(connection, ip, mac, to, url_connect);
 	}
 	//if (session_cookies != NULL && strstr(session_cookies, "WLBRDLGN") != NULL) {
     	//has the cookie setted
 	//	return return_page_js(connection, url_connect);
 	//}
 	return return_page(connection, url_connect);
-	//return return_page(connection, url_connect);
 }
 
 
@@ -682,8 +1048,8 @@ http_nodogsplash_serve_info(request *r, char *title, char *content)
 {
 	char *abspath;
 	char line [MAX_BUF];
-	char *infoskelfilename;
-	FILE *fd;
+	char *page, *start, *end;
+	size_t len;
 	s_config	*config;
 
 	config = config_get_config();
@@ -703,21 +1069,23 @@ http_nodogsplash_serve_info(request *r, char *title, char *content)
 	httpdAddVariable(r,"pagesdir",abspath);
 	free(abspath);
 
-	/* Pipe the page from its file */
-	safe_asprintf(&infoskelfilename, "%s/%s",
-				  config->webroot,
-				  config->infoskelpage );
+	/* Pipe the page from the asset cache, a line at a time as httpdOutput wants */
 	debug(LOG_INFO,"Serving info page %s title %s to %s",
-		  infoskelfilename,r->clientAddr);
-	if (!(fd = fopen(infoskelfilename, "r"))) {
-		debug(LOG_ERR, "Could not open info skel file '%s'", infoskelfilename);
-	} else {
-		while (fgets(line, MAX_BUF, fd)) {
-			httpdOutput(r,line);
-		}
-		fclose(fd);
+		  config->infoskelpage, title, r->clientAddr);
+	if (assets_copy(config->infoskelpage, &page) != 0) {
+		debug(LOG_ERR, "Could not find info skel file '%s/%s'", config->webroot, config->infoskelpage);
+		return;
+	}
+	for (start = page; *start; start = end) {
+		end = strchr(start, '\n');
+		end = end ? end + 1 : start + strlen(start);
+		len = end - start < MAX_BUF ? end - start : MAX_BUF - 1;
+		end = start + len;
+		memcpy(line, start, len);
+		line[len] = '\0';
+		httpdOutput(r,line);
 	}
-	free(infoskelfilename);
+	free(page);
 }
 
 void
@@ -31,7 +31,17 @@
 #include "auth.h"
 #include "httpd.h"
 #include "client_list.h"
+#include <sys/types.h>
 #include <sys/socket.h>
+/* For enum MHD_RequestTerminationCode */
+#include <microhttpd.h>
+
+struct MHD_Connection;
+
+/** Longest URL the captive pages redirect to */
+#define HTTP_URL_MAX 2048
+/** Largest captive page, which holds its URL twice */
+#define HTTP_PAGE_MAX (2 * 3 * HTTP_URL_MAX + 512)
 
 
 /**
@@ -55,6 +65,12 @@ typedef struct _auth_target_t {
 
 
 int on_client_connect (void *cls, const struct sockaddr *addr, socklen_t addrlen);
+void request_completed (void *cls, struct MHD_Connection *connection,
+                        void **con_cls, enum MHD_RequestTerminationCode toe);
+/**@brief Build the responses to OS captive portal probes */
+void http_probe_init(void);
+/**@brief Captive portal probe counters for the status output */
+char *http_probe_text(void);
 int answer_to_connection (void *cls, struct MHD_Connection *connection,
                       const char *url, const char *method,
                       const char *version, const char *upload_data,
@@ -63,6 +63,7 @@ static void ndsctl_trust(void);
 static void ndsctl_untrust(void);
 static void ndsctl_auth(void);
 static void ndsctl_deauth(void);
+static void ndsctl_rate(void);
 static void ndsctl_loglevel(void);
 static void ndsctl_username(void);
 static void ndsctl_password(void);
@@ -87,6 +88,7 @@ usage(void)
 	printf("  stop              Stop the running nodogsplash\n");
 	printf("  auth ip           Authenticate user with specified ip\n");
 	printf("  deauth mac|ip     Deauthenticate user with specified mac or ip\n");
+	printf("  rate mac|ip d u   Shape user at d kbit/s down and u kbit/s up, 0 0 for the default\n");
 	printf("  block mac         Block the given MAC address\n");
 	printf("  unblock mac       Unblock the given MAC address\n");
 	printf("  allow mac         Allow the given MAC address\n");
@@ -119,6 +121,7 @@ parse_commandline(int argc, char **argv)
 {
 	extern int optind;
 	int c;
+	char rate[64];
 
 	while (-1 != (c = getopt(argc, argv, "s:h"))) {
 		switch(c) {
@@ -226,6 +229,17 @@ parse_commandline(int argc, char **argv)
 			exit(1);
 		}
 		config.param = strdup(*(argv + optind + 1));
+	} else if (strcmp(*(argv + optind), "rate") == 0) {
+		config.command = NDSCTL_RATE;
+		if ((argc - (optind + 1)) < 3) {
+			fprintf(stderr, "ndsctl: Error: You must specify an IP "
+					"or a Mac address, a download and an upload rate\n");
+			usage();
+			exit(1);
+		}
+		snprintf(rate, sizeof(rate), "%s %d %d", *(argv + optind + 1),
+				 atoi(*(argv + optind + 2)), atoi(*(argv + optind + 3)));
+		config.param = strdup(rate);
 	} else if (strcmp(*(argv + optind), "loglevel") == 0) {
 		config.command = NDSCTL_LOGLEVEL;
 		if ((argc - (optind + 1)) <= 0) {
@@ -424,6 +438,14 @@ ndsctl_deauth(void)
 				  "Client %s not found.\n");
 }
 
+void
+ndsctl_rate(void)
+{
+	ndsctl_action("rate",
+				  "Client rate set to %s.\n",
+				  "Failed to set client rate to %s.\n");
+}
+
 void
 ndsctl_auth(void)
 {
@@ -532,6 +554,10 @@ main(int argc, char **argv)
 		ndsctl_deauth();
 		break;
 
+	case NDSCTL_RATE:
+		ndsctl_rate();
+		break;
+
 	case NDSCTL_LOGLEVEL:
 		ndsctl_loglevel();
 		break;
@@ -49,6 +49,7 @@
 #define NDSCTL_PASSWORD		14
 #define NDSCTL_USERNAME		15
 #define NDSCTL_CLIENTS 		16
+#define NDSCTL_RATE		17
 
 
 typedef struct {
@@ -69,6 +69,7 @@ static void ndsctl_trust(int, char *);
 static void ndsctl_untrust(int, char *);
 static void ndsctl_auth(int, char *);
 static void ndsctl_deauth(int, char *);
+static void ndsctl_rate(int, char *);
 static void ndsctl_loglevel(int, char *);
 static void ndsctl_password(int, char *);
 static void ndsctl_username(int, char *);
@@ -212,6 +213,8 @@ thread_ndsctl_handler(void *arg)
 		ndsctl_auth(fd, (request + 5));
 	} else if (strncmp(request, "deauth", 6) == 0) {
 		ndsctl_deauth(fd, (request + 7));
+	} else if (strncmp(request, "rate", 4) == 0) {
+		ndsctl_rate(fd, (request + 5));
 	} else if (strncmp(request, "loglevel", 8) == 0) {
 		ndsctl_loglevel(fd, (request + 9));
 	} else if (strncmp(request, "password", 8) == 0) {
@@ -342,6 +345,52 @@ ndsctl_deauth(int fd, char *arg)
 	debug(LOG_DEBUG, "Exiting ndsctl_deauth...");
 }
 
+static void
+ndsctl_rate(int fd, char *arg)
+{
+	t_client	*client;
+	char *ip, *mac;
+	char who[64];
+	int download_limit, upload_limit, rc;
+
+	debug(LOG_DEBUG, "Entering ndsctl_rate...");
+
+	/* arg should be IP or MAC address of client, download and upload limits */
+	debug(LOG_DEBUG, "Argument: %s (@%x)", arg, arg);
+	if (sscanf(arg, "%63s %d %d", who, &download_limit, &upload_limit) != 3 ||
+			download_limit < 0 || upload_limit < 0) {
+		write(fd, "No", 2);
+		return;
+	}
+
+	LOCK_CLIENT_LIST();
+
+	if ((client = client_list_find_by_ip(who)) != NULL);
+	else if ((client = client_list_find_by_mac(who)) != NULL);
+	else {
+		debug(LOG_DEBUG, "Client not found.");
+		UNLOCK_CLIENT_LIST();
+		write(fd, "No", 2);
+		return;
+	}
+
+	ip = safe_strdup(client->ip);
+	mac = safe_strdup(client->mac);
+	UNLOCK_CLIENT_LIST();
+
+	rc = auth_client_rate(ip, mac, download_limit, upload_limit);
+
+	free(ip);
+	free(mac);
+	if (rc == 0) {
+		write(fd, "Yes", 3);
+	} else {
+		write(fd, "No", 2);
+	}
+
+	debug(LOG_DEBUG, "Exiting ndsctl_rate...");
+}
+
 static void
 ndsctl_block(int fd, char *arg)
 {
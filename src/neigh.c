@@ -0,0 +1,442 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ \********************************************************************/
+
+/** @internal
+  @file neigh.c
+  @brief In-memory IPv4 neighbour cache
+
+  Looking a MAC up by scanning /proc/net/arp costs a file read per
+  request, and grows with the ARP table.  Instead, the kernel's IPv4
+  neighbour table is dumped once over rtnetlink, and then followed from
+  RTM_NEWNEIGH and RTM_DELNEIGH notifications into a hash of addresses
+  to MACs.  An address the kernel does not know is resolved on demand.
+
+  When notifications are lost, the table is dumped again.  Entries carry
+  the generation of the dump that last saw them, and those the new dump
+  did not mention are dropped once it is done.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/neighbour.h>
+
+#include "safe.h"
+#include "conf.h"
+#include "debug.h"
+#include "rtnl.h"
+#include "neigh.h"
+
+typedef struct _t_neigh {
+	in_addr_t ip;
+	char mac[18];
+	unsigned int generation;
+	struct _t_neigh *next;
+} t_neigh;
+
+static t_neigh *neigh_table[NEIGH_BUCKETS];
+static int neigh_entries = 0;
+/* Bumped by each dump of the kernel's table */
+static unsigned int neigh_generation = 0;
+/* Set once the dump has been read, until then lookups fall back to the kernel */
+static int neigh_ready = 0;
+static unsigned long neigh_hits = 0, neigh_misses = 0, neigh_resolved = 0;
+
+static pthread_mutex_t neigh_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Signalled when an address is learned */
+static pthread_cond_t neigh_cond = PTHREAD_COND_INITIALIZER;
+
+
+/** @internal
+ * Clients are mostly consecutive addresses of one subnet, whose host
+ * bits spread them evenly.
+ */
+static unsigned int
+_neigh_hash(in_addr_t ip)
+{
+	return ntohl(ip) & (NEIGH_BUCKETS - 1);
+}
+
+/** @internal
+ * Must be called with neigh_mutex held.
+ */
+static t_neigh *
+_neigh_find(in_addr_t ip)
+{
+	t_neigh *n;
+
+	for (n = neigh_table[_neigh_hash(ip)]; n != NULL; n = n->next) {
+		if (n->ip == ip) {
+			return n;
+		}
+	}
+	return NULL;
+}
+
+/** @internal
+ * Learn or forget the MAC of ip; mac NULL forgets it.
+ */
+static void
+_neigh_set(in_addr_t ip, const char *mac)
+{
+	t_neigh *n, **prev;
+
+	pthread_mutex_lock(&neigh_mutex);
+	if (mac) {
+		if ((n = _neigh_find(ip)) == NULL) {
+			n = safe_malloc(sizeof(t_neigh));
+			n->ip = ip;
+			n->next = neigh_table[_neigh_hash(ip)];
+			neigh_table[_neigh_hash(ip)] = n;
+			neigh_entries++;
+		}
+		strncpy(n->mac, mac, sizeof(n->mac));
+		n->generation = neigh_generation;
+		pthread_cond_broadcast(&neigh_cond);
+	} else {
+		for (prev = &neigh_table[_neigh_hash(ip)]; (n = *prev) != NULL; prev = &n->next) {
+			if (n->ip == ip) {
+				*prev = n->next;
+				free(n);
+				neigh_entries--;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&neigh_mutex);
+}
+
+/** @internal
+ * Apply an RTM_NEWNEIGH or RTM_DELNEIGH message to the cache.
+ */
+static int
+_neigh_update(struct nlmsghdr *h, void *arg)
+{
+	struct ndmsg *ndm = NLMSG_DATA(h);
+	struct rtattr *tb[NDA_MAX + 1];
+	unsigned char *ll;
+	char mac[18];
+	in_addr_t ip;
+	int len;
+
+	if (h->nlmsg_type != RTM_NEWNEIGH && h->nlmsg_type != RTM_DELNEIGH) {
+		return 0;
+	}
+	len = h->nlmsg_len - NLMSG_LENGTH(sizeof(*ndm));
+	if (len < 0 || ndm->ndm_family != AF_INET) {
+		return 0;
+	}
+
+	rtnl_parse_attrs(tb, NDA_MAX, (struct rtattr *) ((char *) ndm + NLMSG_ALIGN(sizeof(*ndm))), len);
+	if (!tb[NDA_DST] || RTA_PAYLOAD(tb[NDA_DST]) != sizeof(ip)) {
+		return 0;
+	}
+	memcpy(&ip, RTA_DATA(tb[NDA_DST]), sizeof(ip));
+
+	if (h->nlmsg_type == RTM_DELNEIGH || (ndm->ndm_state & (NUD_FAILED | NUD_INCOMPLETE))
+			|| !tb[NDA_LLADDR] || RTA_PAYLOAD(tb[NDA_LLADDR]) != 6) {
+		_neigh_set(ip, NULL);
+		return 0;
+	}
+
+	ll = RTA_DATA(tb[NDA_LLADDR]);
+	snprintf(mac, sizeof(mac), "%02x:%02x:%02x:%02x:%02x:%02x", ll[0], ll[1], ll[2], ll[3], ll[4], ll[5]);
+	_neigh_set(ip, mac);
+
+	return 0;
+}
+
+/** Copy the MAC of ip, as /proc/net/arp spells it, into mac, which has
+ *  room for 18 bytes.
+ *  Returns 0, or -1 if ip is not in the cache.
+ */
+int
+neigh_lookup(const char *ip, char *mac)
+{
+	struct in_addr addr;
+	t_neigh *n;
+
+	if (!inet_aton(ip, &addr)) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&neigh_mutex);
+	if ((n = _neigh_find(addr.s_addr)) != NULL) {
+		memcpy(mac, n->mac, sizeof(n->mac));
+		neigh_hits++;
+	} else {
+		neigh_misses++;
+	}
+	pthread_mutex_unlock(&neigh_mutex);
+
+	return n ? 0 : -1;
+}
+
+/** @internal
+ * Ask the kernel to resolve ip on the gateway interface, as a packet
+ * sent to it would.
+ */
+static int
+_neigh_solicit(in_addr_t ip)
+{
+	struct {
+		struct nlmsghdr n;
+		struct ndmsg ndm;
+		char buf[64];
+	} req;
+	char ext[128];
+	int fd, rc;
+
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct ndmsg));
+	req.n.nlmsg_type = RTM_NEWNEIGH;
+	req.n.nlmsg_flags = NLM_F_CREATE | NLM_F_REPLACE;
+	req.ndm.ndm_family = AF_INET;
+	req.ndm.ndm_state = NUD_NONE;
+	req.ndm.ndm_flags = NTF_USE;
+	req.ndm.ndm_ifindex = if_nametoindex(config_get_config()->gw_interface);
+	rtnl_addattr_l(&req.n, sizeof(req), NDA_DST, &ip, sizeof(ip));
+
+	if ((fd = rtnl_open()) < 0) {
+		return -1;
+	}
+	rc = rtnl_talk(fd, &req.n, ext, sizeof(ext));
+	close(fd);
+
+	if (rc != 0) {
+		debug(LOG_INFO, "Could not resolve %s: %s%s%s", inet_ntoa(*(struct in_addr *) &ip), strerror(-rc), ext[0] ? ": " : "", ext);
+	}
+	return rc;
+}
+
+/** As neigh_lookup(), but if ip is not in the cache, have the kernel
+ *  resolve it, and wait up to NEIGH_RESOLVE_WAIT milliseconds for the answer.
+ *  Returns 0, -1 if ip could not be resolved, or -2 if the cache is not
+ *  loaded yet.
+ */
+int
+neigh_resolve(const char *ip, char *mac)
+{
+	struct in_addr addr;
+	struct timespec deadline;
+	t_neigh *n;
+
+	if (neigh_lookup(ip, mac) == 0) {
+		return 0;
+	}
+	if (!neigh_ready) {
+		return -2;
+	}
+	if (!inet_aton(ip, &addr) || _neigh_solicit(addr.s_addr) != 0) {
+		return -1;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_nsec += NEIGH_RESOLVE_WAIT * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&neigh_mutex);
+	while ((n = _neigh_find(addr.s_addr)) == NULL) {
+		if (pthread_cond_timedwait(&neigh_cond, &neigh_mutex, &deadline) == ETIMEDOUT) {
+			break;
+		}
+	}
+	if ((n = _neigh_find(addr.s_addr)) != NULL) {
+		memcpy(mac, n->mac, sizeof(n->mac));
+		neigh_resolved++;
+	}
+	pthread_mutex_unlock(&neigh_mutex);
+
+	return n ? 0 : -1;
+}
+
+/** Return the counters of the cache as a status line.
+ *  Caller must free.
+ */
+char *
+neigh_text(void)
+{
+	char *text;
+
+	pthread_mutex_lock(&neigh_mutex);
+	safe_asprintf(&text, "Neighbour cache: %s%d entries; %lu hits, %lu misses, %lu resolved\n",
+				  neigh_ready ? "" : "loading, ", neigh_entries, neigh_hits, neigh_misses, neigh_resolved);
+	pthread_mutex_unlock(&neigh_mutex);
+
+	return text;
+}
+
+/** @internal
+ * Ask for a dump of the IPv4 neighbours on the notification socket, so
+ * it and the notifications are read by the same loop.
+ */
+static int
+_neigh_dump(int fd)
+{
+	struct {
+		struct nlmsghdr n;
+		struct ndmsg ndm;
+	} req;
+
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct ndmsg));
+	req.n.nlmsg_type = RTM_GETNEIGH;
+	req.n.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.ndm.ndm_family = AF_INET;
+
+	if (send(fd, &req, req.n.nlmsg_len, 0) < 0) {
+		debug(LOG_ERR, "Could not dump the neighbour table: %s", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/** @internal
+ * Start a dump of a new generation of the neighbour table.
+ */
+static int
+_neigh_reload(int fd)
+{
+	pthread_mutex_lock(&neigh_mutex);
+	neigh_generation++;
+	pthread_mutex_unlock(&neigh_mutex);
+
+	return _neigh_dump(fd);
+}
+
+/** @internal
+ * Drop the entries the last dump did not mention.
+ * Returns how many were dropped.
+ */
+static int
+_neigh_sweep(void)
+{
+	t_neigh *n, **prev;
+	int i, dropped = 0;
+
+	pthread_mutex_lock(&neigh_mutex);
+	for (i = 0; i < NEIGH_BUCKETS; i++) {
+		prev = &neigh_table[i];
+		while ((n = *prev) != NULL) {
+			if (n->generation != neigh_generation) {
+				*prev = n->next;
+				free(n);
+				neigh_entries--;
+				dropped++;
+			} else {
+				prev = &n->next;
+			}
+		}
+	}
+	pthread_mutex_unlock(&neigh_mutex);
+
+	return dropped;
+}
+
+/** Thread reading the neighbour table and its changes into the cache.
+ */
+void
+thread_neigh(const void *arg)
+{
+	struct sockaddr_nl addr;
+	struct nlmsghdr *h;
+	char *buf;
+	int fd, len, size = 1024 * 1024;
+	/* A dump is under way, and whether it may have lost messages */
+	int dumping = 1, overrun = 0, dropped;
+
+	if ((fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE)) < 0) {
+		debug(LOG_ERR, "Could not open rtnetlink socket: %s", strerror(errno));
+		return;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = RTMGRP_NEIGH;
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		debug(LOG_ERR, "Could not bind rtnetlink socket: %s", strerror(errno));
+		close(fd);
+		return;
+	}
+	/* Room for a burst of notifications, as when a busy AP comes up */
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+	buf = safe_malloc(RTNL_MSG_SIZE * 8);
+
+	if (_neigh_dump(fd) != 0) {
+		free(buf);
+		close(fd);
+		return;
+	}
+
+	while (1) {
+		len = recv(fd, buf, RTNL_MSG_SIZE * 8, 0);
+		if (len < 0) {
+			if (errno == ENOBUFS) {
+				/* Notifications were lost, read the whole table again */
+				debug(LOG_WARNING, "Neighbour notifications overran, reloading the neighbour table");
+				if (dumping) {
+					/* Only one dump at a time; start over once this one is done */
+					overrun = 1;
+				} else if (_neigh_reload(fd) == 0) {
+					dumping = 1;
+				}
+			} else if (errno != EINTR) {
+				debug(LOG_ERR, "recv(): %s", strerror(errno));
+			}
+			continue;
+		}
+
+		for (h = (struct nlmsghdr *) buf; NLMSG_OK(h, len); h = NLMSG_NEXT(h, len)) {
+			if (h->nlmsg_type == NLMSG_DONE) {
+				if (overrun) {
+					/* This dump may be missing entries, so it cannot tell which are gone */
+					overrun = 0;
+					dumping = _neigh_reload(fd) == 0;
+					continue;
+				}
+				dumping = 0;
+				if ((dropped = _neigh_sweep()) > 0) {
+					debug(LOG_INFO, "Dropped %d neighbours missing from the reloaded table", dropped);
+				}
+				if (!neigh_ready) {
+					debug(LOG_NOTICE, "Neighbour cache loaded, %d entries", neigh_entries);
+					neigh_ready = 1;
+				}
+			} else {
+				_neigh_update(h, NULL);
+			}
+		}
+	}
+}
@@ -0,0 +1,46 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file neigh.h
+    @brief In-memory IPv4 neighbour cache
+*/
+
+#ifndef _NEIGH_H_
+#define _NEIGH_H_
+
+/** Hash buckets of the cache, a power of two */
+#define NEIGH_BUCKETS 1024
+
+/** Milliseconds a lookup waits for an unknown address to be resolved */
+#define NEIGH_RESOLVE_WAIT 100
+
+/** @brief Copy the MAC of ip into mac, 18 bytes; 0 if known, -1 if not */
+int neigh_lookup(const char *ip, char *mac);
+
+/** @brief Like neigh_lookup(), having the kernel resolve an unknown ip; -2 until the cache is loaded */
+int neigh_resolve(const char *ip, char *mac);
+
+/** @brief Counters of the cache as a status line, caller must free */
+char *neigh_text(void);
+
+/** @brief Keep the cache in step with the kernel's neighbour table */
+void thread_neigh(const void *arg);
+
+#endif /* _NEIGH_H_ */
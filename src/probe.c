@@ -0,0 +1,387 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ \********************************************************************/
+
+/** @internal
+  @file probe.c
+  @brief Kernel and tool feature probing
+
+  Each feature is tried for real, by one shell script run in a throwaway
+  network namespace, so the live chains, sets and qdiscs are never
+  touched.  Everything the script creates goes away with the namespace.
+  The result is cached in FEATURES_FILE_PATH together with the kernel and
+  iptables versions it was found for.  A feature the configuration needs
+  but the cache lacks is probed again, in case a module was installed
+  since.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/utsname.h>
+
+#include "common.h"
+
+#include "safe.h"
+#include "conf.h"
+#include "debug.h"
+#include "util.h"
+#include "probe.h"
+
+extern pthread_mutex_t	config_mutex;
+
+/** Features shaping in IFB mode needs, besides htb */
+#define TC_IFB_FEATURES (FEATURE_IFB | FEATURE_INGRESS | FEATURE_MIRRED)
+
+/** A feature, and the command that only succeeds if it is there */
+typedef struct {
+	unsigned int feature;
+	const char *name;
+	const char *test;
+} t_probe;
+
+static const t_probe probes[] = {
+	{ FEATURE_OR_MARK, "or-mark", "iptables -t mangle -A PREROUTING -j MARK --or-mark 0x100" },
+	{ FEATURE_MARK_MASK, "mark-mask", "iptables -t filter -A FORWARD -m mark --mark 0x100/0x700 -j ACCEPT" },
+	{ FEATURE_IMQ, "imq", "iptables -t mangle -A POSTROUTING -j IMQ --todev 0" },
+	{ FEATURE_NFQUEUE, "nfqueue", "iptables -t mangle -A POSTROUTING -j NFQUEUE --queue-num 0 --queue-bypass" },
+	{ FEATURE_IPSET, "ipset", "ipset create ndsprobe hash:ip timeout 1 && iptables -t filter -A FORWARD -m set --match-set ndsprobe dst -j ACCEPT" },
+	{ FEATURE_NFT, "nft", "nft add table inet ndsprobe" },
+	{ FEATURE_NFT_FLOWTABLE, "flowtable", "nft 'add flowtable inet ndsprobe ft { hook ingress priority 0; devices = { lo }; }'" },
+	{ FEATURE_NFT_EGRESS, "nft-egress", "nft 'add table netdev ndsprobe; add chain netdev ndsprobe c { type filter hook egress device lo priority 0; }'" },
+	{ FEATURE_IFB, "ifb", "ip link add ndsprobe0 type ifb" },
+	{ FEATURE_HTB, "htb", "tc qdisc add dev lo root handle 1: htb" },
+	{ FEATURE_CAKE, "cake", "tc qdisc replace dev lo root cake" },
+	{ FEATURE_INGRESS, "ingress", "tc qdisc add dev lo ingress" },
+	{ FEATURE_MIRRED, "mirred", "tc qdisc replace dev lo ingress && tc filter add dev lo parent ffff: protocol ip u32 match u32 0 0 action connmark action mirred egress redirect dev lo" },
+	{ 0, NULL, NULL }
+};
+
+static pthread_mutex_t probe_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Features of this process, -1 until known */
+static int probed_features = -1;
+
+/** Whether this process has run the probe script already */
+static int probed = 0;
+
+
+/** @internal
+ * The key the cached features are valid for: kernel and iptables versions.
+ */
+static char *
+_probe_key(void)
+{
+	struct utsname uts;
+	char version[128] = "";
+	char *key, *p;
+	FILE *output;
+
+	if (uname(&uts) != 0) {
+		memset(&uts, 0, sizeof(uts));
+	}
+
+	output = execute_popen("iptables --version 2>/dev/null", "r");
+	if (output) {
+		if (!fgets(version, sizeof(version), output)) {
+			version[0] = '\0';
+		}
+		pclose(output);
+	}
+	if ((p = strchr(version, '\n'))) {
+		*p = '\0';
+	}
+
+	safe_asprintf(&key, "%s %s; %s", uts.release, uts.version, version);
+
+	return key;
+}
+
+/** @internal
+ * Read the cached features for key, -1 if there are none.
+ */
+static int
+_probe_read_cache(const char *key)
+{
+	FILE *file;
+	char line[512], *p;
+	unsigned int features;
+	int rc = -1;
+
+	if (!(file = fopen(FEATURES_FILE_PATH, "r"))) {
+		return -1;
+	}
+
+	if (fgets(line, sizeof(line), file)) {
+		if ((p = strchr(line, '\n'))) {
+			*p = '\0';
+		}
+		if (!strcmp(line, key) && fgets(line, sizeof(line), file) && sscanf(line, "0x%x", &features) == 1) {
+			rc = features;
+		}
+	}
+	fclose(file);
+
+	return rc;
+}
+
+/** @internal
+ * Cache the features for key, replacing the file in one step.
+ */
+static void
+_probe_write_cache(const char *key, unsigned int features)
+{
+	FILE *file;
+	char *tmp;
+
+	safe_asprintf(&tmp, "%s.tmp", FEATURES_FILE_PATH);
+
+	if (!(file = fopen(tmp, "w"))) {
+		debug(LOG_WARNING, "Cannot write features file %s: %s", tmp, strerror(errno));
+		free(tmp);
+		return;
+	}
+	fprintf(file, "%s\n0x%x\n", key, features);
+	if (fclose(file) != 0 || rename(tmp, FEATURES_FILE_PATH) != 0) {
+		debug(LOG_WARNING, "Cannot write features file %s: %s", FEATURES_FILE_PATH, strerror(errno));
+		unlink(tmp);
+	}
+
+	free(tmp);
+}
+
+/** @internal
+ * Run all the probes in one shell, inside a new network namespace.
+ * Returns the features found, or -1 if the namespace could not be made.
+ */
+static int
+_probe_run(void)
+{
+	struct sigaction sa, oldsa;
+	char *script, *p, line[64];
+	const t_probe *probe;
+	unsigned int features = 0;
+	int fds[2], status = 0, rc = 0;
+	FILE *output;
+	pid_t pid;
+
+	script = safe_strdup("");
+	for (probe = probes; probe->name; probe++) {
+		p = script;
+		safe_asprintf(&script, "%s(%s) >/dev/null 2>&1 && echo %s\n", p, probe->test, probe->name);
+		free(p);
+	}
+	p = script;
+	safe_asprintf(&script, "%sexit 0\n", p);
+	free(p);
+
+	if (pipe(fds) != 0) {
+		debug(LOG_ERR, "pipe(): %s", strerror(errno));
+		free(script);
+		return -1;
+	}
+
+	/* Reap the child here rather than in the SIGCHLD handler, like execute() */
+	sa.sa_handler = SIG_DFL;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_NOCLDSTOP | SA_RESTART;
+	sigaction(SIGCHLD, &sa, &oldsa);
+
+	pid = safe_fork();
+
+	if (pid == 0) {
+		close(fds[0]);
+		if (unshare(CLONE_NEWNET) != 0) {
+			_exit(2);
+		}
+		dup2(fds[1], 1);
+		close(2);
+		execl("/bin/sh", "sh", "-c", script, (char *) NULL);
+		_exit(1);
+	}
+
+	close(fds[1]);
+	free(script);
+
+	output = fdopen(fds[0], "r");
+	while (output && fgets(line, sizeof(line), output)) {
+		if ((p = strchr(line, '\n'))) {
+			*p = '\0';
+		}
+		for (probe = probes; probe->name; probe++) {
+			if (!strcmp(line, probe->name)) {
+				features |= probe->feature;
+			}
+		}
+	}
+	if (output) {
+		fclose(output);
+	} else {
+		close(fds[0]);
+	}
+
+	while (waitpid(pid, &status, 0) == -1 && errno == EINTR) {}
+	/* The script itself always exits 0 */
+	if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+		debug(LOG_WARNING, "Could not create a network namespace to probe features in");
+		rc = -1;
+	}
+
+	sigaction(SIGCHLD, &oldsa, NULL);
+
+	return rc == 0 ? (int) features : -1;
+}
+
+/** Get the features of this kernel and its tools.
+ *  Cached results are used unless they lack one of the required features.
+ *  Returns -1 if the features are unknown.
+ */
+int
+probe_features(unsigned int required)
+{
+	char *key, text[256];
+	int features;
+
+	pthread_mutex_lock(&probe_mutex);
+
+	if (probed_features >= 0 && (probed || (probed_features & required) == required)) {
+		features = probed_features;
+		pthread_mutex_unlock(&probe_mutex);
+		return features;
+	}
+
+	key = _probe_key();
+
+	features = _probe_read_cache(key);
+	if (features >= 0 && (features & required) == required) {
+		debug(LOG_DEBUG, "Using cached features from %s", FEATURES_FILE_PATH);
+	} else if (!probed) {
+		debug(LOG_NOTICE, "Probing kernel features");
+		probed = 1;
+		if ((features = _probe_run()) >= 0) {
+			_probe_write_cache(key, features);
+		}
+	}
+
+	if (features >= 0) {
+		probe_features_text(features, text, sizeof(text));
+		debug(LOG_INFO, "Kernel features: %s", text);
+	}
+
+	probed_features = features;
+	free(key);
+
+	pthread_mutex_unlock(&probe_mutex);
+
+	return features;
+}
+
+/** Turn off configured backends the kernel cannot support,
+ *  so that firewall setup does not fail half way.
+ */
+void
+probe_select_backends(void)
+{
+	s_config *config;
+	unsigned int required = 0;
+	int features;
+
+	LOCK_CONFIG();
+	config = config_get_config();
+
+	if (config->traffic_control) {
+		required |= (config->tc_qdisc == TC_QDISC_CAKE ? FEATURE_CAKE : FEATURE_HTB);
+		required |= (config->tc_mode == TC_MODE_IFB ? TC_IFB_FEATURES : FEATURE_IMQ);
+	}
+	if (config->flow_offload) {
+		required |= FEATURE_NFT_FLOWTABLE | FEATURE_NFT_EGRESS;
+	}
+	if (config->walled_garden) {
+		required |= FEATURE_IPSET;
+		if (config->walled_garden_snoop) {
+			required |= FEATURE_NFQUEUE;
+		}
+	}
+	UNLOCK_CONFIG();
+
+	if ((features = probe_features(required)) < 0) {
+		debug(LOG_WARNING, "Kernel features unknown, keeping the configured backends");
+		return;
+	}
+
+	LOCK_CONFIG();
+	if (config->traffic_control && config->tc_mode == TC_MODE_IMQ && !(features & FEATURE_IMQ)
+			&& (features & TC_IFB_FEATURES) == TC_IFB_FEATURES) {
+		debug(LOG_WARNING, "Kernel lacks IMQ support, shaping on %s and an ifb instead", config->gw_interface);
+		config->tc_mode = TC_MODE_IFB;
+	}
+	if (config->traffic_control && config->tc_qdisc == TC_QDISC_CAKE && !(features & FEATURE_CAKE)) {
+		debug(LOG_WARNING, "Kernel lacks CAKE support, shaping with an HTB class per client instead");
+		config->tc_qdisc = TC_QDISC_HTB;
+	}
+	if (config->traffic_control && !(features & FEATURE_HTB)) {
+		debug(LOG_ERR, "Kernel lacks HTB support, disabling TrafficControl");
+		config->traffic_control = 0;
+	} else if (config->traffic_control && config->tc_mode == TC_MODE_IFB && (features & TC_IFB_FEATURES) != TC_IFB_FEATURES) {
+		debug(LOG_ERR, "Kernel lacks ifb, ingress qdisc or tc action support, disabling TrafficControl");
+		config->traffic_control = 0;
+	} else if (config->traffic_control && config->tc_mode == TC_MODE_IMQ && !(features & FEATURE_IMQ)) {
+		debug(LOG_ERR, "Kernel lacks IMQ support, disabling TrafficControl");
+		config->traffic_control = 0;
+	}
+	if (config->flow_offload && (features & (FEATURE_NFT_FLOWTABLE | FEATURE_NFT_EGRESS)) != (FEATURE_NFT_FLOWTABLE | FEATURE_NFT_EGRESS)) {
+		debug(LOG_ERR, "Kernel lacks nft flowtable or egress hook support, disabling FlowOffload");
+		config->flow_offload = 0;
+	}
+	if (config->walled_garden && !(features & FEATURE_IPSET)) {
+		debug(LOG_ERR, "Kernel lacks ipset support, disabling WalledGarden");
+		config->walled_garden = 0;
+	}
+	if (config->walled_garden_snoop && !(features & FEATURE_NFQUEUE)) {
+		debug(LOG_ERR, "Kernel lacks NFQUEUE support, disabling WalledGardenSnoop");
+		config->walled_garden_snoop = 0;
+	}
+	UNLOCK_CONFIG();
+}
+
+/** Write the names of the given features, separated by spaces, into buf */
+void
+probe_features_text(unsigned int features, char *buf, size_t len)
+{
+	const t_probe *probe;
+	size_t used = 0;
+
+	buf[0] = '\0';
+	for (probe = probes; probe->name && used < len; probe++) {
+		if (features & probe->feature) {
+			snprintf(buf + used, len - used, "%s%s", used ? " " : "", probe->name);
+			used = strlen(buf);
+		}
+	}
+}
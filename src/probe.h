@@ -0,0 +1,57 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file probe.h
+    @brief Kernel and tool feature probing
+*/
+
+#ifndef _PROBE_H_
+#define _PROBE_H_
+
+/** Cache of the probed features, valid for one kernel and iptables version */
+#define FEATURES_FILE_PATH "/etc/nodogsplash/features"
+
+/*@{*/
+/** Features found by probe_features() */
+#define FEATURE_OR_MARK		0x0001	/**< iptables MARK --or-mark */
+#define FEATURE_MARK_MASK	0x0002	/**< iptables -m mark --mark value/mask */
+#define FEATURE_IMQ		0x0004	/**< iptables IMQ target */
+#define FEATURE_NFQUEUE		0x0008	/**< iptables NFQUEUE target with --queue-bypass */
+#define FEATURE_IPSET		0x0010	/**< ipset with timeouts, and iptables -m set */
+#define FEATURE_NFT		0x0020	/**< nftables */
+#define FEATURE_NFT_FLOWTABLE	0x0040	/**< nftables flowtables */
+#define FEATURE_NFT_EGRESS	0x0080	/**< nftables netdev egress hook */
+#define FEATURE_IFB		0x0100	/**< ifb devices */
+#define FEATURE_HTB		0x0200	/**< htb qdisc */
+#define FEATURE_CAKE		0x0400	/**< cake qdisc */
+#define FEATURE_INGRESS		0x0800	/**< ingress qdisc */
+#define FEATURE_MIRRED		0x1000	/**< tc connmark and mirred actions */
+/*@}*/
+
+/** @brief Get the features of this kernel and its tools, probing them if needed */
+int probe_features(unsigned int required);
+
+/** @brief Turn off configured backends the kernel cannot support */
+void probe_select_backends(void);
+
+/** @brief Write the names of the given features into buf */
+void probe_features_text(unsigned int features, char *buf, size_t len);
+
+#endif /* _PROBE_H_ */
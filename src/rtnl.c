@@ -0,0 +1,295 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ \********************************************************************/
+
+/** @internal
+  @file rtnl.c
+  @brief Minimal rtnetlink helpers
+
+  Just enough of libnetlink to send requests to the kernel and read back
+  acknowledgements and dumps.  Callers open a socket per operation, so
+  no state is shared between threads.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "debug.h"
+#include "cmdstat.h"
+#include "rtnl.h"
+
+/** Receive buffer, large enough for a dump of many tc classes per read */
+#define RTNL_RECV_SIZE 32768
+
+static unsigned int rtnl_seq = 0;
+
+
+/** Open an rtnetlink socket bound to this process.
+ *  Returns the socket, or -1 on error.
+ */
+int
+rtnl_open(void)
+{
+	struct sockaddr_nl addr;
+	int fd, one = 1;
+
+	if ((fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE)) < 0) {
+		debug(LOG_ERR, "Could not open rtnetlink socket: %s", strerror(errno));
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		debug(LOG_ERR, "Could not bind rtnetlink socket: %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	/* Ask for the kernel's own error messages, without the failed request echoed back */
+	setsockopt(fd, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one));
+	setsockopt(fd, SOL_NETLINK, NETLINK_EXT_ACK, &one, sizeof(one));
+
+	return fd;
+}
+
+/** @internal
+ * Send a request with a fresh sequence number.
+ */
+static int
+_rtnl_send(int fd, struct nlmsghdr *n)
+{
+	struct sockaddr_nl addr;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+
+	n->nlmsg_seq = __sync_add_and_fetch(&rtnl_seq, 1) ^ (unsigned int) time(NULL);
+
+	if (sendto(fd, n, n->nlmsg_len, 0, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		return -errno;
+	}
+
+	return 0;
+}
+
+/** @internal
+ * Copy the kernel's message from an error acknowledgement into ext.
+ */
+static void
+_rtnl_extack(struct nlmsghdr *h, char *ext, size_t extlen)
+{
+	struct nlmsgerr *err = NLMSG_DATA(h);
+	struct rtattr *rta;
+	int offset, len;
+
+	if (!(h->nlmsg_flags & NLM_F_ACK_TLVS)) {
+		return;
+	}
+
+	offset = sizeof(*err);
+	if (!(h->nlmsg_flags & NLM_F_CAPPED)) {
+		offset += err->msg.nlmsg_len - sizeof(struct nlmsghdr);
+	}
+	len = h->nlmsg_len - NLMSG_LENGTH(offset);
+
+	for (rta = (struct rtattr *) ((char *) err + offset); len > 0 && RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == NLMSGERR_ATTR_MSG) {
+			snprintf(ext, extlen, "%.*s", (int) RTA_PAYLOAD(rta), (char *) RTA_DATA(rta));
+		}
+	}
+}
+
+/** @internal
+ * Read replies to request n, handing each one to filter, until the
+ * acknowledgement or the end of the dump.
+ */
+static int
+_rtnl_recv(int fd, struct nlmsghdr *n, rtnl_filter_t filter, void *arg, char *ext, size_t extlen)
+{
+	char *buf;
+	struct nlmsghdr *h;
+	struct nlmsgerr *err;
+	int len, rc = 1;
+
+	buf = malloc(RTNL_RECV_SIZE);
+	if (!buf) {
+		return -ENOMEM;
+	}
+
+	while (rc > 0) {
+		len = recv(fd, buf, RTNL_RECV_SIZE, 0);
+		if (len < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			rc = -errno;
+			break;
+		}
+		if (len == 0) {
+			rc = -ECONNRESET;
+			break;
+		}
+
+		for (h = (struct nlmsghdr *) buf; rc > 0 && NLMSG_OK(h, len); h = NLMSG_NEXT(h, len)) {
+			if (h->nlmsg_seq != n->nlmsg_seq) {
+				continue;
+			}
+			if (h->nlmsg_type == NLMSG_DONE) {
+				rc = 0;
+			} else if (h->nlmsg_type == NLMSG_ERROR) {
+				err = NLMSG_DATA(h);
+				rc = h->nlmsg_len < NLMSG_LENGTH(sizeof(*err)) ? -EINVAL : err->error;
+				if (rc != 0 && ext) {
+					_rtnl_extack(h, ext, extlen);
+				}
+			} else if (filter && filter(h, arg) != 0) {
+				/* Stop here, but let the kernel finish the dump into the closing socket */
+				rc = 0;
+			}
+		}
+	}
+
+	free(buf);
+
+	return rc;
+}
+
+/** Send a request and wait for the kernel to acknowledge it.
+ *  Returns 0, or the negative errno the kernel answered with.
+ *  If ext is not NULL, the kernel's explanation of an error, if it gave
+ *  one, is copied into it.
+ *  In dry run mode the request is only logged, and succeeds.
+ */
+int
+rtnl_talk(int fd, struct nlmsghdr *n, char *ext, size_t extlen)
+{
+	int rc;
+
+	if (ext && extlen) {
+		ext[0] = '\0';
+	}
+
+	cmdstat_netlink();
+	if (cmdstat_dry_run()) {
+		debug(LOG_INFO, "Dry run: rtnetlink message type %d flags 0x%x, %u bytes",
+			  n->nlmsg_type, n->nlmsg_flags, n->nlmsg_len);
+		return 0;
+	}
+
+	n->nlmsg_flags |= NLM_F_REQUEST | NLM_F_ACK;
+
+	if ((rc = _rtnl_send(fd, n)) != 0) {
+		return rc;
+	}
+
+	return _rtnl_recv(fd, n, NULL, NULL, ext, extlen);
+}
+
+/** Send a dump request and call filter on each message of the reply.
+ *  Returns 0, or a negative errno.
+ *  In dry run mode nothing is sent, and the dump is empty.
+ */
+int
+rtnl_dump(int fd, struct nlmsghdr *n, rtnl_filter_t filter, void *arg)
+{
+	int rc;
+
+	cmdstat_netlink();
+	if (cmdstat_dry_run()) {
+		return 0;
+	}
+
+	n->nlmsg_flags |= NLM_F_REQUEST | NLM_F_DUMP;
+
+	if ((rc = _rtnl_send(fd, n)) != 0) {
+		return rc;
+	}
+
+	return _rtnl_recv(fd, n, filter, arg, NULL, 0);
+}
+
+/** Append attribute type to request n, which has room for maxlen bytes */
+int
+rtnl_addattr_l(struct nlmsghdr *n, int maxlen, int type, const void *data, int alen)
+{
+	struct rtattr *rta;
+	int len = RTA_LENGTH(alen);
+
+	if (NLMSG_ALIGN(n->nlmsg_len) + RTA_ALIGN(len) > (unsigned int) maxlen) {
+		debug(LOG_ERR, "rtnetlink attribute %d does not fit in %d bytes", type, maxlen);
+		return -1;
+	}
+
+	rta = (struct rtattr *) (((char *) n) + NLMSG_ALIGN(n->nlmsg_len));
+	rta->rta_type = type;
+	rta->rta_len = len;
+	if (alen) {
+		memcpy(RTA_DATA(rta), data, alen);
+	}
+	n->nlmsg_len = NLMSG_ALIGN(n->nlmsg_len) + RTA_ALIGN(len);
+
+	return 0;
+}
+
+int
+rtnl_addattr32(struct nlmsghdr *n, int maxlen, int type, __u32 data)
+{
+	return rtnl_addattr_l(n, maxlen, type, &data, sizeof(data));
+}
+
+/** Start nested attribute type; its length is fixed up by rtnl_nest_end() */
+struct rtattr *
+rtnl_nest(struct nlmsghdr *n, int maxlen, int type)
+{
+	struct rtattr *nest = (struct rtattr *) (((char *) n) + NLMSG_ALIGN(n->nlmsg_len));
+
+	rtnl_addattr_l(n, maxlen, type, NULL, 0);
+
+	return nest;
+}
+
+void
+rtnl_nest_end(struct nlmsghdr *n, struct rtattr *nest)
+{
+	nest->rta_len = (char *) n + n->nlmsg_len - (char *) nest;
+}
+
+/** Fill tb[0..max] with the attributes found in rta, NULL where absent */
+void
+rtnl_parse_attrs(struct rtattr *tb[], int max, struct rtattr *rta, int len)
+{
+	memset(tb, 0, sizeof(struct rtattr *) * (max + 1));
+
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type <= max && !tb[rta->rta_type]) {
+			tb[rta->rta_type] = rta;
+		}
+	}
+}
@@ -0,0 +1,62 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file rtnl.h
+    @brief Minimal rtnetlink helpers
+*/
+
+#ifndef _RTNL_H_
+#define _RTNL_H_
+
+#include <stddef.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+/** Room for the largest request we build, an htb class with both rate tables */
+#define RTNL_MSG_SIZE 4096
+
+/** @brief Callback for each message of a dump; nonzero stops the dump */
+typedef int (*rtnl_filter_t)(struct nlmsghdr *n, void *arg);
+
+/** @brief Open an rtnetlink socket */
+int rtnl_open(void);
+
+/** @brief Send a request and wait for its acknowledgement, returns 0 or -errno */
+int rtnl_talk(int fd, struct nlmsghdr *n, char *ext, size_t extlen);
+
+/** @brief Send a dump request and pass each reply to filter, returns 0 or -errno */
+int rtnl_dump(int fd, struct nlmsghdr *n, rtnl_filter_t filter, void *arg);
+
+/** @brief Append an attribute to a request */
+int rtnl_addattr_l(struct nlmsghdr *n, int maxlen, int type, const void *data, int alen);
+
+/** @brief Append a 32 bit attribute to a request */
+int rtnl_addattr32(struct nlmsghdr *n, int maxlen, int type, __u32 data);
+
+/** @brief Start a nested attribute */
+struct rtattr *rtnl_nest(struct nlmsghdr *n, int maxlen, int type);
+
+/** @brief Close a nested attribute */
+void rtnl_nest_end(struct nlmsghdr *n, struct rtattr *nest);
+
+/** @brief Index the attributes of a message by type */
+void rtnl_parse_attrs(struct rtattr *tb[], int max, struct rtattr *rta, int len);
+
+#endif /* _RTNL_H_ */
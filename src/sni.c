@@ -0,0 +1,366 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ \********************************************************************/
+
+/** @internal
+  @file sni.c
+  @brief Reset listener for preauthenticated HTTPS
+
+  Port 443 from preauthenticated clients is redirected here.  No
+  handshake with them can succeed, so rather than attempt one, each
+  connection is only read far enough to find the server name in its TLS
+  ClientHello, and is then reset.  The data is peeked, never copied out
+  of the socket, so a connection costs no buffer of its own.  The names
+  are counted, and the last one of each client is kept as a hint of
+  where to send it once it is through the portal.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "safe.h"
+#include "debug.h"
+#include "gateway.h"
+#include "sni.h"
+
+typedef struct {
+	int fd;			/* -1 when the slot is free */
+	in_addr_t ip;
+	time_t accepted;
+} t_sni_conn;
+
+typedef struct {
+	char name[64];
+	unsigned long hits;
+} t_sni_name;
+
+typedef struct {
+	in_addr_t ip;
+	time_t seen;
+	char name[64];
+} t_sni_hint;
+
+static t_sni_conn sni_conns[SNI_MAX_CONN];
+static t_sni_name sni_names[SNI_NAMES];
+static t_sni_hint sni_hints[SNI_HINTS];
+static unsigned long sni_connections = 0, sni_named = 0, sni_unnamed = 0;
+static unsigned long sni_timeouts = 0, sni_overflows = 0;
+
+static pthread_mutex_t sni_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/** @internal
+ * Find the server name in the TLS ClientHello of len bytes at buf.
+ * Returns 1 with it in name, 0 if more bytes are needed, or -1 if
+ * the connection is not TLS or names no server.
+ */
+static int
+_sni_parse(const unsigned char *buf, size_t len, char *name, size_t size)
+{
+	size_t end, pos, ext_end, type, ext_len, name_len;
+
+	/* record header: handshake, version, length */
+	if (len < 5)
+		return 0;
+	if (buf[0] != 0x16 || buf[1] != 0x03)
+		return -1;
+	end = 5 + ((buf[3] << 8) | buf[4]);
+	if (end > SNI_PEEK_MAX)
+		end = SNI_PEEK_MAX;
+
+	/* handshake header: ClientHello, length; then version and random */
+	pos = 5;
+	if (pos + 4 > end)
+		return -1;
+	if (pos + 4 > len)
+		return 0;
+	if (buf[pos] != 0x01)
+		return -1;
+	pos += 4 + 2 + 32;
+
+	/* session id, cipher suites, compression methods */
+	if (pos + 1 > len)
+		return pos + 1 > end ? -1 : 0;
+	pos += 1 + buf[pos];
+	if (pos + 2 > len)
+		return pos + 2 > end ? -1 : 0;
+	pos += 2 + ((buf[pos] << 8) | buf[pos + 1]);
+	if (pos + 1 > len)
+		return pos + 1 > end ? -1 : 0;
+	pos += 1 + buf[pos];
+
+	/* extensions */
+	if (pos + 2 > len)
+		return pos + 2 > end ? -1 : 0;
+	ext_end = pos + 2 + ((buf[pos] << 8) | buf[pos + 1]);
+	pos += 2;
+	while (pos + 4 <= ext_end) {
+		if (pos + 4 > len)
+			return pos + 4 > end ? -1 : 0;
+		type = (buf[pos] << 8) | buf[pos + 1];
+		ext_len = (buf[pos + 2] << 8) | buf[pos + 3];
+		pos += 4;
+		if (type == 0) {
+			/* server name list: length, then type 0, length, host name */
+			if (pos + 5 > len)
+				return pos + 5 > end ? -1 : 0;
+			if (buf[pos + 2] != 0)
+				return -1;
+			name_len = (buf[pos + 3] << 8) | buf[pos + 4];
+			pos += 5;
+			if (pos + name_len > len)
+				return pos + name_len > end ? -1 : 0;
+			if (name_len == 0 || name_len >= size)
+				return -1;
+			memcpy(name, buf + pos, name_len);
+			name[name_len] = '\0';
+			return 1;
+		}
+		pos += ext_len;
+	}
+	return -1;
+}
+
+/** @internal
+ * Count name, and keep it as the hint for ip. When the table of names
+ * is full the least counted gives way, inheriting its count, so that
+ * names asked for often still rise to the top.
+ */
+static void
+_sni_record(in_addr_t ip, const char *name)
+{
+	t_sni_name *n, *least = sni_names;
+	t_sni_hint *hint;
+
+	pthread_mutex_lock(&sni_mutex);
+	sni_named++;
+	for (n = sni_names; n < sni_names + SNI_NAMES; n++) {
+		if (n->hits && !strcmp(n->name, name))
+			break;
+		if (n->hits < least->hits)
+			least = n;
+	}
+	if (n == sni_names + SNI_NAMES) {
+		n = least;
+		strncpy(n->name, name, sizeof(n->name) - 1);
+		n->name[sizeof(n->name) - 1] = '\0';
+	}
+	n->hits++;
+
+	hint = &sni_hints[ntohl(ip) & (SNI_HINTS - 1)];
+	hint->ip = ip;
+	hint->seen = time(NULL);
+	strncpy(hint->name, name, sizeof(hint->name) - 1);
+	hint->name[sizeof(hint->name) - 1] = '\0';
+	pthread_mutex_unlock(&sni_mutex);
+}
+
+/** @internal
+ * Close fd with a reset, rather than a FIN.
+ */
+static void
+_sni_reset(int fd)
+{
+	struct linger linger = { 1, 0 };
+
+	setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+	close(fd);
+}
+
+/** @internal
+ * Peek at what conn has sent so far; reset it once its server name is
+ * known or cannot be.
+ */
+static void
+_sni_read(t_sni_conn *conn)
+{
+	unsigned char buf[SNI_PEEK_MAX];
+	char name[64], ip[INET_ADDRSTRLEN];
+	ssize_t len;
+	int rc;
+
+	len = recv(conn->fd, buf, sizeof(buf), MSG_PEEK | MSG_DONTWAIT);
+	if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return;
+	rc = len > 0 ? _sni_parse(buf, len, name, sizeof(name)) : -1;
+	if (rc == 0 && len < (ssize_t) sizeof(buf))
+		return;
+
+	if (rc == 1) {
+		inet_ntop(AF_INET, &conn->ip, ip, sizeof(ip));
+		debug(LOG_DEBUG, "HTTPS from %s for %s, reset", ip, name);
+		_sni_record(conn->ip, name);
+	} else {
+		pthread_mutex_lock(&sni_mutex);
+		sni_unnamed++;
+		pthread_mutex_unlock(&sni_mutex);
+	}
+	_sni_reset(conn->fd);
+	conn->fd = -1;
+}
+
+int
+sni_hint(const char *ip, char *name, size_t size)
+{
+	struct in_addr addr;
+	t_sni_hint *hint;
+	int rc = -1;
+
+	if (!inet_aton(ip, &addr))
+		return -1;
+
+	pthread_mutex_lock(&sni_mutex);
+	hint = &sni_hints[ntohl(addr.s_addr) & (SNI_HINTS - 1)];
+	if (hint->seen && hint->ip == addr.s_addr && time(NULL) - hint->seen < SNI_HINT_TIME) {
+		snprintf(name, size, "%s", hint->name);
+		rc = 0;
+	}
+	pthread_mutex_unlock(&sni_mutex);
+
+	return rc;
+}
+
+char *
+sni_text(void)
+{
+	char *text, *top = NULL, *line;
+	t_sni_name *n, *best;
+	int shown[SNI_NAMES] = { 0 };
+	int i, j;
+
+	pthread_mutex_lock(&sni_mutex);
+	/* the five most asked names */
+	for (i = 0; i < 5; i++) {
+		best = NULL;
+		for (j = 0, n = sni_names; j < SNI_NAMES; j++, n++) {
+			if (n->hits && !shown[j] && (!best || n->hits > best->hits))
+				best = n;
+		}
+		if (!best)
+			break;
+		shown[best - sni_names] = 1;
+		safe_asprintf(&line, "%s%s %s %lu", top ? top : "", top ? "," : "", best->name, best->hits);
+		free(top);
+		top = line;
+	}
+	safe_asprintf(&text, "HTTPS reset: %lu connections, %lu with server name, %lu without, %lu timed out, %lu over limit\n"
+				  "HTTPS server names:%s\n",
+				  sni_connections, sni_named, sni_unnamed, sni_timeouts, sni_overflows, top ? top : " none");
+	pthread_mutex_unlock(&sni_mutex);
+	free(top);
+
+	return text;
+}
+
+void
+thread_sni(const void *arg)
+{
+	struct sockaddr_in addr;
+	socklen_t addrlen;
+	struct epoll_event ev, events[64];
+	t_sni_conn *conn;
+	time_t now;
+	int listen_fd, epfd, fd, n, i, on = 1;
+
+	for (i = 0; i < SNI_MAX_CONN; i++)
+		sni_conns[i].fd = -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(SSL_PORT);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if ((listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0 ||
+			setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+			bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+			listen(listen_fd, SOMAXCONN) < 0 ||
+			(epfd = epoll_create1(0)) < 0) {
+		debug(LOG_ERR, "Could not listen for HTTPS on port %d: %s", SSL_PORT, strerror(errno));
+		return;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+	debug(LOG_NOTICE, "Resetting preauthenticated HTTPS on port %d", SSL_PORT);
+
+	while (1) {
+		n = epoll_wait(epfd, events, 64, 1000);
+		if (n < 0 && errno != EINTR) {
+			debug(LOG_ERR, "epoll_wait(): %s", strerror(errno));
+			return;
+		}
+
+		for (i = 0; i < n; i++) {
+			if ((conn = events[i].data.ptr) != NULL) {
+				if (conn->fd >= 0)
+					_sni_read(conn);
+				continue;
+			}
+			/* new connections */
+			while (1) {
+				addrlen = sizeof(addr);
+				fd = accept4(listen_fd, (struct sockaddr *) &addr, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+				if (fd < 0)
+					break;
+				for (conn = sni_conns; conn < sni_conns + SNI_MAX_CONN && conn->fd >= 0; conn++)
+					;
+				pthread_mutex_lock(&sni_mutex);
+				sni_connections++;
+				if (conn == sni_conns + SNI_MAX_CONN)
+					sni_overflows++;
+				pthread_mutex_unlock(&sni_mutex);
+				if (conn == sni_conns + SNI_MAX_CONN) {
+					_sni_reset(fd);
+					continue;
+				}
+				conn->fd = fd;
+				conn->ip = addr.sin_addr.s_addr;
+				conn->accepted = time(NULL);
+				/* woken when more of the ClientHello arrives, peeked data stays queued */
+				ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+				ev.data.ptr = conn;
+				epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+				_sni_read(conn);
+			}
+		}
+
+		/* reset connections that never said enough */
+		now = time(NULL);
+		for (conn = sni_conns; conn < sni_conns + SNI_MAX_CONN; conn++) {
+			if (conn->fd >= 0 && now - conn->accepted > SNI_TIMEOUT) {
+				pthread_mutex_lock(&sni_mutex);
+				sni_timeouts++;
+				pthread_mutex_unlock(&sni_mutex);
+				_sni_reset(conn->fd);
+				conn->fd = -1;
+			}
+		}
+	}
+}
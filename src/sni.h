@@ -0,0 +1,55 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file sni.h
+    @brief Reset listener for preauthenticated HTTPS
+*/
+
+#ifndef _SNI_H_
+#define _SNI_H_
+
+/** Connections waiting for their ClientHello at once; more are reset unread */
+#define SNI_MAX_CONN 256
+
+/** Seconds a connection may take to send its ClientHello */
+#define SNI_TIMEOUT 3
+
+/** Most bytes of ClientHello read looking for the server name */
+#define SNI_PEEK_MAX 4096
+
+/** Server names counted for the status output */
+#define SNI_NAMES 32
+
+/** Slots remembering the last server name of a client, a power of two */
+#define SNI_HINTS 256
+
+/** Seconds a client's last server name stays a redirect hint */
+#define SNI_HINT_TIME 60
+
+/** @brief Copy the server name ip last asked for over HTTPS into name; 0 if known, -1 if not */
+int sni_hint(const char *ip, char *name, size_t size);
+
+/** @brief Counters and most asked server names as status lines, caller must free */
+char *sni_text(void);
+
+/** @brief Read the server name of each HTTPS connection on SSL_PORT, then reset it */
+void thread_sni(const void *arg);
+
+#endif /* _SNI_H_ */
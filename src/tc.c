@@ -22,14 +22,23 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <stdarg.h>
 #include <syslog.h>
 #include <errno.h>
 #include <string.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <net/if.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <linux/pkt_sched.h>
+#include <linux/pkt_cls.h>
+#include <linux/gen_stats.h>
+#include <linux/if_link.h>
+#include <linux/tc_act/tc_connmark.h>
+#include <linux/tc_act/tc_mirred.h>
 
 #include "common.h"
 
@@ -41,131 +50,921 @@
 #include "firewall.h"
 #include "debug.h"
 #include "util.h"
+#include "rtnl.h"
+#include "cmdstat.h"
 
 #include "tc.h"
 
+extern pthread_mutex_t client_list_mutex;
+extern pthread_mutex_t config_mutex;
 
 /**
  * Make this nonzero to supress the error output during destruction.
  */
 static int tc_quiet = 0;
 
+/** A traffic control request: header, tcmsg, and room for its attributes */
+typedef struct {
+	struct nlmsghdr n;
+	struct tcmsg t;
+	char buf[RTNL_MSG_SIZE];
+} t_tc_req;
 
-/** @internal */
+static pthread_once_t tc_core_once = PTHREAD_ONCE_INIT;
+
+/** Whether client marks are mapped onto classes by one flow filter,
+ *  rather than by a fw filter per client */
+static int tc_flow_map = 1;
+
+/** Number of client slots whose classes were created up front by
+ *  tc_init_tc(), and are only re-rated on (de)authentication */
+static int tc_pool_size = 0;
+
+/** Parent of the class of each slot of the pool, on both devices */
+static __u32 *tc_pool_parent = NULL;
+
+/** Packet scheduler ticks per microsecond, from /proc/net/psched */
+static double tick_in_usec = 1;
+
+
+/** @internal
+ * Read the packet scheduler clock the kernel expects times in, like tc does.
+ */
+static void
+_tc_core_init(void)
+{
+	FILE *fp;
+	unsigned int t2us, us2t, clock_res;
+
+	if (!(fp = fopen("/proc/net/psched", "r"))) {
+		debug(LOG_WARNING, "Could not open /proc/net/psched: %s", strerror(errno));
+		return;
+	}
+
+	if (fscanf(fp, "%08x%08x%08x", &t2us, &us2t, &clock_res) == 3 && us2t) {
+		/* Nanosecond clock, see tc_core_init() in iproute2 */
+		if (clock_res == 1000000000) {
+			t2us = us2t;
+		}
+		tick_in_usec = (double) t2us / us2t * ((double) clock_res / 1000000);
+	}
+
+	fclose(fp);
+}
+
+/** @internal
+ * Time, in scheduler ticks, to send size bytes at rate bytes/s.
+ */
+static unsigned int
+tc_xmittime(unsigned int rate, unsigned int size)
+{
+	return (unsigned int) (tick_in_usec * 1000000.0 * size / rate);
+}
+
+/** @internal
+ * Fill in the rate table for r, and the cell size it is indexed by.
+ * The kernel only uses the table on links of unknown link layer, but
+ * older kernels insist on it.
+ */
+static void
+tc_calc_rtable(struct tc_ratespec *r, __u32 *rtab, int mtu)
+{
+	int i, cell_log = 0;
+
+	while ((mtu >> cell_log) > 255) {
+		cell_log++;
+	}
+
+	for (i = 0; i < TC_RTAB_SIZE / (int) sizeof(__u32); i++) {
+		rtab[i] = tc_xmittime(r->rate, (i + 1) << cell_log);
+	}
+
+	r->cell_align = -1;
+	r->cell_log = cell_log;
+	r->linklayer = TC_LINKLAYER_ETHERNET;
+}
+
+/** @internal
+ * The firewall mark of a client, as written into its iptables MARK rules.
+ */
+static __u32
+tc_client_mark(int idx, int fw_mark)
+{
+	char mark[32];
+
+	snprintf(mark, sizeof(mark), "0x%x%x", idx + 10, fw_mark);
+
+	return strtoul(mark, NULL, 16);
+}
+
+/** @internal
+ * Number of bits the client index is shifted left by in a client mark,
+ * the hex digits of fw_mark.
+ */
+static int
+tc_mark_shift(int fw_mark)
+{
+	char mark[16];
+
+	return 4 * snprintf(mark, sizeof(mark), "%x", fw_mark);
+}
+
+/** @internal
+ * Index of device dev, or 0 if there is none. A dry run shapes devices
+ * that need not exist, so any name gets TC_DRY_RUN_IFINDEX there.
+ */
+static int
+_tc_ifindex(const char *dev)
+{
+	if (cmdstat_dry_run()) {
+		return TC_DRY_RUN_IFINDEX;
+	}
+	return if_nametoindex(dev);
+}
+
+/** @internal
+ * Start a request of the given type on device dev.
+ * Returns 0, or -ENODEV if there is no such device.
+ */
 static int
-tc_do_command(char *format, ...)
+tc_req_init(t_tc_req *req, int type, int flags, const char *dev, __u32 parent, __u32 handle, __u32 info)
 {
-	va_list vlist;
-	char *fmt_cmd;
-	char *cmd;
+	int ifindex;
+
+	memset(req, 0, sizeof(*req));
+
+	if (!(ifindex = _tc_ifindex(dev))) {
+		if (!tc_quiet) {
+			debug(LOG_ERR, "No device %s to shape traffic on", dev);
+		}
+		return -ENODEV;
+	}
+
+	req->n.nlmsg_len = NLMSG_LENGTH(sizeof(struct tcmsg));
+	req->n.nlmsg_type = type;
+	req->n.nlmsg_flags = flags;
+	req->t.tcm_family = AF_UNSPEC;
+	req->t.tcm_ifindex = ifindex;
+	req->t.tcm_parent = parent;
+	req->t.tcm_handle = handle;
+	req->t.tcm_info = info;
+
+	return 0;
+}
+
+/** @internal
+ * Send a request and report the kernel's answer, 0 or a negative errno.
+ * Missing objects are not an error when deleting.
+ */
+static int
+tc_talk(int fd, t_tc_req *req, const char *what, const char *dev)
+{
+	char ext[128];
 	int rc;
 
-	va_start(vlist, format);
-	safe_vasprintf(&fmt_cmd, format, vlist);
-	va_end(vlist);
+	rc = rtnl_talk(fd, &req->n, ext, sizeof(ext));
 
-	safe_asprintf(&cmd, "tc %s", fmt_cmd);
+	if (rc == -ENOENT && (req->n.nlmsg_type == RTM_DELQDISC ||
+						  req->n.nlmsg_type == RTM_DELTCLASS || req->n.nlmsg_type == RTM_DELTFILTER)) {
+		debug(LOG_DEBUG, "No %s on %s to delete", what, dev);
+		rc = 0;
+	} else if (rc != 0 && !tc_quiet) {
+		debug(LOG_ERR, "Could not change %s on %s: %s%s%s", what, dev, strerror(-rc), ext[0] ? ", " : "", ext);
+	} else if (rc == 0) {
+		debug(LOG_DEBUG, "Changed %s on %s", what, dev);
+	}
 
-	free(fmt_cmd);
+	return rc;
+}
 
-	debug(LOG_DEBUG, "Executing command: %s", cmd);
+/** @internal
+ * Add an htb class with the given rate and ceil in bytes/s,
+ * and burst and cburst in bytes. The class may borrow from its parent
+ * up to ceil.
+ * With flags 0 instead of NLM_F_CREATE | NLM_F_EXCL an existing class
+ * is changed in place, keeping its queue and filters, like tc class change.
+ */
+static int
+tc_class_htb(int fd, const char *dev, int flags, __u32 parent, __u32 classid, unsigned int rate, unsigned int ceil, int burst, int cburst, int mtu, int prio)
+{
+	t_tc_req req;
+	struct tc_htb_opt opt;
+	__u32 rtab[TC_RTAB_SIZE / sizeof(__u32)], ctab[TC_RTAB_SIZE / sizeof(__u32)];
+	struct rtattr *tail;
+	char what[32];
+	int rc;
+
+	pthread_once(&tc_core_once, _tc_core_init);
+
+	if ((rc = tc_req_init(&req, RTM_NEWTCLASS, flags, dev, parent, classid, 0)) != 0) {
+		return rc;
+	}
+
+	memset(&opt, 0, sizeof(opt));
+	opt.rate.rate = rate;
+	opt.ceil.rate = ceil;
+	opt.prio = prio;
+	tc_calc_rtable(&opt.rate, rtab, mtu);
+	tc_calc_rtable(&opt.ceil, ctab, mtu);
+	opt.buffer = tc_xmittime(rate, burst);
+	opt.cbuffer = tc_xmittime(ceil, cburst);
+
+	rtnl_addattr_l(&req.n, sizeof(req), TCA_KIND, "htb", strlen("htb") + 1);
+	tail = rtnl_nest(&req.n, sizeof(req), TCA_OPTIONS);
+	rtnl_addattr_l(&req.n, sizeof(req), TCA_HTB_PARMS, &opt, sizeof(opt));
+	rtnl_addattr_l(&req.n, sizeof(req), TCA_HTB_RTAB, rtab, TC_RTAB_SIZE);
+	rtnl_addattr_l(&req.n, sizeof(req), TCA_HTB_CTAB, ctab, TC_RTAB_SIZE);
+	rtnl_nest_end(&req.n, tail);
+
+	snprintf(what, sizeof(what), "class %x:%x", TC_H_MAJ(classid) >> 16, TC_H_MIN(classid));
+
+	return tc_talk(fd, &req, what, dev);
+}
+
+/** @internal
+ * Delete a class.
+ */
+static int
+tc_class_del(int fd, const char *dev, __u32 classid)
+{
+	t_tc_req req;
+	char what[32];
+	int rc;
+
+	if ((rc = tc_req_init(&req, RTM_DELTCLASS, 0, dev, TC_HTB_HANDLE, classid, 0)) != 0) {
+		return rc;
+	}
+
+	snprintf(what, sizeof(what), "class %x:%x", TC_H_MAJ(classid) >> 16, TC_H_MIN(classid));
+
+	return tc_talk(fd, &req, what, dev);
+}
+
+/** @internal
+ * Add (RTM_NEWTFILTER) or delete (RTM_DELTFILTER) the fw filter
+ * sending packets with the given mark to classid.
+ * Only used if the flow classifier is missing.  All of them share one
+ * priority, and so one fw classifier, which finds the filter for a mark
+ * in its hash table.
+ */
+static int
+tc_filter_fw(int fd, int type, const char *dev, __u32 mark, __u32 classid)
+{
+	t_tc_req req;
+	struct rtattr *tail;
+	char what[32];
+	int rc;
+
+	if ((rc = tc_req_init(&req, type, type == RTM_NEWTFILTER ? NLM_F_CREATE | NLM_F_EXCL : 0,
+						  dev, TC_HTB_HANDLE, mark, TC_H_MAKE(TC_FILTER_PRIO << 16, htons(ETH_P_IP)))) != 0) {
+		return rc;
+	}
+
+	rtnl_addattr_l(&req.n, sizeof(req), TCA_KIND, "fw", strlen("fw") + 1);
+	if (type == RTM_NEWTFILTER) {
+		tail = rtnl_nest(&req.n, sizeof(req), TCA_OPTIONS);
+		rtnl_addattr32(&req.n, sizeof(req), TCA_FW_CLASSID, classid);
+		rtnl_nest_end(&req.n, tail);
+	}
+
+	snprintf(what, sizeof(what), "filter 0x%x", mark);
 
-	rc = execute(cmd, tc_quiet);
+	return tc_talk(fd, &req, what, dev);
+}
+
+/** @internal
+ * Add the flow filter mapping client marks straight onto client classes,
+ * whatever the number of clients.  The client index is cut out of the
+ * mark and offset onto the class minor: baseclass 1:1 plus
+ * idx + 10 plus addend 1 is TC_CLASS_MINOR(idx).  Marks without a
+ * client index, trusted and blocked packets, land in the default 1:2.
+ * Returns 0, or -ENOENT if the kernel has no flow classifier.
+ */
+static int
+tc_filter_flow(int fd, char *dev)
+{
+	t_tc_req req;
+	struct rtattr *tail;
+	char ext[128];
+	int rc, shift = tc_mark_shift(FW_MARK_AUTHENTICATED);
+
+	if ((rc = tc_req_init(&req, RTM_NEWTFILTER, NLM_F_CREATE | NLM_F_EXCL, dev, TC_HTB_HANDLE, 1,
+						  TC_H_MAKE(TC_FILTER_PRIO << 16, htons(ETH_P_IP)))) != 0) {
+		return rc;
+	}
+
+	rtnl_addattr_l(&req.n, sizeof(req), TCA_KIND, "flow", strlen("flow") + 1);
+	tail = rtnl_nest(&req.n, sizeof(req), TCA_OPTIONS);
+	rtnl_addattr32(&req.n, sizeof(req), TCA_FLOW_KEYS, 1 << FLOW_KEY_MARK);
+	rtnl_addattr32(&req.n, sizeof(req), TCA_FLOW_MODE, FLOW_MODE_MAP);
+	rtnl_addattr32(&req.n, sizeof(req), TCA_FLOW_MASK, shift < 32 ? ~0U << shift : 0);
+	rtnl_addattr32(&req.n, sizeof(req), TCA_FLOW_RSHIFT, shift);
+	rtnl_addattr32(&req.n, sizeof(req), TCA_FLOW_ADDEND, TC_CLASS_MINOR(0) - 10 - 1);
+	rtnl_addattr32(&req.n, sizeof(req), TCA_FLOW_BASECLASS, TC_H_MAKE(TC_HTB_HANDLE, 1));
+	rtnl_nest_end(&req.n, tail);
 
-	free(cmd);
+	rc = rtnl_talk(fd, &req.n, ext, sizeof(ext));
+	if (rc == -ENOENT) {
+		debug(LOG_NOTICE, "No flow classifier, using a fw filter per client on %s", dev);
+	} else if (rc != 0) {
+		debug(LOG_ERR, "Could not change flow filter on %s: %s%s%s", dev, strerror(-rc), ext[0] ? ", " : "", ext);
+	}
 
 	return rc;
 }
 
-int
-tc_attach_client(char *down_dev, int download_limit, char *up_dev, int upload_limit, int idx, int fw_mark)
+/** @internal
+ * Add or change the class of the client with index idx under parent,
+ * limit is in kbits/s.
+ */
+static int
+tc_class_client(int fd, char *dev, int flags, __u32 parent, int limit, int idx)
 {
 	int burst;
 	int mtu = MTU + 40;
+
+	burst = limit * 1000 / 8 / HZ; /* burst (buffer size) in bytes */
+	burst = burst < mtu ? mtu : burst; /* but burst should be at least mtu */
+
+	return tc_class_htb(fd, dev, flags, parent, TC_H_MAKE(TC_HTB_HANDLE, TC_CLASS_MINOR(idx)),
+						limit * 1000 / 8, limit * 1000 / 8, burst*10, burst, mtu, 1);
+}
+
+/** @internal
+ * Add the class, and without the flow filter the fw filter,
+ * shaping one client on one device.
+ */
+static int
+tc_add_client(int fd, char *dev, __u32 parent, int limit, int idx, int fw_mark)
+{
+	int rc;
+	__u32 classid = TC_H_MAKE(TC_HTB_HANDLE, TC_CLASS_MINOR(idx));
+
+	rc = tc_class_client(fd, dev, NLM_F_CREATE | NLM_F_EXCL, parent, limit, idx);
+	if (rc == 0 && !tc_flow_map) {
+		rc = tc_filter_fw(fd, RTM_NEWTFILTER, dev, tc_client_mark(idx, fw_mark), classid);
+	}
+
+	return rc;
+}
+
+/** @internal
+ * Return the class of the plan called name, the parent of its clients,
+ * or the root class if there is no such plan.
+ */
+static __u32
+tc_plan_parent(const char *name)
+{
+	t_tc_plan *plan;
+	int i = 0;
+
+	if (name == NULL || config_get_config()->tc_qdisc != TC_QDISC_HTB) {
+		return TC_H_MAKE(TC_HTB_HANDLE, 1);
+	}
+
+	for (plan = config_get_config()->tc_plans; plan != NULL; plan = plan->next, i++) {
+		if (!strcmp(plan->name, name)) {
+			return TC_H_MAKE(TC_HTB_HANDLE, TC_PLAN_MINOR(i));
+		}
+	}
+
+	debug(LOG_WARNING, "No traffic control plan %s, shaping its clients under the root", name);
+
+	return TC_H_MAKE(TC_HTB_HANDLE, 1);
+}
+
+/** @internal
+ * Shape one client on one device: the class of a slot of the pool
+ * already under the right parent only needs the client's rate,
+ * others are added.
+ */
+static int
+tc_set_client(int fd, char *dev, __u32 parent, int limit, int idx, int fw_mark)
+{
+	if (idx < tc_pool_size && tc_pool_parent[idx] == parent) {
+		return tc_class_client(fd, dev, 0, parent, limit, idx);
+	}
+
+	return tc_add_client(fd, dev, parent, limit, idx, fw_mark);
+}
+
+/** @internal
+ * Create the classes, and without the flow filter the fw filters,
+ * of all the slots of the pool on dev. They idle at the default limit
+ * until packets with a slot's mark show up.
+ */
+static int
+tc_pool_dev(int fd, char *dev, int limit)
+{
+	int idx, rc = 0;
+
+	for (idx = 0; idx < tc_pool_size && rc == 0; idx++) {
+		rc = tc_add_client(fd, dev, tc_pool_parent[idx], limit, idx, FW_MARK_AUTHENTICATED);
+	}
+
+	debug(LOG_INFO, "Created %d of %d pool classes on %s", rc == 0 ? idx : idx - 1, tc_pool_size, dev);
+
+	return rc;
+}
+
+/** @internal
+ * Remove the filter and class shaping one client on one device.
+ * The filter goes first, htb refuses to delete a class still in use.
+ */
+static int
+tc_del_client(int fd, char *dev, int idx, int fw_mark)
+{
 	int rc = 0;
-	int r2q = 10;
 
-	if(download_limit < 120) r2q = 1;
+	if (!tc_flow_map) {
+		rc = tc_filter_fw(fd, RTM_DELTFILTER, dev, tc_client_mark(idx, fw_mark), 0);
+	}
+	rc |= tc_class_del(fd, dev, TC_H_MAKE(TC_HTB_HANDLE, TC_CLASS_MINOR(idx)));
 
-	burst = download_limit * 1000 / 8 / HZ; /* burst (buffer size) in bytes */
-	burst = burst < mtu ? mtu : burst; /* but burst should be at least mtu */
+	return rc;
+}
 
-	rc |= tc_do_command("class add dev %s parent 1:1 classid 1:%i htb rate %dkbit ceil %dkbit burst %d cburst %d mtu %d prio 1",
-						down_dev, idx + 10, download_limit, download_limit, burst*10, burst, mtu);
-	rc |= tc_do_command("filter add dev %s protocol ip parent 1: handle 0x%x%x fw flowid 1:%i",
-						down_dev, idx + 10, fw_mark, idx + 10);
+/** @internal
+ * Bring a device up or down, without running ip link.
+ */
+static int
+tc_link_set(char *dev, int up)
+{
+	struct ifreq ifr;
+	int fd, rc = 0;
+
+	if (cmdstat_dry_run()) {
+		debug(LOG_INFO, "Dry run: set %s %s", dev, up ? "up" : "down");
+		return 0;
+	}
+
+	if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+		debug(LOG_ERR, "socket(): %s", strerror(errno));
+		return -1;
+	}
 
-	/* to avoid some kernel warnings with small rates */
-	if(upload_limit < 120) r2q = 1;
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, dev, IFNAMSIZ - 1);
 
-	burst = upload_limit * 1000 / 8 / HZ; /* burst (buffer size) in bytes */
-	burst = burst < mtu ? mtu : burst; /* but burst should be at least mtu */
+	debug(LOG_DEBUG, "Setting %s %s", dev, up ? "up" : "down");
+
+	if (ioctl(fd, SIOCGIFFLAGS, &ifr) < 0) {
+		rc = -1;
+	} else {
+		if (up) {
+			ifr.ifr_flags |= IFF_UP;
+		} else {
+			ifr.ifr_flags &= ~IFF_UP;
+		}
+		if (ioctl(fd, SIOCSIFFLAGS, &ifr) < 0) {
+			rc = -1;
+		}
+	}
+
+	if (rc != 0 && !tc_quiet) {
+		debug(LOG_ERR, "Could not set %s %s: %s", dev, up ? "up" : "down", strerror(errno));
+	}
+
+	close(fd);
+
+	return rc;
+}
+
+/** Shape a client, under the class of its plan if it has one.
+ */
+int
+tc_attach_client(char *down_dev, int download_limit, char *up_dev, int upload_limit, int idx, int fw_mark, const char *plan)
+{
+	int fd, rc = 0;
+	__u32 parent;
+
+	/* CAKE shares the limit between hosts by itself */
+	if (config_get_config()->tc_qdisc == TC_QDISC_CAKE) {
+		return 0;
+	}
+
+	if ((fd = rtnl_open()) < 0) {
+		return -1;
+	}
+
+	parent = tc_plan_parent(plan);
+
+	/* htb cannot move a class to another parent, so a slot of the pool
+	 * last used by another plan is emptied and added again */
+	if (idx < tc_pool_size && tc_pool_parent[idx] != parent) {
+		if (download_limit > 0) {
+			tc_del_client(fd, down_dev, idx, fw_mark);
+		}
+		if (upload_limit > 0) {
+			tc_del_client(fd, up_dev, idx, fw_mark);
+		}
+	}
+
+	/* A direction without a limit has no qdisc to add the client to */
+	if (download_limit > 0) {
+		rc |= tc_set_client(fd, down_dev, parent, download_limit, idx, fw_mark);
+	}
+	if (upload_limit > 0) {
+		rc |= tc_set_client(fd, up_dev, parent, upload_limit, idx, fw_mark);
+	}
+
+	if (idx < tc_pool_size) {
+		tc_pool_parent[idx] = parent;
+	}
+
+	close(fd);
 
-	rc |= tc_do_command("class add dev %s parent 1:1 classid 1:%i htb rate %dkbit ceil %dkbit burst %d cburst %d mtu %d prio 1",
-						up_dev, idx + 10, upload_limit, upload_limit, burst*10, burst, mtu);
-	rc |= tc_do_command("filter add dev %s protocol ip parent 1: handle 0x%x%x fw flowid 1:%i",
-						up_dev, idx + 10, fw_mark, idx + 10);
 	return rc;
+}
+
+/** Change the rates of the classes of an attached client in place.
+ *  Unlike detaching and attaching again, packets queued in the classes
+ *  are not dropped and the filters are left alone.
+ *  A direction without a limit is not shaped, and is left alone too.
+ *  If the client moved from old_plan to a plan with another class, its
+ *  classes are added again under that one, as htb cannot move them.
+ */
+int
+tc_change_client(char *down_dev, int download_limit, char *up_dev, int upload_limit, int idx, const char *old_plan, const char *plan)
+{
+	int fd, rc = 0;
+	__u32 parent, old_parent;
+
+	if (config_get_config()->tc_qdisc == TC_QDISC_CAKE) {
+		return 0;
+	}
 
+	if ((fd = rtnl_open()) < 0) {
+		return -1;
+	}
+
+	parent = tc_plan_parent(plan);
+	old_parent = idx < tc_pool_size ? tc_pool_parent[idx] : tc_plan_parent(old_plan);
+
+	if (parent != old_parent) {
+		debug(LOG_INFO, "Moving the classes of slot %d to plan %s", idx, plan ? plan : "none");
+		if (download_limit > 0) {
+			tc_del_client(fd, down_dev, idx, FW_MARK_AUTHENTICATED);
+			rc |= tc_add_client(fd, down_dev, parent, download_limit, idx, FW_MARK_AUTHENTICATED);
+		}
+		if (upload_limit > 0) {
+			tc_del_client(fd, up_dev, idx, FW_MARK_AUTHENTICATED);
+			rc |= tc_add_client(fd, up_dev, parent, upload_limit, idx, FW_MARK_AUTHENTICATED);
+		}
+		if (idx < tc_pool_size) {
+			tc_pool_parent[idx] = parent;
+		}
+		close(fd);
+		return rc;
+	}
+
+	if (download_limit > 0) {
+		rc |= tc_class_client(fd, down_dev, 0, parent, download_limit, idx);
+	}
+	if (upload_limit > 0) {
+		rc |= tc_class_client(fd, up_dev, 0, parent, upload_limit, idx);
+	}
+
+	close(fd);
+
+	return rc;
 }
 
 int
 tc_detach_client(char *down_dev, char *up_dev, int idx)
 {
-	int rc = 0;
+	int fd, rc;
+
+	/* CAKE has no client classes, and those of the pool stay put */
+	if (config_get_config()->tc_qdisc == TC_QDISC_CAKE || idx < tc_pool_size) {
+		return 0;
+	}
 
-	rc |= tc_do_command("class del dev %s parent 1: classid 1:%i", down_dev, idx + 10);
-	rc |= tc_do_command("class del dev %s parent 1: classid 1:%i", up_dev, idx + 10);
+	if ((fd = rtnl_open()) < 0) {
+		return -1;
+	}
+
+	rc = tc_del_client(fd, down_dev, idx, FW_MARK_AUTHENTICATED);
+	rc |= tc_del_client(fd, up_dev, idx, FW_MARK_AUTHENTICATED);
+
+	close(fd);
 
 	return rc;
 }
 
-/* Use HTB as a upload qdisc.
- * dev is name of device to attach qdisc to (typically an IMQ)
- * upload_limit is in kbits/s
- * Some ideas here from Rudy's qos-scripts
- * http://forum.openwrt.org/viewtopic.php?id=4112&p=1
+/** @internal
+ * Add the classes of the plans under the root class,
+ * with their upload or download rates.
  */
 static int
-tc_attach_upload_qdisc(char *dev, int upload_limit)
+tc_class_plans(int fd, char *dev, int upload)
 {
-	int rc = 0;
-	int burst;
+	t_tc_plan *plan;
+	int i = 0, rate, ceil, burst, rc = 0;
 	int mtu = MTU + 40;
 
-	burst = upload_limit * 1000 / 8 / HZ; /* burst (buffer size) in bytes */
-	burst = burst < mtu ? mtu : burst; /* but burst should be at least mtu */
-
-	rc |= tc_do_command("qdisc add dev %s root handle 1: htb default 2 r2q %d", dev, 1700);
-	rc |= tc_do_command("class add dev %s parent 1: classid 1:1 htb rate 100Mbps ceil 100Mbps burst %d cburst %d mtu %d",
-						dev, burst*10, burst, mtu);
-	rc |= tc_do_command("class add dev %s parent 1:1 classid 1:2 htb rate %dkbit ceil %dkbit burst %d cburst %d mtu %d prio 1",
-						dev, upload_limit, upload_limit, burst*10, burst, mtu);
+	for (plan = config_get_config()->tc_plans; plan != NULL && rc == 0; plan = plan->next, i++) {
+		rate = upload ? plan->upload_rate : plan->download_rate;
+		ceil = upload ? plan->upload_ceil : plan->download_ceil;
+		burst = ceil * 1000 / 8 / HZ;
+		burst = burst < mtu ? mtu : burst;
+		rc = tc_class_htb(fd, dev, NLM_F_CREATE | NLM_F_EXCL, TC_H_MAKE(TC_HTB_HANDLE, 1), TC_H_MAKE(TC_HTB_HANDLE, TC_PLAN_MINOR(i)),
+						  rate * 1000 / 8, ceil * 1000 / 8, burst*10, burst, mtu, 1);
+	}
 
 	return rc;
 }
 
-/* Use HTB as a download qdisc.
+/* Use HTB as a shaping qdisc.
  * dev is name of device to attach qdisc to (typically an IMQ)
- * download_limit is in kbits/s
+ * limit is in kbits/s
+ * The root class is limited to the uplink rate, if it is configured.
  * Some ideas here from Rudy's qos-scripts
  * http://forum.openwrt.org/viewtopic.php?id=4112&p=1
  */
 static int
-tc_attach_download_qdisc(char *dev, int download_limit)
+tc_qdisc_htb(int fd, char *dev, int limit, int upload)
 {
-	int rc = 0;
-	int burst;
+	t_tc_req req;
+	struct tc_htb_glob opt;
+	struct rtattr *tail;
+	int burst, rc, uplink;
+	unsigned int root_rate;
 	int mtu = MTU + 40;
 
-	burst = download_limit * 1000 / 8 / HZ; /* burst (buffer size) in bytes */
+	uplink = upload ? config_get_config()->uplink_upload_rate : config_get_config()->uplink_download_rate;
+	/* 100Mbps in tc units, that is 100 MBytes/s, without one */
+	root_rate = uplink > 0 ? uplink * 1000 / 8 : 100000000;
+
+	burst = limit * 1000 / 8 / HZ; /* burst (buffer size) in bytes */
 	burst = burst < mtu ? mtu : burst; /* but burst should be at least mtu */
 
-	rc |= tc_do_command("qdisc add dev %s root handle 1: htb default 2 r2q %d", dev, 1700);
-	rc |= tc_do_command("class add dev %s parent 1: classid 1:1 htb rate 100Mbps ceil 100Mbps burst %d cburst %d mtu %d",
-						dev, burst*10, burst, mtu);
-	rc |= tc_do_command("class add dev %s parent 1:1 classid 1:2 htb rate %dkbit ceil %dkbit burst %d cburst %d mtu %d prio 1",
-						dev, download_limit, download_limit, burst*10, burst, mtu);
+	if ((rc = tc_req_init(&req, RTM_NEWQDISC, NLM_F_CREATE | NLM_F_EXCL, dev, TC_H_ROOT, TC_HTB_HANDLE, 0)) != 0) {
+		return rc;
+	}
+
+	memset(&opt, 0, sizeof(opt));
+	opt.version = 3;
+	opt.rate2quantum = 1700;
+	opt.defcls = 2;
+
+	rtnl_addattr_l(&req.n, sizeof(req), TCA_KIND, "htb", strlen("htb") + 1);
+	tail = rtnl_nest(&req.n, sizeof(req), TCA_OPTIONS);
+	rtnl_addattr_l(&req.n, sizeof(req), TCA_HTB_INIT, &opt, sizeof(opt));
+	rtnl_nest_end(&req.n, tail);
+
+	if ((rc = tc_talk(fd, &req, "htb qdisc", dev)) != 0) {
+		return rc;
+	}
+
+	rc = tc_class_htb(fd, dev, NLM_F_CREATE | NLM_F_EXCL, TC_HTB_HANDLE, TC_H_MAKE(TC_HTB_HANDLE, 1), root_rate, root_rate, burst*10, burst, mtu, 0);
+	if (rc == 0) {
+		rc = tc_class_htb(fd, dev, NLM_F_CREATE | NLM_F_EXCL, TC_H_MAKE(TC_HTB_HANDLE, 1), TC_H_MAKE(TC_HTB_HANDLE, 2), limit * 1000 / 8, limit * 1000 / 8, burst*10, burst, mtu, 1);
+	}
+	if (rc == 0) {
+		rc = tc_class_plans(fd, dev, upload);
+	}
+	if (rc == 0 && tc_flow_map && tc_filter_flow(fd, dev) == -ENOENT) {
+		tc_flow_map = 0;
+	}
+
+	return rc;
+}
+
+/** @internal
+ * Use a single CAKE qdisc as the shaper, sharing limit fairly between
+ * hosts, and then between the flows of each host.  upload is nonzero if
+ * dev carries traffic from the clients, which are then told apart by
+ * source address, else by destination address.
+ */
+static int
+tc_qdisc_cake(int fd, char *dev, int limit, int upload)
+{
+	t_tc_req req;
+	struct rtattr *tail;
+	__u64 rate = (__u64) limit * 1000 / 8;
+	int rc;
+
+	if ((rc = tc_req_init(&req, RTM_NEWQDISC, NLM_F_CREATE | NLM_F_EXCL, dev, TC_H_ROOT, TC_HTB_HANDLE, 0)) != 0) {
+		return rc;
+	}
+
+	rtnl_addattr_l(&req.n, sizeof(req), TCA_KIND, "cake", strlen("cake") + 1);
+	tail = rtnl_nest(&req.n, sizeof(req), TCA_OPTIONS);
+	rtnl_addattr_l(&req.n, sizeof(req), TCA_CAKE_BASE_RATE64, &rate, sizeof(rate));
+	rtnl_addattr32(&req.n, sizeof(req), TCA_CAKE_FLOW_MODE, upload ? CAKE_FLOW_DUAL_SRC : CAKE_FLOW_DUAL_DST);
+	rtnl_nest_end(&req.n, tail);
+
+	return tc_talk(fd, &req, "cake qdisc", dev);
+}
+
+/** @internal
+ * Attach the configured shaping qdisc to dev.
+ */
+static int
+tc_qdisc_shaper(int fd, char *dev, int limit, int upload)
+{
+	int rc;
+
+	if (config_get_config()->tc_qdisc == TC_QDISC_CAKE) {
+		return tc_qdisc_cake(fd, dev, limit, upload);
+	}
+
+	if ((rc = tc_qdisc_htb(fd, dev, limit, upload)) == 0 && tc_pool_size > 0) {
+		rc = tc_pool_dev(fd, dev, limit);
+	}
+
+	return rc;
+}
+
+/** @internal
+ * Delete the root (TC_H_ROOT) or ingress (TC_H_INGRESS) qdisc of a device,
+ * and with it all its classes and filters.
+ */
+static int
+tc_qdisc_del(int fd, char *dev, __u32 parent)
+{
+	t_tc_req req;
+	int rc;
+
+	if ((rc = tc_req_init(&req, RTM_DELQDISC, 0, dev, parent, 0, 0)) != 0) {
+		return rc;
+	}
+
+	return tc_talk(fd, &req, parent == TC_H_INGRESS ? "ingress qdisc" : "root qdisc", dev);
+}
+
+/** @internal
+ * Add an ingress qdisc to a device, for filters on its incoming packets.
+ */
+static int
+tc_qdisc_ingress(int fd, char *dev)
+{
+	t_tc_req req;
+	int rc;
+
+	if ((rc = tc_req_init(&req, RTM_NEWQDISC, NLM_F_CREATE | NLM_F_EXCL, dev, TC_H_INGRESS, TC_H_MAKE(TC_H_INGRESS, 0), 0)) != 0) {
+		return rc;
+	}
+
+	rtnl_addattr_l(&req.n, sizeof(req), TCA_KIND, "ingress", strlen("ingress") + 1);
+
+	return tc_talk(fd, &req, "ingress qdisc", dev);
+}
+
+/** @internal
+ * Send every IP packet arriving on dev to to_dev, with the mark
+ * its connection was given by iptables.  The packet is then queued
+ * on to_dev as if it was leaving through it, before it reaches
+ * iptables, so the mark has to come from conntrack.
+ */
+static int
+tc_filter_redirect(int fd, char *dev, char *to_dev)
+{
+	t_tc_req req;
+	struct {
+		struct tc_u32_sel sel;
+		struct tc_u32_key keys[1];
+	} sel;
+	struct tc_connmark connmark;
+	struct tc_mirred mirred;
+	struct rtattr *tail, *acts, *act, *opts;
+	int rc, ifindex;
+
+	if (!(ifindex = _tc_ifindex(to_dev))) {
+		debug(LOG_ERR, "No device %s to redirect %s to", to_dev, dev);
+		return -ENODEV;
+	}
+
+	if ((rc = tc_req_init(&req, RTM_NEWTFILTER, NLM_F_CREATE | NLM_F_EXCL, dev, TC_H_MAKE(TC_H_INGRESS, 0), 0,
+						  TC_H_MAKE(TC_FILTER_PRIO << 16, htons(ETH_P_IP)))) != 0) {
+		return rc;
+	}
+
+	/* u32 match u32 0 0: every packet */
+	memset(&sel, 0, sizeof(sel));
+	sel.sel.nkeys = 1;
+	sel.sel.flags = TC_U32_TERMINAL;
+
+	memset(&connmark, 0, sizeof(connmark));
+	connmark.action = TC_ACT_PIPE;
+
+	memset(&mirred, 0, sizeof(mirred));
+	mirred.action = TC_ACT_STOLEN;
+	mirred.eaction = TCA_EGRESS_REDIR;
+	mirred.ifindex = ifindex;
+
+	rtnl_addattr_l(&req.n, sizeof(req), TCA_KIND, "u32", strlen("u32") + 1);
+	tail = rtnl_nest(&req.n, sizeof(req), TCA_OPTIONS);
+	rtnl_addattr_l(&req.n, sizeof(req), TCA_U32_SEL, &sel, sizeof(sel));
+	acts = rtnl_nest(&req.n, sizeof(req), TCA_U32_ACT);
+
+	act = rtnl_nest(&req.n, sizeof(req), 1);
+	rtnl_addattr_l(&req.n, sizeof(req), TCA_ACT_KIND, "connmark", strlen("connmark") + 1);
+	opts = rtnl_nest(&req.n, sizeof(req), TCA_ACT_OPTIONS);
+	rtnl_addattr_l(&req.n, sizeof(req), TCA_CONNMARK_PARMS, &connmark, sizeof(connmark));
+	rtnl_nest_end(&req.n, opts);
+	rtnl_nest_end(&req.n, act);
+
+	act = rtnl_nest(&req.n, sizeof(req), 2);
+	rtnl_addattr_l(&req.n, sizeof(req), TCA_ACT_KIND, "mirred", strlen("mirred") + 1);
+	opts = rtnl_nest(&req.n, sizeof(req), TCA_ACT_OPTIONS);
+	rtnl_addattr_l(&req.n, sizeof(req), TCA_MIRRED_PARMS, &mirred, sizeof(mirred));
+	rtnl_nest_end(&req.n, opts);
+	rtnl_nest_end(&req.n, act);
+
+	rtnl_nest_end(&req.n, acts);
+	rtnl_nest_end(&req.n, tail);
+
+	return tc_talk(fd, &req, "redirect filter", dev);
+}
+
+/** @internal
+ * Create (RTM_NEWLINK) or delete (RTM_DELLINK) an ifb device.
+ * An ifb left over from an earlier run is kept.
+ */
+static int
+tc_link_ifb(int fd, int type, char *dev)
+{
+	struct {
+		struct nlmsghdr n;
+		struct ifinfomsg i;
+		char buf[256];
+	} req;
+	struct rtattr *linkinfo;
+	char ext[128];
+	int rc;
+
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+	req.n.nlmsg_type = type;
+	req.n.nlmsg_flags = type == RTM_NEWLINK ? NLM_F_CREATE | NLM_F_EXCL : 0;
+	req.i.ifi_family = AF_UNSPEC;
+
+	rtnl_addattr_l(&req.n, sizeof(req), IFLA_IFNAME, dev, strlen(dev) + 1);
+	if (type == RTM_NEWLINK) {
+		linkinfo = rtnl_nest(&req.n, sizeof(req), IFLA_LINKINFO);
+		rtnl_addattr_l(&req.n, sizeof(req), IFLA_INFO_KIND, "ifb", strlen("ifb") + 1);
+		rtnl_nest_end(&req.n, linkinfo);
+	}
+
+	rc = rtnl_talk(fd, &req.n, ext, sizeof(ext));
+
+	if ((rc == -EEXIST && type == RTM_NEWLINK) || (rc == -ENODEV && type == RTM_DELLINK)) {
+		rc = 0;
+	} else if (rc != 0 && !tc_quiet) {
+		debug(LOG_ERR, "Could not %s %s: %s%s%s", type == RTM_NEWLINK ? "create" : "delete",
+			  dev, strerror(-rc), ext[0] ? ", " : "", ext);
+	}
+
+	return rc;
+}
+
+/** Get the devices download and upload traffic is shaped on.
+ *  Both strings must be freed.
+ */
+void
+tc_get_devices(char **down_dev, char **up_dev)
+{
+	s_config *config = config_get_config();
+
+	if (config->tc_mode == TC_MODE_IFB) {
+		*down_dev = safe_strdup(config->gw_interface);
+		*up_dev = safe_strdup(TC_IFB_DEVICE);
+	} else {
+		safe_asprintf(down_dev, "imq%d", config->download_imq);
+		safe_asprintf(up_dev, "imq%d", config->upload_imq);
+	}
+}
+
+/** @internal
+ * IFB mode: shape download on the egress of the gateway interface, and
+ * upload on an ifb device its ingress is redirected to.
+ * iptables marks packets after tc ingress, so the client marks are
+ * saved to conntrack, and cleared again on packets coming back from the ifb.
+ */
+static int
+_tc_init_ifb(int fd, int download_limit, int upload_limit)
+{
+	s_config *config = config_get_config();
+	char *gw_interface = config->gw_interface;
+	char *gw_iprange = config->gw_iprange;
+	int rc = 0;
+
+	if(download_limit > 0) {
+		rc |= tc_qdisc_shaper(fd, gw_interface, download_limit, 0);
+	}
+	if(upload_limit > 0) {
+		if(tc_link_ifb(fd, RTM_NEWLINK, TC_IFB_DEVICE) != 0 || tc_link_set(TC_IFB_DEVICE, 1) != 0) {
+			debug(LOG_ERR, "Could not set up %s. Upload limiting will not work", TC_IFB_DEVICE);
+			return -1;
+		}
+		rc |= tc_qdisc_shaper(fd, TC_IFB_DEVICE, upload_limit, 1);
+		rc |= iptables_do_command("-t mangle -I PREROUTING 4 -i %s -s %s -j CONNMARK --save-mark", gw_interface, gw_iprange);
+		rc |= iptables_do_command("-t mangle -I PREROUTING 1 -i %s -s %s -j MARK --set-mark 0x0", gw_interface, gw_iprange);
+		rc |= tc_qdisc_ingress(fd, gw_interface);
+		rc |= tc_filter_redirect(fd, gw_interface, TC_IFB_DEVICE);
+	}
 
 	return rc;
 }
@@ -180,9 +979,9 @@ tc_init_tc()
 {
 	int upload_limit, download_limit;
 	int upload_imq, download_imq;
-	char *download_imqname, *upload_imqname, *cmd;
+	char *download_imqname, *upload_imqname;
 	s_config *config;
-	int rc = 0, ret = 0;
+	int fd, i, rc = 0;
 
 	config = config_get_config();
 	download_limit = config->download_limit;
@@ -190,30 +989,49 @@ tc_init_tc()
 	download_imq = config->download_imq;
 	upload_imq = config->upload_imq;
 
-	safe_asprintf(&download_imqname,"imq%d",download_imq); /* must free */
-	safe_asprintf(&upload_imqname,"imq%d",upload_imq);  /* must free */
+	if ((fd = rtnl_open()) < 0) {
+		return -1;
+	}
 
 	tc_quiet = 0;
+	tc_flow_map = 1;
+	tc_pool_size = 0;
+	if (config->tc_pool && config->tc_qdisc == TC_QDISC_HTB) {
+		/* Client indexes are below maxclients, and class minors fit in 16 bits */
+		tc_pool_size = config->maxclients;
+		if (TC_CLASS_MINOR(tc_pool_size - 1) > (int) TC_H_MIN_MASK) {
+			tc_pool_size = TC_H_MIN_MASK - TC_CLASS_MINOR(0) + 1;
+		}
+		/* Idle classes of the pool wait under the root */
+		free(tc_pool_parent);
+		tc_pool_parent = safe_malloc(tc_pool_size * sizeof(__u32));
+		for (i = 0; i < tc_pool_size; i++) {
+			tc_pool_parent[i] = TC_H_MAKE(TC_HTB_HANDLE, 1);
+		}
+	}
+
+	if (config->tc_mode == TC_MODE_IFB) {
+		rc = _tc_init_ifb(fd, download_limit, upload_limit);
+		close(fd);
+		return rc;
+	}
+
+	safe_asprintf(&download_imqname,"imq%d",download_imq); /* must free */
+	safe_asprintf(&upload_imqname,"imq%d",upload_imq);  /* must free */
 
 	if(download_limit > 0) {
-		safe_asprintf(&cmd,"ip link set %s up", download_imqname);
-		ret = execute(cmd ,tc_quiet);
-		free(cmd);
-		if( ret != 0 ) {
+		if(tc_link_set(download_imqname, 1) != 0) {
 			debug(LOG_ERR, "Could not set %s up. Download limiting will not work",
 				  download_imqname);
 		} else {
 			/* jump to the imq in mangle CHAIN_INCOMING */
 			rc |= iptables_do_command("-t mangle -A " CHAIN_INCOMING " -j IMQ --todev %d ", download_imq);
 			/* attach download shaping qdisc to this imq */
-			rc |= tc_attach_download_qdisc(download_imqname,download_limit);
+			rc |= tc_qdisc_shaper(fd, download_imqname, download_limit, 0);
 		}
 	}
 	if(upload_limit > 0) {
-		safe_asprintf(&cmd,"ip link set %s up", upload_imqname);
-		ret = execute(cmd ,tc_quiet);
-		free(cmd);
-		if( ret != 0 ) {
+		if(tc_link_set(upload_imqname, 1) != 0) {
 			debug(LOG_ERR, "Could not set %s up. Upload limiting will not work",
 				  upload_imqname);
 			rc = -1;
@@ -221,44 +1039,61 @@ tc_init_tc()
 			/* jump to the imq in mangle CHAIN_OUTGOING */
 			rc |= iptables_do_command("-t mangle -A " CHAIN_OUTGOING " -j IMQ --todev %d ", upload_imq);
 			/* attach upload shaping qdisc to this imq */
-			rc |= tc_attach_upload_qdisc(upload_imqname,upload_limit);
+			rc |= tc_qdisc_shaper(fd, upload_imqname, upload_limit, 1);
 		}
 	}
 
+	close(fd);
+
 	free(download_imqname);
 	free(upload_imqname);
+
+	return rc;
 }
 
 
 /**
- * Remove qdiscs from intermediate queueing devices, and bring IMQ's down
+ * Remove qdiscs from intermediate queueing devices, and bring IMQ's down,
+ * or in IFB mode remove the gateway interface qdiscs and the ifb.
  */
 int
 tc_destroy_tc()
 {
-	int rc = 0, old_tc_quiet;
+	int fd, rc = 0, old_tc_quiet;
+	s_config *config;
+	char *download_imqname, *upload_imqname;
 
 	old_tc_quiet = tc_quiet;
 	tc_quiet = 1;
-	s_config *config;
-	char *download_imqname, *upload_imqname, *cmd;
 
 	config = config_get_config();
+
+	if ((fd = rtnl_open()) < 0) {
+		tc_quiet = old_tc_quiet;
+		return -1;
+	}
+
+	if (config->tc_mode == TC_MODE_IFB) {
+		rc |= tc_qdisc_del(fd, config->gw_interface, TC_H_ROOT);
+		rc |= tc_qdisc_del(fd, config->gw_interface, TC_H_INGRESS);
+		rc |= tc_link_ifb(fd, RTM_DELLINK, TC_IFB_DEVICE);
+		iptables_do_command("-t mangle -D PREROUTING -i %s -s %s -j MARK --set-mark 0x0", config->gw_interface, config->gw_iprange);
+		iptables_do_command("-t mangle -D PREROUTING -i %s -s %s -j CONNMARK --save-mark", config->gw_interface, config->gw_iprange);
+		close(fd);
+		tc_quiet = old_tc_quiet;
+		return rc;
+	}
+
 	safe_asprintf(&download_imqname,"imq%d",config->download_imq); /* must free */
 	safe_asprintf(&upload_imqname,"imq%d",config->upload_imq);  /* must free */
 
 	/* remove qdiscs from imq's */
-	rc |= tc_do_command("qdisc del dev %s root",download_imqname);
-	rc |= tc_do_command("qdisc del dev %s root",upload_imqname);
+	rc |= tc_qdisc_del(fd, download_imqname, TC_H_ROOT);
+	rc |= tc_qdisc_del(fd, upload_imqname, TC_H_ROOT);
+	close(fd);
 	/* bring down imq's */
-	safe_asprintf(&cmd,"ip link set %s down", download_imqname);
-	debug(LOG_DEBUG, "Executing command: %s", cmd);
-	rc |= execute(cmd,tc_quiet);
-	free(cmd);
-	safe_asprintf(&cmd,"ip link set %s down", upload_imqname);
-	debug(LOG_DEBUG, "Executing command: %s", cmd);
-	rc |= execute(cmd,tc_quiet);
-	free(cmd);
+	rc |= tc_link_set(download_imqname, 0);
+	rc |= tc_link_set(upload_imqname, 0);
 
 	free(upload_imqname);
 	free(download_imqname);
@@ -267,3 +1102,344 @@ tc_destroy_tc()
 
 	return rc;
 }
+
+/** @internal
+ * Dump the classes on dev in one request, calling filter on each.
+ */
+static int
+_tc_dump(char *dev, rtnl_filter_t filter, void *arg)
+{
+	t_tc_req req;
+	int fd, rc;
+
+	if ((rc = tc_req_init(&req, RTM_GETTCLASS, 0, dev, 0, 0, 0)) != 0) {
+		return rc;
+	}
+
+	if ((fd = rtnl_open()) < 0) {
+		return -EIO;
+	}
+
+	if ((rc = rtnl_dump(fd, &req.n, filter, arg)) != 0) {
+		debug(LOG_ERR, "Could not dump classes on %s: %s", dev, strerror(-rc));
+	}
+
+	close(fd);
+
+	return rc;
+}
+
+/** @internal
+ * Dump callback marking the minors of the htb classes seen.
+ */
+static int
+_tc_dump_class(struct nlmsghdr *n, void *arg)
+{
+	unsigned char *classes = arg;
+	struct tcmsg *t = NLMSG_DATA(n);
+	struct rtattr *tb[TCA_MAX + 1];
+
+	if (n->nlmsg_type != RTM_NEWTCLASS || n->nlmsg_len < NLMSG_LENGTH(sizeof(*t))) {
+		return 0;
+	}
+
+	rtnl_parse_attrs(tb, TCA_MAX, TCA_RTA(t), n->nlmsg_len - NLMSG_LENGTH(sizeof(*t)));
+
+	if (tb[TCA_KIND] && !strcmp(RTA_DATA(tb[TCA_KIND]), "htb") && TC_H_MAJ(t->tcm_handle) == TC_HTB_HANDLE) {
+		classes[TC_H_MIN(t->tcm_handle)] = 1;
+	}
+
+	return 0;
+}
+
+/** Dump the htb classes on dev into classes, indexed by class minor,
+ *  which must have room for TC_H_MIN_MASK + 1 entries.
+ *  Returns 0, or a negative errno.
+ */
+int
+tc_dump_classes(char *dev, unsigned char *classes)
+{
+	memset(classes, 0, TC_H_MIN_MASK + 1);
+
+	return _tc_dump(dev, _tc_dump_class, classes);
+}
+
+/** @internal
+ * Bring the client classes on one device in line with the client list.
+ * The list stays locked from the dump to the last change, so no client
+ * can take or give up a class in between.
+ */
+static int
+_tc_reconcile_dev(char *dev, int limit, int upload)
+{
+	unsigned char *classes;
+	t_client *client;
+	int fd, minor, client_limit, rc = 0;
+
+	if ((fd = rtnl_open()) < 0) {
+		return -1;
+	}
+	classes = safe_malloc(TC_H_MIN_MASK + 1);
+
+	LOCK_CLIENT_LIST();
+
+	if (tc_dump_classes(dev, classes) != 0) {
+		UNLOCK_CLIENT_LIST();
+		close(fd);
+		free(classes);
+		return -1;
+	}
+
+	for (client = client_get_first_client(); client; client = client->next) {
+		if (client->fw_connection_state != FW_MARK_AUTHENTICATED && !client->parked) {
+			continue;
+		}
+		minor = TC_CLASS_MINOR(client->idx);
+		if (minor > (int) TC_H_MIN_MASK) {
+			continue;
+		}
+		if (classes[minor]) {
+			classes[minor] = 2;
+			continue;
+		}
+		client_limit = limit;
+		if (client->download_limit > 0 && client->upload_limit > 0) {
+			client_limit = upload ? client->upload_limit : client->download_limit;
+		}
+		debug(LOG_WARNING, "Class 1:%x of %s %s missing on %s, adding it", minor, client->ip, client->mac, dev);
+		rc |= tc_add_client(fd, dev, tc_plan_parent(client->plan), client_limit, client->idx, FW_MARK_AUTHENTICATED);
+		if (client->idx < tc_pool_size) {
+			tc_pool_parent[client->idx] = tc_plan_parent(client->plan);
+		}
+		classes[minor] = 2;
+	}
+
+	/* Idle classes of the pool belong to a slot, not a client */
+	for (minor = TC_CLASS_MINOR(0); minor < TC_CLASS_MINOR(tc_pool_size); minor++) {
+		if (!classes[minor]) {
+			debug(LOG_WARNING, "Pool class 1:%x missing on %s, adding it", minor, dev);
+			rc |= tc_add_client(fd, dev, tc_pool_parent[minor - TC_CLASS_MINOR(0)], limit, minor - TC_CLASS_MINOR(0), FW_MARK_AUTHENTICATED);
+		}
+		classes[minor] = 2;
+	}
+
+	for (minor = TC_CLASS_MINOR(0); minor <= (int) TC_H_MIN_MASK; minor++) {
+		if (classes[minor] == 1) {
+			debug(LOG_WARNING, "Class 1:%x on %s belongs to no client, removing it", minor, dev);
+			rc |= tc_del_client(fd, dev, minor - TC_CLASS_MINOR(0), FW_MARK_AUTHENTICATED);
+		}
+	}
+
+	UNLOCK_CLIENT_LIST();
+
+	close(fd);
+	free(classes);
+
+	return rc;
+}
+
+/**
+ * Compare the classes in the kernel with the authenticated clients,
+ * removing classes left over by lost deauthentications and adding
+ * those that are missing.
+ */
+int
+tc_reconcile(void)
+{
+	int download_limit, upload_limit, rc = 0;
+	char *download_imqname, *upload_imqname;
+	s_config *config;
+
+	LOCK_CONFIG();
+	config = config_get_config();
+	download_limit = config->download_limit;
+	upload_limit = config->upload_limit;
+	tc_get_devices(&download_imqname, &upload_imqname); /* must free */
+	if (config->tc_qdisc == TC_QDISC_CAKE) {
+		/* No client classes to reconcile */
+		download_limit = upload_limit = 0;
+	}
+	UNLOCK_CONFIG();
+
+	if (download_limit > 0) {
+		rc |= _tc_reconcile_dev(download_imqname, download_limit, 0);
+	}
+	if (upload_limit > 0) {
+		rc |= _tc_reconcile_dev(upload_imqname, upload_limit, 1);
+	}
+
+	free(upload_imqname);
+	free(download_imqname);
+
+	return rc;
+}
+
+/** Counters of the client classes found by one dump, indexed by client index */
+typedef struct {
+	int count;
+	struct {
+		int seen;
+		struct gnet_stats_basic basic;
+		struct gnet_stats_queue queue;
+	} *slot;
+} t_tc_dump_stats;
+
+/** Serializes tc_stats_update(), so counters are folded in the order they were read */
+static pthread_mutex_t tc_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** @internal
+ * Copy a statistics attribute, which depending on the kernel
+ * may be shorter or longer than our struct.
+ */
+static void
+_tc_copy_stats(void *to, size_t size, struct rtattr *rta)
+{
+	if (rta) {
+		memcpy(to, RTA_DATA(rta), RTA_PAYLOAD(rta) < size ? RTA_PAYLOAD(rta) : size);
+	}
+}
+
+/** @internal
+ * Dump callback copying the statistics of client classes.
+ */
+static int
+_tc_dump_stats(struct nlmsghdr *n, void *arg)
+{
+	t_tc_dump_stats *stats = arg;
+	struct tcmsg *t = NLMSG_DATA(n);
+	struct rtattr *tb[TCA_MAX + 1], *xs[TCA_STATS_MAX + 1];
+	int idx;
+
+	if (n->nlmsg_type != RTM_NEWTCLASS || n->nlmsg_len < NLMSG_LENGTH(sizeof(*t))) {
+		return 0;
+	}
+
+	idx = (int) TC_H_MIN(t->tcm_handle) - TC_CLASS_MINOR(0);
+	if (TC_H_MAJ(t->tcm_handle) != TC_HTB_HANDLE || idx < 0 || idx >= stats->count) {
+		return 0;
+	}
+
+	rtnl_parse_attrs(tb, TCA_MAX, TCA_RTA(t), n->nlmsg_len - NLMSG_LENGTH(sizeof(*t)));
+	if (!tb[TCA_STATS2]) {
+		return 0;
+	}
+
+	rtnl_parse_attrs(xs, TCA_STATS_MAX, RTA_DATA(tb[TCA_STATS2]), RTA_PAYLOAD(tb[TCA_STATS2]));
+	_tc_copy_stats(&stats->slot[idx].basic, sizeof(struct gnet_stats_basic), xs[TCA_STATS_BASIC]);
+	_tc_copy_stats(&stats->slot[idx].queue, sizeof(struct gnet_stats_queue), xs[TCA_STATS_QUEUE]);
+	stats->slot[idx].seen = 1;
+
+	return 0;
+}
+
+/** @internal
+ * Fold the counters just read from a client's class into its statistics.
+ * The first read only sets the base the next ones count from.
+ */
+static void
+_tc_stats_fold(t_tc_stats *s, struct gnet_stats_basic *basic, struct gnet_stats_queue *queue, time_t now)
+{
+	unsigned long long bytes = basic->bytes;
+	double w;
+
+	if (s->last_updated) {
+		/* Counters going backwards mean the class was added again */
+		bytes = bytes >= s->class_bytes ? bytes - s->class_bytes : bytes;
+		s->bytes += bytes;
+		s->packets += basic->packets >= s->class_packets ? basic->packets - s->class_packets : basic->packets;
+		s->drops += queue->drops >= s->class_drops ? queue->drops - s->class_drops : queue->drops;
+		s->overlimits += queue->overlimits >= s->class_overlimits ? queue->overlimits - s->class_overlimits : queue->overlimits;
+		if (now > s->last_updated) {
+			/* Weigh the new sample by how long it covers, without needing exp() */
+			w = (double) (now - s->last_updated) / (now - s->last_updated + TC_STATS_EWMA_SECS);
+			s->rate += w * ((double) bytes / (now - s->last_updated) - s->rate);
+		}
+	}
+
+	if (now > s->last_updated) {
+		s->last_updated = now;
+	}
+	s->class_bytes = basic->bytes;
+	s->class_packets = basic->packets;
+	s->class_drops = queue->drops;
+	s->class_overlimits = queue->overlimits;
+	s->backlog = queue->backlog;
+}
+
+/** @internal
+ * Read the statistics of the client classes on dev with one dump,
+ * and fold them into the clients' download or upload statistics.
+ */
+static int
+_tc_stats_dev(char *dev, int maxclients, int upload)
+{
+	t_tc_dump_stats stats;
+	t_client *client;
+	time_t now;
+	int rc;
+
+	stats.count = maxclients;
+	stats.slot = safe_malloc(maxclients * sizeof(*stats.slot));
+	memset(stats.slot, 0, maxclients * sizeof(*stats.slot));
+
+	if ((rc = _tc_dump(dev, _tc_dump_stats, &stats)) == 0) {
+		now = time(NULL);
+
+		LOCK_CLIENT_LIST();
+
+		for (client = client_get_first_client(); client; client = client->next) {
+			if (client->fw_connection_state != FW_MARK_AUTHENTICATED && !client->parked) {
+				continue;
+			}
+			if (client->idx < 0 || client->idx >= maxclients || !stats.slot[client->idx].seen) {
+				continue;
+			}
+			_tc_stats_fold(upload ? &client->tc_upload : &client->tc_download,
+						   &stats.slot[client->idx].basic, &stats.slot[client->idx].queue, now);
+		}
+
+		UNLOCK_CLIENT_LIST();
+	}
+
+	free(stats.slot);
+
+	return rc;
+}
+
+/**
+ * Update the shaping statistics of the authenticated clients from
+ * their classes on both devices, to see which hit their limits.
+ */
+int
+tc_stats_update(void)
+{
+	int download_limit, upload_limit, maxclients, rc = 0;
+	char *download_imqname, *upload_imqname;
+	s_config *config;
+
+	LOCK_CONFIG();
+	config = config_get_config();
+	download_limit = config->download_limit;
+	upload_limit = config->upload_limit;
+	maxclients = config->maxclients;
+	tc_get_devices(&download_imqname, &upload_imqname); /* must free */
+	if (!config->traffic_control || config->tc_qdisc == TC_QDISC_CAKE) {
+		/* No client classes to read */
+		download_limit = upload_limit = 0;
+	}
+	UNLOCK_CONFIG();
+
+	pthread_mutex_lock(&tc_stats_mutex);
+	if (download_limit > 0) {
+		rc |= _tc_stats_dev(download_imqname, maxclients, 0);
+	}
+	if (upload_limit > 0) {
+		rc |= _tc_stats_dev(upload_imqname, maxclients, 1);
+	}
+	pthread_mutex_unlock(&tc_stats_mutex);
+
+	free(upload_imqname);
+	free(download_imqname);
+
+	return rc;
+}
@@ -25,6 +25,28 @@
 #define MTU 1500
 #define HZ 100
 
+/** Handle of the root htb qdisc, 1: */
+#define TC_HTB_HANDLE 0x10000
+
+/** Priority of the filters classifying client packets */
+#define TC_FILTER_PRIO 1
+
+/** Minor of the htb class of the i-th TrafficControlPlan, 1:i+3 */
+#define TC_PLAN_MINOR(i) ((i) + 3)
+
+/** Minor of the htb class of the client with index idx, 1:idx+12.
+ *  The flow filter computes it from the client mark, see tc_filter_flow() */
+#define TC_CLASS_MINOR(idx) ((idx) + 12)
+
+/** Placeholder device index of requests made in a dry run */
+#define TC_DRY_RUN_IFINDEX 0x7fffffff
+
+/** Time constant of the moving average of client class rates, in seconds */
+#define TC_STATS_EWMA_SECS 30
+
+/** ifb device upload traffic is shaped on, in IFB mode */
+#define TC_IFB_DEVICE "ndsifb0"
+
 
 int
 tc_init_tc(void);
@@ -32,5 +54,26 @@ tc_init_tc(void);
 int
 tc_destroy_tc(void);
 
+int
+tc_attach_client(char *down_dev, int download_limit, char *up_dev, int upload_limit, int idx, int fw_mark, const char *plan);
+
+int
+tc_change_client(char *down_dev, int download_limit, char *up_dev, int upload_limit, int idx, const char *old_plan, const char *plan);
+
+int
+tc_detach_client(char *down_dev, char *up_dev, int idx);
+
+void
+tc_get_devices(char **down_dev, char **up_dev);
+
+int
+tc_dump_classes(char *dev, unsigned char *classes);
+
+int
+tc_reconcile(void);
+
+int
+tc_stats_update(void);
+
 
 #endif /* _TC_H_ */
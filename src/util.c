@@ -72,6 +72,14 @@
 #include "conf.h"
 #include "debug.h"
 #include "firewall.h"
+#include "probe.h"
+#include "tc.h"
+#include "cmdstat.h"
+#include "wl_service.h"
+#include "neigh.h"
+#include "http.h"
+#include "sni.h"
+#include "assets.h"
 
 
 static pthread_mutex_t ghbn_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -90,6 +98,7 @@ extern unsigned int authenticated_since_start;
 /** Fork a child and execute a shell command.
  * The parent process waits for the child to return,
  * and returns the child's exit() value.
+ * In dry run mode the command is only logged, and succeeds.
  * @return Return code of the command
  */
 int
@@ -99,6 +108,12 @@ execute(char *cmd_line, int quiet)
 	pid_t pid, rc;
 	struct sigaction sa, oldsa;
 	const char *new_argv[4];
+
+	cmdstat_spawn(cmd_line);
+	if (cmdstat_dry_run()) {
+		return 0;
+	}
+
 	new_argv[0] = "/bin/sh";
 	new_argv[1] = "-c";
 	new_argv[2] = cmd_line;
@@ -161,6 +176,21 @@ execute(char *cmd_line, int quiet)
 }
 
 
+/** Start a shell command with popen(), counting the process.
+ * In dry run mode the command is only logged, and reads nothing
+ * or has its input thrown away. Close the stream with pclose().
+ */
+FILE *
+execute_popen(const char *cmd_line, const char *mode)
+{
+	cmdstat_spawn(cmd_line);
+	if (cmdstat_dry_run()) {
+		return popen(mode[0] == 'r' ? "true" : "cat >/dev/null", mode);
+	}
+
+	return popen(cmd_line, mode);
+}
+
 void
 safe_sleep(int seconds){
     pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
@@ -180,30 +210,6 @@ safe_sleep(int seconds){
     pthread_mutex_unlock(&cond_mutex);
 }
 
-char * 
-hostname_to_ip(char * hostname) {
-    struct hostent *he;
-    struct in_addr **addr_list;
-    int i;
-         
-    if ( (he = gethostbyname( hostname ) ) == NULL) {
-        // get the host info
-        debug(LOG_DEBUG, "Cannot retrieve ip for hostname: %s", hostname);
-        return NULL;
-    }
- 
-    addr_list = (struct in_addr **) he->h_addr_list;
-     
-    for(i = 0; addr_list[i] != NULL; i++) {
-        //Return the first one
-        debug(LOG_DEBUG, "Retrieved ip for hostname: %s", hostname);
-        return inet_ntoa(*addr_list[i]);
-    }
-     
-    return NULL;
-}
-
-
 void
 condense_alpha_str(char *str) {
   int source = 0; // index of copy source
@@ -462,16 +468,18 @@ char * get_status_text()
 {
 	char buffer[STATUS_BUF_SIZ];
 	char timebuf[32];
+	char features_text[256];
 	char * str;
 	ssize_t len;
 	s_config *config;
 	t_client *client;
-	int	   indx;
+	int	   indx, features;
 	unsigned long int now, uptimesecs, durationsecs = 0;
 	unsigned long long int download_bytes, upload_bytes;
 	t_MAC *trust_mac;
 	t_MAC *allow_mac;
 	t_MAC *block_mac;
+	t_tc_plan *plan;
 
 	config = config_get_config();
 
@@ -535,6 +543,13 @@ char * get_status_text()
 	len = strlen(buffer);
 
 	if(config->traffic_control) {
+		snprintf((buffer + len), (sizeof(buffer) - len), "Traffic control mode: %s, %s\n", config->tc_mode == TC_MODE_IFB ? "ifb" : "imq",
+				 config->tc_qdisc == TC_QDISC_CAKE ? "cake" : "htb");
+		len = strlen(buffer);
+		if(config->tc_pool && config->tc_qdisc == TC_QDISC_HTB) {
+			snprintf((buffer + len), (sizeof(buffer) - len), "Traffic control pool: %d classes\n", config->maxclients);
+			len = strlen(buffer);
+		}
 		if(config->download_limit > 0) {
 			snprintf((buffer + len), (sizeof(buffer) - len), "Download rate limit: %d kbit/s\n", config->download_limit);
 			len = strlen(buffer);
@@ -549,8 +564,74 @@ char * get_status_text()
 			snprintf((buffer + len), (sizeof(buffer) - len), "Upload rate limit: none\n");
 			len = strlen(buffer);
 		}
+		if(config->tc_qdisc == TC_QDISC_HTB) {
+			if(config->uplink_download_rate > 0 || config->uplink_upload_rate > 0) {
+				snprintf((buffer + len), (sizeof(buffer) - len), "Uplink rate: %d/%d kbit/s\n",
+						 config->uplink_download_rate, config->uplink_upload_rate);
+				len = strlen(buffer);
+			}
+			for (plan = config->tc_plans; plan != NULL; plan = plan->next) {
+				snprintf((buffer + len), (sizeof(buffer) - len), "Traffic control plan %s: %d/%d kbit/s, ceil %d/%d kbit/s\n",
+						 plan->name, plan->download_rate, plan->upload_rate, plan->download_ceil, plan->upload_ceil);
+				len = strlen(buffer);
+			}
+		}
 	}
 
+	snprintf((buffer + len), (sizeof(buffer) - len), "Flow offload: %s\n", config->flow_offload ? "yes" : "no");
+	len = strlen(buffer);
+
+	snprintf((buffer + len), (sizeof(buffer) - len), "Walled garden: %s\n", config->walled_garden ? (config->walled_garden_snoop ? "yes, DNS snooping" : "yes") : "no");
+	len = strlen(buffer);
+
+	str = neigh_text();
+	snprintf((buffer + len), (sizeof(buffer) - len), "%s", str);
+	len = strlen(buffer);
+	free(str);
+
+	str = wl_breaker_text();
+	snprintf((buffer + len), (sizeof(buffer) - len), "%s", str);
+	len = strlen(buffer);
+	free(str);
+
+	str = wl_admission_text();
+	snprintf((buffer + len), (sizeof(buffer) - len), "%s", str);
+	len = strlen(buffer);
+	free(str);
+
+	str = assets_text();
+	snprintf((buffer + len), (sizeof(buffer) - len), "%s", str);
+	len = strlen(buffer);
+	free(str);
+
+	str = http_probe_text();
+	snprintf((buffer + len), (sizeof(buffer) - len), "%s", str);
+	len = strlen(buffer);
+	free(str);
+
+	if (config->https_preauth == HTTPS_PREAUTH_PEEK) {
+		str = sni_text();
+		snprintf((buffer + len), (sizeof(buffer) - len), "%s", str);
+		len = strlen(buffer);
+		free(str);
+	}
+
+	if ((features = probe_features(0)) >= 0) {
+		probe_features_text(features, features_text, sizeof(features_text));
+		snprintf((buffer + len), (sizeof(buffer) - len), "Kernel features: %s\n", features_text);
+		len = strlen(buffer);
+	}
+
+	if(config->dry_run) {
+		snprintf((buffer + len), (sizeof(buffer) - len), "Dry run: yes\n");
+		len = strlen(buffer);
+	}
+
+	str = cmdstat_text();
+	snprintf((buffer + len), (sizeof(buffer) - len), "Control plane:\n%s", str);
+	len = strlen(buffer);
+	free(str);
+
 	download_bytes = iptables_fw_total_download();
 	snprintf((buffer + len), (sizeof(buffer) - len), "Total download: %llu kByte", download_bytes/1000);
 	len = strlen(buffer);
@@ -571,6 +652,7 @@ char * get_status_text()
 
 	/* Update the client's counters so info is current */
 	iptables_fw_counters_update();
+	tc_stats_update();
 
 	LOCK_CLIENT_LIST();
 
@@ -617,15 +699,43 @@ char * get_status_text()
 				 fw_connection_state_as_string(client->fw_connection_state));
 		len = strlen(buffer);
 
+		if(client->plan) {
+			snprintf((buffer + len), (sizeof(buffer) - len), "  Plan: %s\n", client->plan);
+			len = strlen(buffer);
+		}
+
+		if(client->parked) {
+			snprintf((buffer + len), (sizeof(buffer) - len), "  Parked: %lu secs ago\n", (unsigned long) (now - client->parked));
+			len = strlen(buffer);
+		}
+
 		download_bytes = client->counters.incoming;
 		upload_bytes = client->counters.outgoing;
 
 		snprintf((buffer + len), (sizeof(buffer) - len),
-				 "  Download: %llu kByte; avg: %.6g kbit/s\n  Upload:   %llu kByte; avg: %.6g kbit/s\n\n",
+				 "  Download: %llu kByte; avg: %.6g kbit/s\n  Upload:   %llu kByte; avg: %.6g kbit/s\n",
 				 download_bytes/1000, ((double)download_bytes)/125/durationsecs,
 				 upload_bytes/1000, ((double)upload_bytes)/125/durationsecs);
 		len = strlen(buffer);
 
+		if(client->tc_download.last_updated) {
+			snprintf((buffer + len), (sizeof(buffer) - len),
+					 "  Shaped download: %.6g kbit/s; drops: %lu; overlimits: %lu; backlog: %u bytes\n",
+					 client->tc_download.rate/125, client->tc_download.drops,
+					 client->tc_download.overlimits, client->tc_download.backlog);
+			len = strlen(buffer);
+		}
+		if(client->tc_upload.last_updated) {
+			snprintf((buffer + len), (sizeof(buffer) - len),
+					 "  Shaped upload:   %.6g kbit/s; drops: %lu; overlimits: %lu; backlog: %u bytes\n",
+					 client->tc_upload.rate/125, client->tc_upload.drops,
+					 client->tc_upload.overlimits, client->tc_upload.backlog);
+			len = strlen(buffer);
+		}
+
+		snprintf((buffer + len), (sizeof(buffer) - len), "\n");
+		len = strlen(buffer);
+
 		indx++;
 		client = client->next;
 	}
@@ -710,6 +820,7 @@ char * get_clients_text()
 
 	/* Update the client's counters so info is current */
 	iptables_fw_counters_update();
+	tc_stats_update();
 
 	LOCK_CLIENT_LIST();
 
@@ -745,16 +856,37 @@ char * get_clients_text()
 				 fw_connection_state_as_string(client->fw_connection_state));
 		len = strlen(buffer);
 
+		snprintf((buffer + len), (sizeof(buffer) - len), "plan=%s\n", client->plan ? client->plan : "none");
+		len = strlen(buffer);
+
 		durationsecs = now - client->added_time;
 		download_bytes = client->counters.incoming;
 		upload_bytes = client->counters.outgoing;
 
 		snprintf((buffer + len), (sizeof(buffer) - len),
-				 "downloaded=%llu\navg_down_speed=%.6g\nuploaded=%llu\navg_up_speed=%.6g\n\n",
+				 "downloaded=%llu\navg_down_speed=%.6g\nuploaded=%llu\navg_up_speed=%.6g\n",
 				 download_bytes/1000, ((double)download_bytes)/125/durationsecs,
 				 upload_bytes/1000, ((double)upload_bytes)/125/durationsecs);
 		len = strlen(buffer);
 
+		if(client->tc_download.last_updated) {
+			snprintf((buffer + len), (sizeof(buffer) - len),
+					 "shaped_down_speed=%.6g\nshaped_down_drops=%lu\nshaped_down_overlimits=%lu\nshaped_down_backlog=%u\n",
+					 client->tc_download.rate/125, client->tc_download.drops,
+					 client->tc_download.overlimits, client->tc_download.backlog);
+			len = strlen(buffer);
+		}
+		if(client->tc_upload.last_updated) {
+			snprintf((buffer + len), (sizeof(buffer) - len),
+					 "shaped_up_speed=%.6g\nshaped_up_drops=%lu\nshaped_up_overlimits=%lu\nshaped_up_backlog=%u\n",
+					 client->tc_upload.rate/125, client->tc_upload.drops,
+					 client->tc_upload.overlimits, client->tc_upload.backlog);
+			len = strlen(buffer);
+		}
+
+		snprintf((buffer + len), (sizeof(buffer) - len), "\n");
+		len = strlen(buffer);
+
 		indx++;
 		client = client->next;
 	}
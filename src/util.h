@@ -27,11 +27,16 @@
 #ifndef _UTIL_H_
 #define _UTIL_H_
 
+#include <stdio.h>
+
 #define STATUS_BUF_SIZ	16384
 
 /** @brief Execute a shell command
  */
 int execute(char *cmd_line, int quiet);
+
+/** @brief Start a shell command with popen() */
+FILE *execute_popen(const char *cmd_line, const char *mode);
 struct in_addr *wd_gethostbyname(const char *name);
 
 /* @brief Get IP address of an interface */
@@ -60,7 +65,6 @@ void mark_auth_offline();
 /* @brief Returns a guess (true or false) on whether we're an auth server is online or not based on previous calls to mark_auth_online and mark_auth_offline */
 int is_auth_online();
 
-char * hostname_to_ip(char * hostname);
 /*
  * @brief Mallocs and returns nodogsplash uptime string
  */
@@ -0,0 +1,586 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ \********************************************************************/
+
+/** @internal
+  @file walled_garden.c
+  @brief Walled garden of hosts reachable before authentication
+
+  The hosts listed in HOSTS_FILE_PATH are resolved in their own thread,
+  and every A record is put into the WG_IPSET ipset with a timeout
+  derived from the record's TTL.  The firewall matches preauthenticated
+  traffic against the set, so addresses come and go without touching
+  the iptables rules.  Each round of lookups is applied as a single
+  ipset restore batch.
+
+  Hosts behind CDNs rotate addresses faster than they can be looked up.
+  With DNS snooping, the DNS replies sent to clients are queued to
+  userspace by the WG_SNOOP_QUEUE NFQUEUE rule, answers for walled garden
+  names are added to the set over the snooper's own nfnetlink socket,
+  and only once the kernel has acknowledged them is the reply let through.
+  The client thus reaches the very address its resolver returned.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <linux/netlink.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_queue.h>
+#include <linux/netfilter/ipset/ip_set.h>
+
+#include "common.h"
+
+#include "safe.h"
+#include "conf.h"
+#include "debug.h"
+#include "util.h"
+#include "rtnl.h"
+#include "wl_service.h"
+#include "walled_garden.h"
+
+/** A host of the walled garden and when to look it up again */
+typedef struct _t_wg_host {
+	struct _t_wg_host *next;
+	char *name;
+	time_t next_refresh;
+} t_wg_host;
+
+static t_wg_host *wg_hosts = NULL;
+
+/** The hosts file is read once, by whichever thread needs it first */
+static pthread_once_t wg_hosts_once = PTHREAD_ONCE_INIT;
+
+
+/** Create the walled garden ipset.
+ *  Entries carry their own timeout, so the set needs a default one.
+ */
+int
+wg_fw_init(void)
+{
+	char *cmd;
+	int rc;
+
+	debug(LOG_DEBUG, "Creating ipset " WG_IPSET);
+	safe_asprintf(&cmd, "ipset -exist create " WG_IPSET " hash:ip timeout %d", WG_MAX_TTL);
+	rc = execute(cmd, 0);
+	free(cmd);
+	if (rc != 0) {
+		debug(LOG_ERR, "Could not create ipset " WG_IPSET ". Walled garden will not work");
+	}
+
+	return rc;
+}
+
+/** Destroy the walled garden ipset.
+ *  The firewall rules referring to it must be gone already.
+ */
+int
+wg_fw_destroy(void)
+{
+	debug(LOG_DEBUG, "Destroying ipset " WG_IPSET);
+	execute("ipset -exist destroy " WG_IPSET, 1);
+
+	return 0;
+}
+
+/** Start a batched update of the walled garden ipset.
+ *  Returns NULL if ipset could not be run.
+ */
+FILE *
+wg_batch_begin(void)
+{
+	FILE *batch;
+
+	batch = execute_popen("ipset -exist restore", "w");
+	if (!batch) {
+		debug(LOG_ERR, "popen(): %s", strerror(errno));
+	}
+
+	return batch;
+}
+
+/** @internal
+ * Set entry timeout for a record TTL.
+ */
+static unsigned int
+_wg_timeout(unsigned int ttl)
+{
+	if (ttl < WG_MIN_TTL) {
+		ttl = WG_MIN_TTL;
+	} else if (ttl > WG_MAX_TTL) {
+		ttl = WG_MAX_TTL;
+	}
+
+	return ttl + WG_TTL_GRACE;
+}
+
+/** Queue an address into a batched update.
+ *  -exist makes this refresh the timeout of an address already in the set.
+ */
+void
+wg_batch_add(FILE *batch, const char *ip, unsigned int ttl)
+{
+	fprintf(batch, "add " WG_IPSET " %s timeout %u\n", ip, _wg_timeout(ttl));
+}
+
+/** Apply a batched update of the walled garden ipset. */
+int
+wg_batch_commit(FILE *batch)
+{
+	int rc;
+
+	rc = pclose(batch);
+	if (rc == -1 && errno == ECHILD) {
+		/* Reaped by the SIGCHLD handler, see execute() */
+		rc = 0;
+	} else if (rc != -1 && WIFEXITED(rc)) {
+		rc = WEXITSTATUS(rc);
+	}
+	if (rc != 0) {
+		debug(LOG_ERR, "Nonzero exit status %d from ipset restore", rc);
+	}
+
+	return rc;
+}
+
+/** @internal
+ * Read the walled garden hosts, one name per line.
+ */
+static void
+_wg_read_hosts(void)
+{
+	FILE *file;
+	char line[256];
+	t_wg_host *host;
+
+	file = fopen(HOSTS_FILE_PATH, "r");
+	if (!file) {
+		debug(LOG_WARNING, "Cannot open walled garden hosts file %s", HOSTS_FILE_PATH);
+		return;
+	}
+
+	while (fgets(line, sizeof(line), file)) {
+		if (line[0] == '#') {
+			continue;
+		}
+		condense_alpha_str(line);
+		if (line[0] == '\0') {
+			continue;
+		}
+		host = safe_malloc(sizeof(t_wg_host));
+		host->name = safe_strdup(line);
+		host->next_refresh = 0;
+		host->next = wg_hosts;
+		wg_hosts = host;
+		debug(LOG_INFO, "Walled garden host %s", host->name);
+	}
+	fclose(file);
+}
+
+/** @internal
+ * Resolve every A record of a host into the batch.
+ * Returns the lowest TTL seen, or -1 if the host did not resolve.
+ */
+static int
+_wg_resolve(FILE *batch, const char *name)
+{
+	unsigned char answer[NS_PACKETSZ * 4];
+	char ip[INET_ADDRSTRLEN];
+	ns_msg msg;
+	ns_rr rr;
+	int len, i, count, ttl = -1;
+
+	len = res_query(name, ns_c_in, ns_t_a, answer, sizeof(answer));
+	if (len < 0 || ns_initparse(answer, len, &msg) < 0) {
+		debug(LOG_DEBUG, "Cannot retrieve ip for hostname: %s", name);
+		return -1;
+	}
+
+	count = ns_msg_count(msg, ns_s_an);
+	for (i = 0; i < count; i++) {
+		if (ns_parserr(&msg, ns_s_an, i, &rr) < 0) {
+			break;
+		}
+		/* CNAME records are followed by the A records of their target */
+		if (ns_rr_type(rr) != ns_t_a || ns_rr_rdlen(rr) != 4) {
+			continue;
+		}
+		inet_ntop(AF_INET, ns_rr_rdata(rr), ip, sizeof(ip));
+		wg_batch_add(batch, ip, ns_rr_ttl(rr));
+		debug(LOG_DEBUG, "Walled garden %s -> %s, ttl %u", name, ip, ns_rr_ttl(rr));
+		if (ttl < 0 || (int) ns_rr_ttl(rr) < ttl) {
+			ttl = ns_rr_ttl(rr);
+		}
+	}
+
+	return ttl;
+}
+
+/** Launched in its own thread.
+ *  Looks up each walled garden host when its records are about to expire,
+ *  and applies the lookups of a round as one ipset batch.
+ */
+void
+thread_walled_garden(const void *arg)
+{
+	pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+	pthread_mutex_t cond_mutex = PTHREAD_MUTEX_INITIALIZER;
+	struct	timespec	timeout;
+	t_wg_host *host;
+	FILE *batch;
+	time_t now, wakeup;
+	int ttl;
+
+	pthread_once(&wg_hosts_once, _wg_read_hosts);
+
+	while (1) {
+		now = time(NULL);
+		wakeup = now + WG_MAX_TTL;
+
+		/* Pick up resolv.conf changes */
+		res_init();
+
+		batch = wg_batch_begin();
+		for (host = wg_hosts; batch && host != NULL; host = host->next) {
+			if (host->next_refresh <= now) {
+				ttl = _wg_resolve(batch, host->name);
+				if (ttl < 0) {
+					host->next_refresh = now + WG_RETRY_INTERVAL;
+				} else {
+					host->next_refresh = now + (ttl < WG_MIN_TTL ? WG_MIN_TTL : (ttl > WG_MAX_TTL ? WG_MAX_TTL : ttl));
+				}
+			}
+			if (host->next_refresh < wakeup) {
+				wakeup = host->next_refresh;
+			}
+		}
+		if (batch) {
+			wg_batch_commit(batch);
+		} else {
+			wakeup = now + WG_RETRY_INTERVAL;
+		}
+
+		/* Sleep until the first host is due */
+		timeout.tv_sec = wakeup;
+		timeout.tv_nsec = 0;
+
+		/* Mutex must be locked for pthread_cond_timedwait... */
+		pthread_mutex_lock(&cond_mutex);
+
+		/* Thread safe "sleep" */
+		pthread_cond_timedwait(&cond, &cond_mutex, &timeout);
+
+		/* No longer needs to be locked */
+		pthread_mutex_unlock(&cond_mutex);
+	}
+}
+
+/** @internal
+ * Whether a name is a walled garden host or one of its subdomains.
+ */
+static int
+_wg_is_walled(const char *name)
+{
+	t_wg_host *host;
+	size_t len, hlen;
+
+	len = strlen(name);
+	for (host = wg_hosts; host != NULL; host = host->next) {
+		hlen = strlen(host->name);
+		if (len == hlen && !strcasecmp(name, host->name)) {
+			return 1;
+		}
+		if (len > hlen && name[len - hlen - 1] == '.' && !strcasecmp(name + len - hlen, host->name)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/** @internal
+ * Send an nfnetlink request and wait for its acknowledgement.
+ * Unlike rtnl_talk(), this is data plane work done for each DNS reply,
+ * so it is neither counted by cmdstat nor skipped in dry run.
+ * Returns 0, or a negative errno.
+ */
+static int
+_wg_nfnl_talk(int fd, struct nlmsghdr *n)
+{
+	static unsigned int seq = 0;
+	char buf[NLMSG_SPACE(sizeof(struct nlmsgerr)) + 256];
+	struct nlmsghdr *h;
+	struct nlmsgerr *err;
+	int len;
+
+	n->nlmsg_flags |= NLM_F_REQUEST | NLM_F_ACK;
+	n->nlmsg_seq = ++seq;
+
+	if (send(fd, n, n->nlmsg_len, 0) < 0) {
+		return -errno;
+	}
+
+	while (1) {
+		len = recv(fd, buf, sizeof(buf), 0);
+		if (len < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		}
+		for (h = (struct nlmsghdr *) buf; NLMSG_OK(h, len); h = NLMSG_NEXT(h, len)) {
+			if (h->nlmsg_seq != n->nlmsg_seq || h->nlmsg_type != NLMSG_ERROR) {
+				continue;
+			}
+			err = NLMSG_DATA(h);
+			return h->nlmsg_len < NLMSG_LENGTH(sizeof(*err)) ? -EINVAL : err->error;
+		}
+	}
+}
+
+/** @internal
+ * Add an address to the walled garden ipset and wait for the kernel
+ * to acknowledge it, like "ipset -exist add" without the fork.
+ * Returns 0, or a negative errno.
+ */
+static int
+_wg_ipset_add(int fd, const void *addr, unsigned int ttl)
+{
+	struct {
+		struct nlmsghdr n;
+		struct nfgenmsg nfg;
+		char buf[256];
+	} req;
+	struct rtattr *data, *ip;
+	__u8 protocol = IPSET_PROTOCOL;
+
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct nfgenmsg));
+	/* No NLM_F_EXCL: an address already in the set gets its timeout refreshed */
+	req.n.nlmsg_type = (NFNL_SUBSYS_IPSET << 8) | IPSET_CMD_ADD;
+	req.nfg.nfgen_family = AF_INET;
+	req.nfg.version = NFNETLINK_V0;
+
+	rtnl_addattr_l(&req.n, sizeof(req), IPSET_ATTR_PROTOCOL, &protocol, sizeof(protocol));
+	rtnl_addattr_l(&req.n, sizeof(req), IPSET_ATTR_SETNAME, WG_IPSET, sizeof(WG_IPSET));
+	data = rtnl_nest(&req.n, sizeof(req), IPSET_ATTR_DATA | NLA_F_NESTED);
+	ip = rtnl_nest(&req.n, sizeof(req), IPSET_ATTR_IP | NLA_F_NESTED);
+	rtnl_addattr_l(&req.n, sizeof(req), IPSET_ATTR_IPADDR_IPV4 | NLA_F_NET_BYTEORDER, addr, 4);
+	rtnl_nest_end(&req.n, ip);
+	rtnl_addattr32(&req.n, sizeof(req), IPSET_ATTR_TIMEOUT | NLA_F_NET_BYTEORDER, htonl(_wg_timeout(ttl)));
+	rtnl_nest_end(&req.n, data);
+
+	return _wg_nfnl_talk(fd, &req.n);
+}
+
+/** @internal
+ * Add the A records of a snooped DNS reply to the walled garden,
+ * if it answers a question for a walled garden name.
+ */
+static void
+_wg_snoop_reply(int ipset_fd, const unsigned char *payload, int len)
+{
+	const struct iphdr *iph;
+	ns_msg msg;
+	ns_rr rr;
+	char ip[INET_ADDRSTRLEN];
+	int hlen, i, count, rc;
+
+	iph = (const struct iphdr *) payload;
+	if (len < (int) sizeof(struct iphdr) || iph->version != 4 || iph->protocol != IPPROTO_UDP) {
+		return;
+	}
+	hlen = iph->ihl * 4;
+	if (len < hlen + (int) sizeof(struct udphdr)) {
+		return;
+	}
+	payload += hlen + sizeof(struct udphdr);
+	len -= hlen + sizeof(struct udphdr);
+
+	if (ns_initparse(payload, len, &msg) < 0
+			|| ns_msg_count(msg, ns_s_qd) != 1
+			|| ns_parserr(&msg, ns_s_qd, 0, &rr) < 0
+			|| !_wg_is_walled(ns_rr_name(rr))) {
+		return;
+	}
+
+	count = ns_msg_count(msg, ns_s_an);
+	for (i = 0; i < count; i++) {
+		if (ns_parserr(&msg, ns_s_an, i, &rr) < 0) {
+			break;
+		}
+		if (ns_rr_type(rr) != ns_t_a || ns_rr_rdlen(rr) != 4) {
+			continue;
+		}
+		inet_ntop(AF_INET, ns_rr_rdata(rr), ip, sizeof(ip));
+		if ((rc = _wg_ipset_add(ipset_fd, ns_rr_rdata(rr), ns_rr_ttl(rr))) != 0) {
+			debug(LOG_ERR, "Could not add %s to ipset " WG_IPSET ": %s", ip, strerror(-rc));
+			continue;
+		}
+		debug(LOG_DEBUG, "Walled garden snooped %s -> %s, ttl %u", ns_rr_name(rr), ip, ns_rr_ttl(rr));
+	}
+}
+
+/** @internal
+ * Send a nfnetlink_queue message carrying a single attribute.
+ */
+static int
+_wg_nfq_send(int fd, int type, int attr, const void *data, int len)
+{
+	char buf[NLMSG_SPACE(sizeof(struct nfgenmsg) + NLA_HDRLEN + 64)];
+	struct nlmsghdr *nlh;
+	struct nfgenmsg *nfg;
+	struct nlattr *nla;
+
+	memset(buf, 0, sizeof(buf));
+	nlh = (struct nlmsghdr *) buf;
+	nlh->nlmsg_len = NLMSG_LENGTH(sizeof(struct nfgenmsg) + NLA_HDRLEN + NLA_ALIGN(len));
+	nlh->nlmsg_type = (NFNL_SUBSYS_QUEUE << 8) | type;
+	nlh->nlmsg_flags = NLM_F_REQUEST;
+
+	nfg = NLMSG_DATA(nlh);
+	nfg->nfgen_family = AF_UNSPEC;
+	nfg->version = NFNETLINK_V0;
+	nfg->res_id = htons(WG_SNOOP_QUEUE);
+
+	nla = (struct nlattr *) ((char *) nfg + sizeof(struct nfgenmsg));
+	nla->nla_len = NLA_HDRLEN + len;
+	nla->nla_type = attr;
+	memcpy((char *) nla + NLA_HDRLEN, data, len);
+
+	return send(fd, buf, nlh->nlmsg_len, 0);
+}
+
+/** Launched in its own thread.
+ *  Binds to the WG_SNOOP_QUEUE queue and lets each queued DNS reply
+ *  through once its walled garden answers are in the ipset.
+ */
+void
+thread_wg_snoop(const void *arg)
+{
+	struct sockaddr_nl addr;
+	struct nfqnl_msg_config_cmd cmd;
+	struct nfqnl_msg_config_params params;
+	struct nfqnl_msg_verdict_hdr verdict;
+	struct nfqnl_msg_packet_hdr *ph;
+	struct nlmsghdr *nlh;
+	struct nlattr *nla;
+	unsigned char buf[0xffff + 256], *payload;
+	int fd, ipset_fd, len, attrlen, payload_len;
+
+	pthread_once(&wg_hosts_once, _wg_read_hosts);
+
+	/* Set updates get their own socket, so their acknowledgements
+	 * are not mixed in with the queued packets */
+	if ((ipset_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_NETFILTER)) < 0) {
+		debug(LOG_ERR, "Could not open ipset socket: %s", strerror(errno));
+		return;
+	}
+
+	if ((fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_NETFILTER)) < 0) {
+		debug(LOG_ERR, "Could not open netfilter socket: %s", strerror(errno));
+		close(ipset_fd);
+		return;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		debug(LOG_ERR, "Could not bind netfilter socket: %s", strerror(errno));
+		close(fd);
+		close(ipset_fd);
+		return;
+	}
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.command = NFQNL_CFG_CMD_BIND;
+	cmd.pf = htons(AF_INET);
+	params.copy_range = htonl(0xffff);
+	params.copy_mode = NFQNL_COPY_PACKET;
+	if (_wg_nfq_send(fd, NFQNL_MSG_CONFIG, NFQA_CFG_CMD, &cmd, sizeof(cmd)) < 0
+			|| _wg_nfq_send(fd, NFQNL_MSG_CONFIG, NFQA_CFG_PARAMS, &params, sizeof(params)) < 0) {
+		debug(LOG_ERR, "Could not bind to queue %d: %s", WG_SNOOP_QUEUE, strerror(errno));
+		close(fd);
+		close(ipset_fd);
+		return;
+	}
+
+	debug(LOG_NOTICE, "Snooping DNS replies on queue %d", WG_SNOOP_QUEUE);
+
+	while (1) {
+		len = recv(fd, buf, sizeof(buf), 0);
+		if (len < 0) {
+			if (errno != EINTR && errno != ENOBUFS) {
+				debug(LOG_ERR, "recv(): %s", strerror(errno));
+			}
+			continue;
+		}
+
+		for (nlh = (struct nlmsghdr *) buf; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+			if (nlh->nlmsg_type != ((NFNL_SUBSYS_QUEUE << 8) | NFQNL_MSG_PACKET)) {
+				continue;
+			}
+
+			ph = NULL;
+			payload = NULL;
+			payload_len = 0;
+			attrlen = nlh->nlmsg_len - NLMSG_LENGTH(sizeof(struct nfgenmsg));
+			nla = (struct nlattr *) ((char *) NLMSG_DATA(nlh) + sizeof(struct nfgenmsg));
+			while (attrlen >= NLA_HDRLEN && nla->nla_len >= NLA_HDRLEN && nla->nla_len <= attrlen) {
+				if ((nla->nla_type & NLA_TYPE_MASK) == NFQA_PACKET_HDR) {
+					ph = (struct nfqnl_msg_packet_hdr *) ((char *) nla + NLA_HDRLEN);
+				} else if ((nla->nla_type & NLA_TYPE_MASK) == NFQA_PAYLOAD) {
+					payload = (unsigned char *) nla + NLA_HDRLEN;
+					payload_len = nla->nla_len - NLA_HDRLEN;
+				}
+				attrlen -= NLA_ALIGN(nla->nla_len);
+				nla = (struct nlattr *) ((char *) nla + NLA_ALIGN(nla->nla_len));
+			}
+			if (!ph) {
+				continue;
+			}
+
+			if (payload) {
+				_wg_snoop_reply(ipset_fd, payload, payload_len);
+			}
+
+			/* The reply always goes through, but only after the set is updated */
+			verdict.verdict = htonl(NF_ACCEPT);
+			verdict.id = ph->packet_id;
+			_wg_nfq_send(fd, NFQNL_MSG_VERDICT, NFQA_VERDICT_HDR, &verdict, sizeof(verdict));
+		}
+	}
+}
@@ -0,0 +1,69 @@
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file walled_garden.h
+    @brief Walled garden of hosts reachable before authentication
+*/
+
+#ifndef _WALLED_GARDEN_H_
+#define _WALLED_GARDEN_H_
+
+#include <stdio.h>
+
+/** ipset holding the addresses of the walled garden hosts */
+#define WG_IPSET "nds_wg"
+
+/*@{*/
+/** Bounds, in seconds, applied to the TTL of resolved records */
+#define WG_MIN_TTL 30
+#define WG_MAX_TTL 3600
+/*@}*/
+
+/** Extra lifetime of a set entry past its TTL, so it is refreshed before it expires */
+#define WG_TTL_GRACE 30
+
+/** Retry interval, in seconds, for hosts that failed to resolve */
+#define WG_RETRY_INTERVAL 60
+
+/** NFQUEUE number the DNS replies to clients are snooped on */
+#define WG_SNOOP_QUEUE 53
+
+/** @brief Create the walled garden ipset */
+int wg_fw_init(void);
+
+/** @brief Destroy the walled garden ipset */
+int wg_fw_destroy(void);
+
+/** @brief Start a batched update of the walled garden ipset */
+FILE *wg_batch_begin(void);
+
+/** @brief Queue an address with its TTL into a batched update */
+void wg_batch_add(FILE *batch, const char *ip, unsigned int ttl);
+
+/** @brief Apply a batched update of the walled garden ipset */
+int wg_batch_commit(FILE *batch);
+
+/** @brief Keep the walled garden ipset in step with the DNS */
+void thread_walled_garden(const void *arg);
+
+/** @brief Add walled garden answers of DNS replies to clients to the ipset */
+void thread_wg_snoop(const void *arg);
+
+#endif /* _WALLED_GARDEN_H_ */
@@ -25,8 +25,12 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <unistd.h>
 #include <syslog.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
 
 #include <jansson.h>
@@ -68,6 +72,7 @@ struct event {
     int type;
     int seconds;
     int speed;
+    const char *plan;
 };
 
 typedef struct event EVENT;
@@ -90,6 +95,7 @@ manage_disconnect(EVENT disconnect_event) {
         ip = safe_strdup(client->ip);
         UNLOCK_CLIENT_LIST();
         auth_client_action(ip, disconnect_event.token, AUTH_MAKE_DEAUTHENTICATED);
+        wl_admission_forget(disconnect_event.token);
         debug(LOG_NOTICE, "MAC %s Deauthenticated!", disconnect_event.token);
     } else {
 
@@ -115,6 +121,10 @@ manage_connect(EVENT connect_event) {
 
         ip = safe_strdup(client->ip);
         UNLOCK_CLIENT_LIST();
+        if (connect_event.plan != NULL) {
+            /* before authenticating, so new clients are shaped under it */
+            auth_client_plan(ip, connect_event.token, connect_event.plan);
+        }
         auth_client_action(ip, connect_event.token, AUTH_MAKE_AUTHENTICATED);
         debug(LOG_NOTICE, "MAC %s Authenticated!", connect_event.token);
     } else {
@@ -125,6 +135,34 @@ manage_connect(EVENT connect_event) {
     free(ip);
 }
 
+/**
+*
+* this function provides a simple way to manage a single event
+* RATE returned by wifiLazooo service events poller.
+* The client keeps its connection, only the rate it is shaped at changes.
+*/
+void
+manage_rate(EVENT rate_event) {
+
+    t_client *client;
+    char *ip;
+    debug(LOG_DEBUG, "Entering manage_rate on wl_service");
+    LOCK_CLIENT_LIST();
+    if ((client = client_list_find_by_mac(rate_event.token)) != NULL) {
+
+        ip = safe_strdup(client->ip);
+        UNLOCK_CLIENT_LIST();
+        if (auth_client_rate(ip, rate_event.token, rate_event.speed, rate_event.speed) == 0) {
+            debug(LOG_NOTICE, "MAC %s rated at %d kbit/s!", rate_event.token, rate_event.speed);
+        }
+        free(ip);
+    } else {
+
+        debug(LOG_DEBUG, "Cannot rate mac: %s because is no more on client list", rate_event.token);
+        UNLOCK_CLIENT_LIST();
+    }
+}
+
 void
 manage_remote_command(char * remote_command){
 
@@ -216,6 +254,171 @@ wl_down(void) {
     safe_sleep(WAIT_SECONDS);
 }
 
+/**
+* circuit breaker shared by all the requests to wifiLazooo: once too many
+* recent ones failed or were slow it opens, and requests are refused
+* instead of each waiting for its timeout. After cloud_breaker_cooldown
+* seconds a single request is let through to test whether the service
+* is back, which closes the breaker again or keeps it open.
+*/
+static struct {
+    int state;
+    time_t opened;
+    unsigned char failed[WL_BREAKER_WINDOW];
+    int next, samples, failures;
+    unsigned long refused;
+} wl_breaker;
+static pthread_mutex_t wl_breaker_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *wl_breaker_states[] = { "closed", "open", "half-open" };
+
+/**
+* TRUE if a request to wifiLazooo can be made now. Every request allowed
+* must be followed by a wl_breaker_record() of its outcome.
+*/
+int
+wl_breaker_allow(void) {
+
+    s_config *config = config_get_config();
+    int allow = FALSE;
+
+    pthread_mutex_lock(&wl_breaker_mutex);
+    switch(wl_breaker.state) {
+    case WL_BREAKER_CLOSED:
+        allow = TRUE;
+        break;
+    case WL_BREAKER_OPEN:
+        if(time(NULL) - wl_breaker.opened >= config->cloud_breaker_cooldown) {
+            debug(LOG_NOTICE, "Testing whether wifiLazooo is back");
+            wl_breaker.state = WL_BREAKER_HALF_OPEN;
+            allow = TRUE;
+        }
+        break;
+    case WL_BREAKER_HALF_OPEN:
+        /* the test request is in flight */
+        break;
+    }
+    if(!allow)
+        wl_breaker.refused++;
+    pthread_mutex_unlock(&wl_breaker_mutex);
+
+    return allow;
+}
+
+/**
+* TRUE if a long poll can be made now: only while the breaker is closed,
+* as a poll must never hold the single half-open test for its minutes.
+* Its outcome goes to wl_breaker_record_poll().
+*/
+int
+wl_breaker_allow_poll(void) {
+
+    int allow;
+
+    pthread_mutex_lock(&wl_breaker_mutex);
+    allow = wl_breaker.state == WL_BREAKER_CLOSED;
+    pthread_mutex_unlock(&wl_breaker_mutex);
+
+    return allow;
+}
+
+/**
+* TRUE while wifiLazooo is taken for unreachable, that is unless the
+* breaker is closed. Unlike wl_breaker_allow(), this asks for nothing.
+*/
+int
+wl_breaker_open(void) {
+
+    int open;
+
+    pthread_mutex_lock(&wl_breaker_mutex);
+    open = wl_breaker.state != WL_BREAKER_CLOSED;
+    pthread_mutex_unlock(&wl_breaker_mutex);
+
+    return open;
+}
+
+/**
+* count the outcome of a request in the window of a closed breaker.
+* must be called with wl_breaker_mutex held.
+*/
+static void
+wl_breaker_count(int failed) {
+
+    s_config *config = config_get_config();
+
+    wl_breaker.failures += failed - wl_breaker.failed[wl_breaker.next];
+    wl_breaker.failed[wl_breaker.next] = failed;
+    wl_breaker.next = (wl_breaker.next + 1) % WL_BREAKER_WINDOW;
+    if(wl_breaker.samples < WL_BREAKER_WINDOW)
+        wl_breaker.samples++;
+    if(wl_breaker.failures >= WL_BREAKER_MIN_FAILURES &&
+            wl_breaker.failures * 100 >= wl_breaker.samples * WL_BREAKER_FAILURE_PERCENT) {
+        debug(LOG_WARNING, "%d of the last %d requests to wifiLazooo failed, refusing requests for %d seconds",
+              wl_breaker.failures, wl_breaker.samples, config->cloud_breaker_cooldown);
+        wl_breaker.state = WL_BREAKER_OPEN;
+        wl_breaker.opened = time(NULL);
+    }
+}
+
+/**
+* record the outcome of a long poll allowed by wl_breaker_allow_poll();
+* it never decides a half-open test, whatever the state is by now.
+*/
+void
+wl_breaker_record_poll(int ok) {
+
+    pthread_mutex_lock(&wl_breaker_mutex);
+    if(wl_breaker.state == WL_BREAKER_CLOSED)
+        wl_breaker_count(!ok);
+    pthread_mutex_unlock(&wl_breaker_mutex);
+}
+
+/**
+* record the outcome of an allowed request, failed unless ok, and how
+* long it took.
+*/
+void
+wl_breaker_record(int ok, long msecs) {
+
+    s_config *config = config_get_config();
+    int failed = !ok || msecs > config->cloud_slow_request;
+
+    pthread_mutex_lock(&wl_breaker_mutex);
+    if(wl_breaker.state == WL_BREAKER_HALF_OPEN) {
+        if(failed) {
+            debug(LOG_WARNING, "WifiLazooo still unreachable, refusing requests for %d seconds", config->cloud_breaker_cooldown);
+            wl_breaker.state = WL_BREAKER_OPEN;
+            wl_breaker.opened = time(NULL);
+        } else {
+            debug(LOG_NOTICE, "WifiLazooo is back");
+            wl_breaker.state = WL_BREAKER_CLOSED;
+            memset(wl_breaker.failed, 0, sizeof(wl_breaker.failed));
+            wl_breaker.next = wl_breaker.samples = wl_breaker.failures = 0;
+        }
+    } else if(wl_breaker.state == WL_BREAKER_CLOSED) {
+        wl_breaker_count(failed);
+    }
+    /* outcomes of requests allowed before the breaker opened don't matter */
+    pthread_mutex_unlock(&wl_breaker_mutex);
+}
+
+/**
+* breaker state as a status line, caller must free.
+*/
+char *
+wl_breaker_text(void) {
+
+    char *text;
+
+    pthread_mutex_lock(&wl_breaker_mutex);
+    safe_asprintf(&text, "Cloud breaker: %s; %d of the last %d requests failed; %lu refused\n",
+                  wl_breaker_states[wl_breaker.state], wl_breaker.failures, wl_breaker.samples, wl_breaker.refused);
+    pthread_mutex_unlock(&wl_breaker_mutex);
+
+    return text;
+}
+
 static size_t read_callback(void *ptr, size_t size, size_t nmemb, void *userp) {
 
   struct WriteThis *pooh = (struct WriteThis *)userp;
@@ -236,6 +439,8 @@ wl_post(const char *url, char *json){
     CURL *curl;
     CURLcode res;
     char *data;
+    long code = 0;
+    double secs = 0;
 
 
     struct WriteThis pooh;
@@ -286,7 +491,14 @@ wl_post(const char *url, char *json){
         curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, pooh.sizeleft);
 
         /* Perform the request, res will get the return code */ 
-        res = curl_easy_perform(curl);
+        if(wl_breaker_allow()) {
+            res = curl_easy_perform(curl);
+            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+            curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &secs);
+            wl_breaker_record(res == CURLE_OK && code < 500, (long) (secs * 1000));
+        } else {
+            res = CURLE_COULDNT_CONNECT;
+        }
         /* Check for errors */ 
         if(res != CURLE_OK)
             debug(LOG_NOTICE, "During the post made at: %s, server returned: %s", url, curl_easy_strerror(res));
@@ -300,13 +512,15 @@ wl_post(const char *url, char *json){
 }
 
 char *
-wl_request(const char *url) {
+wl_request(const char *url, int long_poll) {
     CURL *curl = NULL; 
     
     CURLcode status;
     struct curl_slist *headers = NULL;
     char *data = NULL;
     long code;
+    double connect_secs, secs;
+    int ok;
 
     curl = curl_easy_init();
     if(!curl)
@@ -334,7 +548,25 @@ wl_request(const char *url) {
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_response);
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, &write_result);
 
+    if(!(long_poll ? wl_breaker_allow_poll() : wl_breaker_allow())){
+        debug(LOG_DEBUG, "WifiLazooo unreachable, not making the request at: %s", url);
+        safe_sleep(WAIT_SECONDS);
+        goto error;
+    }
+
     status = curl_easy_perform(curl);
+    code = connect_secs = secs = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME, &connect_secs);
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &secs);
+    if(long_poll) {
+        /* a long poll timing out is no sign of trouble, if it got connected at all */
+        ok = (status == CURLE_OK || (status == CURLE_OPERATION_TIMEDOUT && connect_secs > 0)) && code < 500;
+        wl_breaker_record_poll(ok);
+    } else {
+        wl_breaker_record(status == CURLE_OK && code < 500, (long) (secs * 1000));
+    }
+
     if(status == CURLE_OPERATION_TIMEDOUT){
     	debug(LOG_DEBUG, "Timeout reached during the request made at: %s", url);
         goto error;
@@ -344,7 +576,6 @@ wl_request(const char *url) {
         goto error;
     }
 
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
     if(code != 200){
         debug(LOG_DEBUG, "During the request made at: %s, server returned code: %d", url, code);
         last_req_code = code;
@@ -389,116 +620,370 @@ user_inactive(char *user_token, int inactive_seconds) {
     free(url);
 }
 
-int
-can_mac_connects(char *mac){
-
-    s_config *config = config_get_config();
-    CURL *curl = NULL;
-    char *data = NULL;
-    CURLcode status;
-    struct curl_slist *headers = NULL;
-    long code;
+/**
+* a cannavigate request, queued for the admission thread by
+* can_mac_connects_async().
+*/
+struct admission {
+    CURL *curl;
     char *url;
+    char *mac;
+    struct curl_slist *headers;
+    struct admission *next;
+};
 
-    curl = curl_easy_init();
-    if(!curl)
-        return FALSE;
+/**
+* a caller of can_mac_connects_async() waiting for an answer.
+*/
+struct admission_waiter {
+    wl_admission_cb cb;
+    void *arg;
+    struct admission_waiter *next;
+};
 
-    data = malloc(BUFFER_SIZE);
-    if(!data)
-        return FALSE;
+/**
+* the last cannavigate answer for a mac, or the request in flight for it
+* with everyone waiting for its answer.
+*/
+struct admission_entry {
+    char *mac;
+    int pending;
+    int allowed;
+    time_t expires;
+    struct admission_waiter *waiters;
+    struct admission_entry *next;
+};
 
-    struct write_result write_result = {
-        .data = data,
-        .pos = 0
-    };
+/* Requests waiting to be added to the admission thread's multi handle */
+static struct admission *admission_queue = NULL;
+/* Cached answers and requests in flight, by mac */
+static struct admission_entry *admission_cache = NULL;
+static unsigned long admission_hits = 0, admission_misses = 0, admission_coalesced = 0;
+static pthread_mutex_t admission_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Written to wake the admission thread up, -1 until it runs */
+static int admission_wake = -1;
 
-    safe_asprintf(&url, "%s/api/v1/business/from/ap/%s/user/mac/%s/cannavigate", config->remote_auth_action, UUID, mac);
-    curl_easy_setopt(curl, CURLOPT_URL, url);
-    /* put a two seconds timeout */
-    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 4);
+static size_t
+write_discard(void *ptr, size_t size, size_t nmemb, void *stream) {
+    return size * nmemb;
+}
+
+static struct admission *
+admission_new(const char *mac) {
+
+    s_config *config = config_get_config();
+    struct admission *admission;
+
+    admission = safe_malloc(sizeof(struct admission));
+    memset(admission, 0, sizeof(struct admission));
+    admission->curl = curl_easy_init();
+    if(!admission->curl) {
+        free(admission);
+        return NULL;
+    }
+
+    admission->mac = safe_strdup(mac);
+    safe_asprintf(&admission->url, "%s/api/v1/business/from/ap/%s/user/mac/%s/cannavigate", config->remote_auth_action, UUID, mac);
+    curl_easy_setopt(admission->curl, CURLOPT_URL, admission->url);
+    /* put a four seconds timeout */
+    curl_easy_setopt(admission->curl, CURLOPT_TIMEOUT, 4L);
+    /* no SIGALRM for the timeout, we are not alone in this process */
+    curl_easy_setopt(admission->curl, CURLOPT_NOSIGNAL, 1L);
 
     /* pass a User-Agent header to wifiLazooo service */
-    headers = curl_slist_append(headers, "User-Agent: wifiLazooo-router-cannavigate");
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    admission->headers = curl_slist_append(admission->headers, "User-Agent: wifiLazooo-router-cannavigate");
+    curl_easy_setopt(admission->curl, CURLOPT_HTTPHEADER, admission->headers);
 
     /*######### TODO: REMEMBER --> for development use only! ########*/
     /* in a normal behaviour we need to check here the authenticity of the server */
-    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, FALSE);
+    curl_easy_setopt(admission->curl, CURLOPT_SSL_VERIFYPEER, FALSE);
 
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_response);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &write_result);
+    /* only the response code matters */
+    curl_easy_setopt(admission->curl, CURLOPT_WRITEFUNCTION, write_discard);
+    curl_easy_setopt(admission->curl, CURLOPT_PRIVATE, admission);
 
-    status = curl_easy_perform(curl);
-    if(status != 0) {
-        debug(LOG_DEBUG, "Unable to contact wifiLazooo during the cannavigate request made at: %s", url);
-        if(url)
-        	free(url);
-    	if(data)
-        	free(data);
-    	if(curl)
-        	curl_easy_cleanup(curl);
-    	if(headers)
-        	curl_slist_free_all(headers);
-        return FALSE;
+    return admission;
+}
+
+static void
+admission_free(struct admission *admission) {
+    curl_easy_cleanup(admission->curl);
+    curl_slist_free_all(admission->headers);
+    free(admission->url);
+    free(admission->mac);
+    free(admission);
+}
+
+/**
+* find the cache entry of mac, dropping the expired ones on the way.
+* must be called with admission_mutex held.
+*/
+static struct admission_entry *
+admission_find(const char *mac, time_t now) {
+
+    struct admission_entry *entry, **prev, *found = NULL;
+
+    prev = &admission_cache;
+    while((entry = *prev) != NULL) {
+        if(!entry->pending && entry->expires <= now) {
+            *prev = entry->next;
+            free(entry->mac);
+            free(entry);
+            continue;
+        }
+        if(!strcasecmp(entry->mac, mac))
+            found = entry;
+        prev = &entry->next;
+    }
+    return found;
+}
+
+/**
+* cache the answer to a finished request and pass it to its waiters.
+*/
+static void
+admission_done(struct admission *admission, int allowed) {
+
+    s_config *config = config_get_config();
+    struct admission_entry *entry;
+    struct admission_waiter *waiter, *next = NULL;
+
+    pthread_mutex_lock(&admission_mutex);
+    for(entry = admission_cache; entry != NULL; entry = entry->next) {
+        if(entry->pending && !strcasecmp(entry->mac, admission->mac)) {
+            entry->pending = FALSE;
+            entry->allowed = allowed;
+            if(allowed == WL_UNAVAILABLE) {
+                /* not an answer: expired at once, the breaker fails fast meanwhile */
+                entry->expires = time(NULL);
+            } else {
+                entry->expires = time(NULL) + (allowed == TRUE ? config->admission_cache_time : config->admission_negative_cache_time);
+            }
+            next = entry->waiters;
+            entry->waiters = NULL;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&admission_mutex);
+
+    for(waiter = next; waiter != NULL; waiter = next) {
+        next = waiter->next;
+        waiter->cb(allowed, waiter->arg);
+        free(waiter);
+    }
+}
+
+/**
+* TRUE if the finished cannavigate request let the mac navigate,
+* WL_UNAVAILABLE if wifiLazooo could not answer.
+*/
+static int
+admission_allowed(struct admission *admission, CURLcode status) {
+
+    long code = 0;
+    double secs = 0;
+
+    curl_easy_getinfo(admission->curl, CURLINFO_RESPONSE_CODE, &code);
+    curl_easy_getinfo(admission->curl, CURLINFO_TOTAL_TIME, &secs);
+    wl_breaker_record(status == CURLE_OK && code < 500, (long) (secs * 1000));
+
+    if(status != CURLE_OK) {
+        debug(LOG_DEBUG, "Unable to contact wifiLazooo during the cannavigate request made at: %s", admission->url);
+        return WL_UNAVAILABLE;
     }
 
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
     if(code != 200) {
-        debug(LOG_DEBUG, "During the cannavigate request made at: %s, server returned code: %d", url, code);
-        if(url)
-        	free(url);
-    	if(data)
-        	free(data);
-    	if(curl)
-        	curl_easy_cleanup(curl);
-    	if(headers)
-        	curl_slist_free_all(headers);
-        return FALSE;
+        debug(LOG_DEBUG, "During the cannavigate request made at: %s, server returned code: %ld", admission->url, code);
+        return code < 500 ? FALSE : WL_UNAVAILABLE;
     }
-    if(url)
-        free(url);
-    if(data)
-        free(data);
-    if(curl)
-        curl_easy_cleanup(curl);
-    if(headers)
-        curl_slist_free_all(headers);
     return TRUE;
 }
 
+/**
+* ask wifiLazooo whether mac can navigate without waiting for the answer.
+* cb is called with it right away if it is cached, otherwise from the
+* admission thread; callers asking about a mac already being asked about
+* share the one request.
+* Returns 0, or -1 if the request could not be queued; cb is then never called.
+*/
+int
+can_mac_connects_async(const char *mac, wl_admission_cb cb, void *arg){
+
+    struct admission *admission;
+    struct admission_entry *entry;
+    struct admission_waiter *waiter;
+    int wake, allowed;
+
+    pthread_mutex_lock(&admission_mutex);
+    wake = admission_wake;
+    if(wake < 0) {
+        pthread_mutex_unlock(&admission_mutex);
+        debug(LOG_WARNING, "Admission thread not running, cannot ask whether %s can navigate", mac);
+        return -1;
+    }
+
+    entry = admission_find(mac, time(NULL));
+    if(entry && !entry->pending) {
+        admission_hits++;
+        allowed = entry->allowed;
+        pthread_mutex_unlock(&admission_mutex);
+        debug(LOG_DEBUG, "Cached cannavigate answer for %s: %d", mac, allowed);
+        cb(allowed, arg);
+        return 0;
+    }
+
+    waiter = safe_malloc(sizeof(struct admission_waiter));
+    waiter->cb = cb;
+    waiter->arg = arg;
+
+    if(entry) {
+        admission_coalesced++;
+        waiter->next = entry->waiters;
+        entry->waiters = waiter;
+        pthread_mutex_unlock(&admission_mutex);
+        debug(LOG_DEBUG, "Waiting for the cannavigate request in flight for %s", mac);
+        return 0;
+    }
+
+    if(!wl_breaker_allow()) {
+        pthread_mutex_unlock(&admission_mutex);
+        free(waiter);
+        debug(LOG_DEBUG, "WifiLazooo unreachable, not asking whether %s can navigate", mac);
+        cb(WL_UNAVAILABLE, arg);
+        return 0;
+    }
+
+    admission = admission_new(mac);
+    if(!admission) {
+        pthread_mutex_unlock(&admission_mutex);
+        free(waiter);
+        wl_breaker_record(FALSE, 0);
+        return -1;
+    }
 
+    admission_misses++;
+    entry = safe_malloc(sizeof(struct admission_entry));
+    memset(entry, 0, sizeof(struct admission_entry));
+    entry->mac = safe_strdup(mac);
+    entry->pending = TRUE;
+    waiter->next = NULL;
+    entry->waiters = waiter;
+    entry->next = admission_cache;
+    admission_cache = entry;
+
+    admission->next = admission_queue;
+    admission_queue = admission;
+    pthread_mutex_unlock(&admission_mutex);
+
+    /* a full pipe already wakes the thread up */
+    if(write(wake, "", 1) < 0 && errno != EAGAIN) {
+        debug(LOG_ERR, "Could not wake the admission thread up: %s", strerror(errno));
+    }
+    return 0;
+}
+
+/**
+* forget the cached answer for mac, so the next request asks again.
+*/
 void
-_allow_white_ip(char * host){
+wl_admission_forget(const char *mac) {
 
-	char *ip1;
-	condense_alpha_str(host);
-	ip1 = hostname_to_ip(host);
+    struct admission_entry *entry;
 
-	debug(LOG_NOTICE, "Allowing  ip %s for host %s",  ip1, host);
+    pthread_mutex_lock(&admission_mutex);
+    if((entry = admission_find(mac, time(NULL))) != NULL && !entry->pending)
+        entry->expires = 0;
+    pthread_mutex_unlock(&admission_mutex);
+}
 
-	if(ip1 != NULL && strlen(ip1) >= 4){
+/**
+* admission cache counters as a status line, caller must free.
+*/
+char *
+wl_admission_text(void) {
+
+    struct admission_entry *entry;
+    char *text;
+    int cached = 0, pending = 0;
+
+    pthread_mutex_lock(&admission_mutex);
+    /* drop the expired entries first */
+    admission_find("", time(NULL));
+    for(entry = admission_cache; entry != NULL; entry = entry->next) {
+        if(entry->pending)
+            pending++;
+        else
+            cached++;
+    }
+    safe_asprintf(&text, "Admission cache: %lu hits, %lu misses, %lu coalesced; %d cached, %d in flight\n",
+                  admission_hits, admission_misses, admission_coalesced, cached, pending);
+    pthread_mutex_unlock(&admission_mutex);
 
-	//	iptables_do_command("-t nat -A " CHAIN_OUTGOING " -d %s -p tcp --dport 443 -j ACCEPT", ip1);
-	//	iptables_do_command("-t filter -A " CHAIN_TO_INTERNET " -d %s -p tcp --dport 443 -j ACCEPT", ip1);
-	}
+    return text;
 }
 
+/**
+* admission thread: drives all the cannavigate requests queued by
+* can_mac_connects_async() on one curl multi handle, so that a slow
+* answer never holds up the HTTP server.
+*/
 void
-allow_white_ips(){
-    
-    FILE *file = fopen(HOSTS_FILE_PATH, "r");
-    if ( file != NULL ) {
-      char line [ 256 ];
-      while ( fgets ( line, sizeof line, file ) != NULL ) {
+thread_wl_admission(const void *arg){
 
-         _allow_white_ip(line);
-      }
-      fclose ( file );
+    CURLM *multi;
+    CURLMsg *msg;
+    CURLcode status;
+    struct admission *admission, *next;
+    struct curl_waitfd waitfd;
+    int fds[2], running, left;
+    char drain[64];
+
+    multi = curl_multi_init();
+    if(!multi || pipe(fds) < 0) {
+        debug(LOG_ERR, "Could not start the admission thread: %s", strerror(errno));
+        return;
     }
-    else {
-        debug(LOG_NOTICE, "Cannot find UUID file located at: %s", HOSTS_FILE_PATH);
-        termination_handler(0);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+
+    pthread_mutex_lock(&admission_mutex);
+    admission_wake = fds[1];
+    pthread_mutex_unlock(&admission_mutex);
+
+    debug(LOG_NOTICE, "Admission thread started");
+
+    waitfd.fd = fds[0];
+    waitfd.events = CURL_WAIT_POLLIN;
+
+    while(1) {
+
+        pthread_mutex_lock(&admission_mutex);
+        admission = admission_queue;
+        admission_queue = NULL;
+        pthread_mutex_unlock(&admission_mutex);
+
+        for(; admission != NULL; admission = next) {
+            next = admission->next;
+            curl_multi_add_handle(multi, admission->curl);
+        }
+
+        curl_multi_perform(multi, &running);
+
+        while((msg = curl_multi_info_read(multi, &left)) != NULL) {
+            if(msg->msg != CURLMSG_DONE)
+                continue;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **) &admission);
+            status = msg->data.result;
+            curl_multi_remove_handle(multi, admission->curl);
+            admission_done(admission, admission_allowed(admission, status));
+            admission_free(admission);
+        }
+
+        waitfd.revents = 0;
+        curl_multi_wait(multi, &waitfd, 1, 1000, NULL);
+        if(waitfd.revents) {
+            while(read(fds[0], drain, sizeof(drain)) > 0) {}
+        }
     }
 }
 
@@ -532,10 +1017,8 @@ void
 wl_init(void) {
 
     s_config *config = config_get_config();
-	
-    debug(LOG_NOTICE, "Initializing libcurl.");
-    curl_global_init(CURL_GLOBAL_DEFAULT);
-    
+
+    /* libcurl was initialized by main_loop(), before any thread used it */
     debug(LOG_NOTICE, "Initializing wifiLazooo poller.");
 
     size_t i;
@@ -547,7 +1030,7 @@ wl_init(void) {
     }
 
     debug(LOG_NOTICE, "Starting wifiLazooo service with UUID: %s", UUID);
-    json_t *root, *data, *event, *token, *seconds, *speed, *type;
+    json_t *root, *data, *event, *token, *seconds, *speed, *type, *plan;
     json_error_t error;
 
     while(1) {
@@ -557,7 +1040,7 @@ wl_init(void) {
             safe_asprintf(&url_register, "%s/api/v1/business/from/ap/%s/register", config->remote_auth_action, UUID);
             wl_ap_token = NULL;
             debug(LOG_NOTICE, "Making a request to wifilazooo api for the ap registration.");
-            text = wl_request(url_register);
+            text = wl_request(url_register, FALSE);
             if (text != NULL) {
 		debug(LOG_DEBUG, "text returned by wifilazooo registration is not null: %s", text);
                 root = json_loads(text, 0, &error);
@@ -590,7 +1073,7 @@ wl_init(void) {
 
             debug(LOG_DEBUG, "Making a request to wifilazooo api for new events.");
             safe_asprintf(&url_events, "%s/api/v1/business/from/ap/events?tokenAP=%s", config->remote_auth_action, wl_ap_token);
-            text = wl_request(url_events);
+            text = wl_request(url_events, TRUE);
             if (text != NULL) {
 
                 root = json_loads(text, 0, &error);
@@ -637,11 +1120,14 @@ wl_init(void) {
                                         debug(LOG_DEBUG, "Cannot find 'allowedBW' on event");
                                         //break;
                                     }
+                                    /* optional TrafficControlPlan of the user */
+                                    plan = json_object_get(event, "plan");
                                     EVENT event_connect = {
                                                     .token = json_string_value(token),
                                                     .type = (int)json_number_value(type),
                                                     .seconds = (int)json_number_value(seconds),
-                                                    .speed = (int)json_number_value(speed)
+                                                    .speed = (int)json_number_value(speed),
+                                                    .plan = json_is_string(plan) ? json_string_value(plan) : NULL
                                                 };
                                     manage_connect(event_connect);
                                 } 
@@ -665,6 +1151,32 @@ wl_init(void) {
                                     manage_disconnect(event_disconnect);
                                 }
 
+                                else if (((int)json_number_value(type)) == EVENT_RATE){
+
+                                    /* Rate change */
+                                    debug(LOG_DEBUG, "Captured a new RATE event");
+
+                                    token = json_object_get(event, "userToken");
+                                    if(!json_is_string(token)){
+
+                                        debug(LOG_DEBUG, "Cannot find 'userToken' on event");
+                                        break;
+                                    }
+                                    speed = json_object_get(event, "allowedBW");
+                                    if(!json_is_integer(speed) || json_number_value(speed) < 0){
+
+                                        debug(LOG_DEBUG, "Cannot find 'allowedBW' on event");
+                                        break;
+                                    }
+
+                                    EVENT event_rate = {
+                                                    .token = json_string_value(token),
+                                                    .type = (int)json_number_value(type),
+                                                    .speed = (int)json_number_value(speed)
+                                                };
+                                    manage_rate(event_rate);
+                                }
+
                                 else if (((int)json_number_value(type)) == EVENT_UPGRADE){
 
                                     /* UPGRADE */
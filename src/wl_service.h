@@ -48,13 +48,37 @@
 #define EVENT_DISCONNECT 0
 #define EVENT_UPGRADE -2
 #define EVENT_COMMAND -1
+#define EVENT_RATE 2
+
+/* can_mac_connects_async() answer while wifiLazooo cannot be reached */
+#define WL_UNAVAILABLE -1
+
+#define WL_BREAKER_CLOSED 0
+#define WL_BREAKER_OPEN 1
+#define WL_BREAKER_HALF_OPEN 2
+/* the breaker opens on WL_BREAKER_FAILURE_PERCENT failures of the last
+   WL_BREAKER_WINDOW requests, and at least WL_BREAKER_MIN_FAILURES */
+#define WL_BREAKER_WINDOW 20
+#define WL_BREAKER_MIN_FAILURES 5
+#define WL_BREAKER_FAILURE_PERCENT 50
     
 extern int wl_current_status;
 extern char* wl_ap_id;
 extern char* UUID;
 
-void allow_white_ips();
+/** @brief Called with the answer of can_mac_connects_async() */
+typedef void (*wl_admission_cb)(int allowed, void *arg);
+
 void wl_init(void);
 void user_inactive(char *user_token, int inactive_seconds);
-int can_mac_connects(char *mac);
+int can_mac_connects_async(const char *mac, wl_admission_cb cb, void *arg);
+void thread_wl_admission(const void *arg);
+void wl_admission_forget(const char *mac);
+int wl_breaker_allow(void);
+void wl_breaker_record(int ok, long msecs);
+int wl_breaker_allow_poll(void);
+int wl_breaker_open(void);
+void wl_breaker_record_poll(int ok);
+char *wl_breaker_text(void);
+char *wl_admission_text(void);
 char * get_ap_UUID();
\ No newline at end of file